@@ -0,0 +1,370 @@
+#include "ChangeJournal.h"
+#include "DirectoryWatcherInternal.h"
+
+typedef DirectoryWatcher::EMemoryTag EMemoryTag;
+
+// FNV-1a. It only has to catch records that were cut off or never made it to disk, not tampering.
+static u32 Checksum(const u8* data, s32 size)
+{
+    u32 hash = 2166136261u;
+    for (s32 i = 0; i < size; ++i) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+static const s32 ChecksumOffset = 8; // Everything after record_size and checksum.
+
+static s32 WriteHex(char16_t* out, u64 value)
+{
+    for (s32 i = 15; i >= 0; --i, value >>= 4) out[i] = u"0123456789abcdef"[value & 15];
+    return 16;
+}
+
+bool ChangeJournal::Open(const char* in_directory, u64 in_instance_id, u64 in_start_time, u64 in_segment_size, const DirectoryWatcher::Allocator* in_allocator)
+{
+    allocator = in_allocator;
+    instance_id = in_instance_id;
+    start_time = in_start_time;
+    segment_size = (in_segment_size < MaxSegmentSize) ? in_segment_size : MaxSegmentSize;
+
+    // Leave room for the segment name (34 characters) and a separator.
+    directory_length = MultiByteToWideChar(CP_UTF8, 0, in_directory, -1, (LPWSTR)directory, MAX_PATH - 40) - 1;
+    if (directory_length <= 0) return false;
+    if (directory[directory_length - 1] == u'\\' || directory[directory_length - 1] == u'/') directory[--directory_length] = u'\0';
+    if (!CreateDirectoryW((LPCWSTR)directory, 0) && GetLastError() != ERROR_ALREADY_EXISTS) return false;
+
+    InitializeSRWLock(&write_lock);
+    work = CreateThreadpoolWork((PTP_WORK_CALLBACK)ChangeJournal::FlushWorkProc, this, 0);
+    return work != 0;
+}
+
+void ChangeJournal::Append(const DirectoryWatcher::FileChange& change)
+{
+    s32 path_length = (change.path_length > 0) ? change.path_length : 0;
+    s32 record_size = (s32)((sizeof(Record) + path_length + 7) & ~7);
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+
+    // NOTE: The allocator is pluggable and may take its time, so the bigger buffer is allocated with the lock let go.
+    // Flush() or another Append() may have changed the pending buffer in the meantime, so look again before using it.
+    u8* spare = 0;
+    s32 spare_capacity = 0;
+    for (;;)
+    {
+        lock.Lock();
+        s32 needed = pending_count + record_size;
+        if (needed <= pending_capacity) break;
+        if (needed <= spare_capacity)
+        {
+            // No realloc() in the allocator interface, so copy by hand. The old buffer gets freed once we're done.
+            if (pending_count) CopyMemory(spare, pending, pending_count);
+            u8* old_pending = pending;
+            s32 old_capacity = pending_capacity;
+            pending = spare;
+            pending_capacity = spare_capacity;
+            spare = old_pending;
+            spare_capacity = old_capacity;
+            break;
+        }
+
+        s32 new_capacity = (pending_capacity) ? pending_capacity * 2 : 65536;
+        while (new_capacity < needed) new_capacity *= 2;
+        lock.Unlock();
+        if (spare) Free(allocator, spare, EMemoryTag::Journal);
+        spare = (u8*)Allocate(allocator, new_capacity, EMemoryTag::Journal);
+        spare_capacity = new_capacity;
+    }
+
+    Record* record = (Record*)(pending + pending_count);
+    record->record_size = record_size;
+    record->sequence = change.sequence;
+    record->root_sequence = change.root_sequence;
+    record->time = ((u64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    record->creation_time = change.creation_time;
+    record->modification_time = change.modification_time;
+    record->change_time = change.change_time;
+    record->access_time = change.access_time;
+    record->size = change.size;
+    record->attributes = change.attributes;
+    record->path_length = (u16)path_length;
+    record->action = (u8)change.action;
+    record->is_directory = change.is_directory;
+    u8* path = (u8*)(record + 1);
+    CopyMemory(path, change.path, path_length);
+    for (s32 i = (s32)sizeof(Record) + path_length; i < record_size; ++i) ((u8*)record)[i] = 0;
+    record->checksum = Checksum((u8*)record + ChecksumOffset, (s32)sizeof(Record) - ChecksumOffset + path_length);
+    pending_count += record_size;
+    lock.Unlock();
+    if (spare) Free(allocator, spare, EMemoryTag::Journal);
+
+    if (InterlockedExchange((LPLONG)&is_work_queued, 1) == 0) SubmitThreadpoolWork(work);
+}
+
+void __stdcall ChangeJournal::FlushWorkProc(void* instance, void* arg, void* work)
+{
+    // Clear the flag first, so anything appended while we're writing queues up another flush.
+    ChangeJournal* journal = (ChangeJournal*)arg;
+    InterlockedExchange((LPLONG)&journal->is_work_queued, 0);
+    journal->Flush();
+}
+
+void ChangeJournal::Flush()
+{
+    AcquireSRWLockExclusive(&write_lock);
+
+    // Swap buffers, so Append() can carry on while we're on the disk.
+    lock.Lock();
+    u8* data = pending;
+    s32 data_capacity = pending_capacity;
+    s32 data_count = pending_count;
+    pending = writing;
+    pending_capacity = writing_capacity;
+    pending_count = 0;
+    writing = data;
+    writing_capacity = data_capacity;
+    lock.Unlock();
+
+    // Usually this is one write, unless the segment fills up partway through.
+    s32 offset = 0;
+    s32 run_start = 0;
+    while (offset < data_count)
+    {
+        const Record* record = (const Record*)(data + offset);
+        u64 segment_used = segment_bytes + (offset - run_start);
+        bool is_segment_full = segment && segment_used + record->record_size > segment_size && segment_used > sizeof(SegmentHeader);
+        if (!segment || is_segment_full)
+        {
+            Write(data + run_start, offset - run_start);
+            run_start = offset;
+            if (!StartSegment(record->sequence))
+            {
+                // Drop the rest, there's nowhere to put it. The next flush tries again.
+                InterlockedIncrement((LPLONG)&error_count);
+                run_start = offset = data_count;
+                break;
+            }
+        }
+        offset += record->record_size;
+    }
+    Write(data + run_start, offset - run_start);
+
+    ReleaseSRWLockExclusive(&write_lock);
+}
+
+bool ChangeJournal::StartSegment(u64 first_sequence)
+{
+    if (segment) CloseHandle(segment);
+    segment = 0;
+    segment_bytes = 0;
+
+    char16_t path[MAX_PATH];
+    s32 length = directory_length;
+    CopyMemory(path, directory, length * 2);
+    path[length++] = u'\\';
+    length += WriteHex(path + length, start_time);
+    path[length++] = u'-';
+    length += WriteHex(path + length, first_sequence);
+    CopyMemory(path + length, u".dwj", 5 * 2);
+
+    void* file = CreateFileW((LPCWSTR)path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    SegmentHeader header = {Magic, Version, instance_id, first_sequence, start_time};
+    DWORD written = 0;
+    if (!WriteFile(file, &header, sizeof(header), &written, 0) || written != sizeof(header))
+    {
+        CloseHandle(file);
+        return false;
+    }
+    segment = file;
+    segment_bytes = sizeof(header);
+    return true;
+}
+
+void ChangeJournal::Write(const u8* data, s32 size)
+{
+    if (!size || !segment) return;
+    DWORD written = 0;
+    if (!WriteFile(segment, data, size, &written, 0) || (s32)written != size) InterlockedIncrement((LPLONG)&error_count);
+    segment_bytes += written;
+}
+
+void ChangeJournal::Close()
+{
+    if (work)
+    {
+        WaitForThreadpoolWorkCallbacks(work, false);
+        CloseThreadpoolWork(work);
+        work = 0;
+    }
+    Flush();
+    if (segment) CloseHandle(segment);
+    segment = 0;
+    if (pending) Free(allocator, pending, EMemoryTag::Journal);
+    if (writing) Free(allocator, writing, EMemoryTag::Journal);
+    pending = writing = 0;
+    pending_capacity = writing_capacity = pending_count = 0;
+}
+
+bool ChangeJournalReader::Open(const char* segment_path)
+{
+    Close();
+    char16_t path[MAX_PATH];
+    if (MultiByteToWideChar(CP_UTF8, 0, segment_path, -1, (LPWSTR)path, MAX_PATH) <= 0) return false;
+
+    // The writer may still be appending, so share everything.
+    file = CreateFileW((LPCWSTR)path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = 0;
+        return false;
+    }
+    LARGE_INTEGER file_size = {};
+    if (!GetFileSizeEx(file, &file_size) || (u64)file_size.QuadPart < sizeof(ChangeJournal::SegmentHeader))
+    {
+        Close();
+        return false;
+    }
+
+    mapping = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+    view = (mapping) ? (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+    if (!view)
+    {
+        Close();
+        return false;
+    }
+    view_size = (u64)file_size.QuadPart;
+
+    CopyMemory(&header, view, sizeof(header));
+    if (header.magic != ChangeJournal::Magic || header.version != ChangeJournal::Version)
+    {
+        Close();
+        return false;
+    }
+
+    // Index every complete record. A record can't be smaller than its header, which bounds how many there can be.
+    // NOTE: Anything starting past MaxSegmentSize can't have been written by a watcher, and wouldn't fit in an offset.
+    u64 indexed_size = (view_size < ChangeJournal::MaxSegmentSize) ? view_size : ChangeJournal::MaxSegmentSize;
+    u64 max_records = (indexed_size - sizeof(header)) / sizeof(ChangeJournal::Record);
+    record_offsets = (u32*)Allocate(allocator, (size_t)(max_records + 1) * sizeof(u32), EMemoryTag::Journal);
+    u64 offset = sizeof(header);
+    while (offset + sizeof(ChangeJournal::Record) <= indexed_size)
+    {
+        const ChangeJournal::Record* record = (const ChangeJournal::Record*)(view + offset);
+        bool is_valid = record->record_size >= sizeof(ChangeJournal::Record) && offset + record->record_size <= view_size &&
+                        sizeof(ChangeJournal::Record) + record->path_length <= record->record_size &&
+                        record->checksum == Checksum((const u8*)record + ChecksumOffset, (s32)sizeof(ChangeJournal::Record) - ChecksumOffset + record->path_length);
+        if (!is_valid) break;
+        record_offsets[record_count++] = (u32)offset;
+        offset += record->record_size;
+    }
+    next_record = 0;
+    return true;
+}
+
+void ChangeJournalReader::Close()
+{
+    if (record_offsets) Free(allocator, record_offsets, EMemoryTag::Journal);
+    if (view) UnmapViewOfFile(view);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    record_offsets = 0;
+    view = 0;
+    mapping = 0;
+    file = 0;
+    view_size = 0;
+    record_count = 0;
+    next_record = 0;
+}
+
+bool ChangeJournalReader::Seek(u64 sequence)
+{
+    // Sequences in a segment are consecutive unless a write failed, so this usually finds it on the first try.
+    s32 low = 0;
+    s32 high = record_count - 1;
+    s32 guess = (sequence >= header.first_sequence && sequence - header.first_sequence < (u64)record_count) ? (s32)(sequence - header.first_sequence) : -1;
+    while (low <= high)
+    {
+        s32 middle = (guess >= 0) ? guess : low + (high - low) / 2;
+        guess = -1;
+        u64 middle_sequence = ((const ChangeJournal::Record*)(view + record_offsets[middle]))->sequence;
+        if (middle_sequence == sequence)
+        {
+            next_record = middle;
+            return true;
+        }
+        if (middle_sequence < sequence) low = middle + 1;
+        else high = middle - 1;
+    }
+    return false;
+}
+
+bool ChangeJournalReader::Next(DirectoryWatcher::FileChange* out_change, u64* out_time)
+{
+    assert(out_change);
+    if (next_record >= record_count) return false;
+    const ChangeJournal::Record* record = (const ChangeJournal::Record*)(view + record_offsets[next_record++]);
+
+    *out_change = {};
+    out_change->sequence = record->sequence;
+    out_change->root_sequence = record->root_sequence;
+    out_change->directory_id = -1; // Not journaled, directory ids only mean something to the watcher that handed them out.
+    out_change->creation_time = record->creation_time;
+    out_change->modification_time = record->modification_time;
+    out_change->change_time = record->change_time;
+    out_change->access_time = record->access_time;
+    out_change->size = record->size;
+    out_change->attributes = record->attributes;
+    out_change->action = (DirectoryWatcher::EFileAction)record->action;
+    out_change->is_directory = record->is_directory;
+
+    // A journal written by a build with longer paths gets cut short, rather than overflowing.
+    s32 path_length = record->path_length;
+    if (path_length > DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1) path_length = DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1;
+    CopyMemory(out_change->path, record + 1, path_length);
+    out_change->path[path_length] = '\0';
+    out_change->path_length = path_length;
+    if (out_time) *out_time = record->time;
+    return true;
+}
+
+bool ChangeJournalReader::FindSegment(const char* directory, u64 instance_id, u64 sequence, char* out_path, s32 out_path_size)
+{
+    char16_t pattern[MAX_PATH];
+    s32 directory_length = MultiByteToWideChar(CP_UTF8, 0, directory, -1, (LPWSTR)pattern, MAX_PATH - 40) - 1;
+    if (directory_length <= 0) return false;
+    if (pattern[directory_length - 1] != u'\\' && pattern[directory_length - 1] != u'/') pattern[directory_length++] = u'\\';
+    CopyMemory(pattern + directory_length, u"*.dwj", 6 * 2);
+
+    WIN32_FIND_DATAW find_data;
+    HANDLE find_handle = FindFirstFileExW((LPCWSTR)pattern, FindExInfoBasic, &find_data, FindExSearchNameMatch, 0, 0);
+    if (find_handle == INVALID_HANDLE_VALUE) return false;
+
+    // The name says when the segment starts, but only the header says which instance wrote it.
+    bool did_find = false;
+    u64 best_sequence = 0;
+    do
+    {
+        char16_t path[MAX_PATH];
+        s32 name_length = 0;
+        while (find_data.cFileName[name_length]) name_length += 1;
+        if (directory_length + name_length + 1 > MAX_PATH) continue;
+        CopyMemory(path, pattern, directory_length * 2);
+        CopyMemory(path + directory_length, find_data.cFileName, (name_length + 1) * 2);
+
+        HANDLE file = CreateFileW((LPCWSTR)path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE) continue;
+        ChangeJournal::SegmentHeader header = {};
+        DWORD read = 0;
+        bool is_match = ReadFile(file, &header, sizeof(header), &read, 0) && read == sizeof(header) && header.magic == ChangeJournal::Magic &&
+                        header.instance_id == instance_id && header.first_sequence <= sequence && (!did_find || header.first_sequence > best_sequence);
+        CloseHandle(file);
+
+        if (is_match && WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)path, -1, out_path, out_path_size, 0, 0) > 0)
+        {
+            did_find = true;
+            best_sequence = header.first_sequence;
+        }
+    } while (FindNextFileW(find_handle, &find_data));
+    FindClose(find_handle);
+    return did_find;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+/*
+ChangeJournal is an optional append-only log of every change a DirectoryWatcher reports, turned on with
+DirectoryWatcher::Settings::journal_directory. It's meant for auditing, for picking up changes nobody got
+around to reading before a crash, and for looking at change storms after the fact.
+
+The journal is split into segment files, named "<start time>-<first sequence>.dwj" (both as 16 hex digits),
+so sorting the names sorts the segments oldest first. A new segment is started for every watcher instance,
+and whenever the current one grows past Settings::journal_segment_size. Each segment starts with a
+SegmentHeader, followed by Records, each of which is followed by its UTF-8 path and padded to 8 bytes.
+Within a segment the sequence numbers are consecutive, which is what makes seeking cheap.
+
+The watcher thread never touches the disk. Append() encodes the change into a memory buffer and, unless one
+is already queued, queues a thread pool work item. By the time the work item runs, the rest of the burst has
+usually landed in the buffer too, so the work item swaps buffers and writes the whole lot with a single
+WriteFile(). Records are checksummed, so a segment that was cut off partway through a write (the process
+crashed, the machine lost power) is still readable up to the last complete record.
+
+ChangeJournalReader maps a segment into memory, indexes where each record starts, and can then seek to any
+sequence number in it directly. It only sees what was in the file when it was opened.
+*/
+
+#include "DirectoryWatcher.h"
+
+struct ChangeJournal
+{
+    static const u32 Magic = 0x314A5744; // "DWJ1"
+    static const u32 Version = 1;
+    static const u64 MaxSegmentSize = 0xFFFFFFFF; // Readers index records by 32-bit offset, so segments stop short of 4GB.
+
+    struct SegmentHeader
+    {
+        u32 magic;
+        u32 version;
+        u64 instance_id; // DirectoryWatcher::Cursor::instance of the watcher that wrote it.
+        u64 first_sequence;
+        u64 start_time; // FILETIME of the watcher's Initialize().
+    };
+
+    struct Record
+    {
+        u32 record_size; // Including the path and padding.
+        u32 checksum; // Of everything after this field, up to the end of the path.
+        u64 sequence;
+        u64 root_sequence;
+        u64 time; // FILETIME of when the change was reported.
+        u64 creation_time;
+        u64 modification_time;
+        u64 change_time;
+        u64 access_time;
+        u64 size;
+        u32 attributes;
+        u16 path_length;
+        u8 action;
+        u8 is_directory;
+    };
+
+    const DirectoryWatcher::Allocator* allocator = 0;
+    char16_t directory[MAX_PATH] = {};
+    s32 directory_length = 0;
+    u64 instance_id = 0;
+    u64 start_time = 0;
+    u64 segment_size = 0; // Size a segment is allowed to grow to before a new one is started, at most MaxSegmentSize.
+
+    DirectoryWatcher::QueueLock lock; // Guards the pending buffer.
+    u8* pending = 0; // Records waiting to be written.
+    s32 pending_count = 0;
+    s32 pending_capacity = 0;
+    u8* writing = 0; // Swapped with pending by whoever is writing.
+    s32 writing_capacity = 0;
+
+    SRWLOCK write_lock = SRWLOCK_INIT; // Held while writing, so segments are only touched by one thread at a time.
+    void* segment = 0; // File handle, or null if no segment has been started yet.
+    u64 segment_bytes = 0;
+    PTP_WORK work = 0;
+    volatile s32 is_work_queued = 0;
+    volatile s32 error_count = 0;
+
+    // Creates the directory if needed. Segments are only created once there is something to write.
+    bool Open(const char* directory, u64 instance_id, u64 start_time, u64 segment_size, const DirectoryWatcher::Allocator* allocator);
+    // Queues a change to be written. Cheap, and never blocks on the disk.
+    void Append(const DirectoryWatcher::FileChange& change);
+    // Writes whatever is queued, on the calling thread.
+    void Flush();
+    // Writes whatever is still queued, waits for any write in progress, and closes the current segment.
+    void Close();
+
+private:
+
+    bool StartSegment(u64 first_sequence);
+    void Write(const u8* data, s32 size);
+
+    static void __stdcall FlushWorkProc(void* instance, void* arg, void* work);
+};
+
+struct ChangeJournalReader
+{
+    ChangeJournal::SegmentHeader header = {};
+    const DirectoryWatcher::Allocator* allocator = 0; // Null means malloc() and free().
+    void* file = 0;
+    void* mapping = 0;
+    const u8* view = 0;
+    u64 view_size = 0;
+    u32* record_offsets = 0; // Where each complete record starts. Record i usually has sequence header.first_sequence + i.
+    s32 record_count = 0;
+    s32 next_record = 0;
+
+    // Maps a segment and indexes its records. Anything after the first damaged record is ignored.
+    bool Open(const char* segment_path);
+    void Close();
+    // Positions the reader so the next call to Next() returns the change with this sequence. False if it isn't in this segment.
+    bool Seek(u64 sequence);
+    // Gets the next change, and optionally when it was reported. False at the end of the segment.
+    bool Next(DirectoryWatcher::FileChange* out_change, u64* out_time = 0);
+    // Finds the segment in directory that holds the given sequence for the given watcher instance, and writes its path to out_path.
+    static bool FindSegment(const char* directory, u64 instance_id, u64 sequence, char* out_path, s32 out_path_size);
+};
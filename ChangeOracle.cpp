@@ -0,0 +1,385 @@
+#include "ChangeOracle.h"
+#include "DirectoryWatcherInternal.h"
+
+typedef DirectoryWatcher::EFileAction EFileAction;
+
+static u64 HashPath(const char16_t* path, s32 path_length)
+{
+    u64 hash = 14695981039346656037ull;
+    for (s32 i = 0; i < path_length; ++i) hash = (hash ^ (u16)path[i]) * 1099511628211ull;
+    return hash;
+}
+
+// True if path is prefix itself, or something under it. An empty prefix is the root, which everything is under.
+static bool IsUnder(const char16_t* path, s32 path_length, const char16_t* prefix, s32 prefix_length)
+{
+    if (!prefix_length) return true;
+    if (path_length < prefix_length || memcmp(path, prefix, prefix_length * 2)) return false;
+    return path_length == prefix_length || path[prefix_length] == u'\\';
+}
+
+bool ChangeOracle::Open(const char* root_path, bool is_recursive)
+{
+    assert(root_path);
+    root_length = MultiByteToWideChar(CP_UTF8, 0, root_path, -1, (LPWSTR)root, MAX_PATH) - 1;
+    if (root_length <= 0) return false;
+    this->is_recursive = is_recursive;
+    counts = {};
+    totals = {};
+    rename_from_length = -1;
+
+    DirectorySnapshot snapshot;
+    snapshot.allocator = allocator;
+    bool result = snapshot.Scan(root, root_length, is_recursive, 0, false, thread_count);
+    if (result) Load(&snapshot);
+    snapshot.Destroy();
+    return result;
+}
+
+void ChangeOracle::Close()
+{
+    Free(allocator, slots);
+    Free(allocator, paths);
+    Free(allocator, overflowed);
+    slots = 0;
+    paths = 0;
+    overflowed = 0;
+    slot_capacity = used_slot_count = live_slot_count = 0;
+    path_count = path_capacity = 0;
+    overflowed_count = overflowed_capacity = 0;
+    rename_from_length = -1;
+}
+
+void ChangeOracle::Apply(const DirectoryWatcher::FileChange& change)
+{
+    // Turn the full path back into one relative to the root, the way the model and DirectorySnapshot keep them.
+    char16_t full_path[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
+    s32 full_path_length = MultiByteToWideChar(CP_UTF8, 0, change.path, change.path_length, (LPWSTR)full_path, DIRECTORY_WATCHER_MAX_PATH_LENGTH);
+
+    // An empty path (a subscription that overflowed), the root itself or a directory above it all mean that anything
+    // under the root may have changed, even though the path isn't under the root.
+    bool is_whole_root = false;
+    if (change.action == EFileAction::TooManyChanges && full_path_length <= root_length)
+    {
+        is_whole_root = full_path_length <= 0 || (!memcmp(full_path, root, full_path_length * 2) &&
+                        (full_path_length == root_length || full_path[full_path_length - 1] == u'\\' || root[full_path_length] == u'\\'));
+    }
+
+    const char16_t* path = full_path + root_length;
+    s32 path_length = full_path_length - root_length;
+    if (is_whole_root)
+    {
+        path = full_path;
+        path_length = 0;
+    }
+    else
+    {
+        if (full_path_length < root_length || memcmp(full_path, root, root_length * 2))
+        {
+            counts.ignored_count += 1;
+            return;
+        }
+        if (path_length && root[root_length - 1] != u'\\')
+        {
+            // Spelled like the root, but really a sibling of it, like "C:\abc" for "C:\ab".
+            if (*path != u'\\')
+            {
+                counts.ignored_count += 1;
+                return;
+            }
+            path += 1;
+            path_length -= 1;
+        }
+        if (path_length >= MAX_PATH || path_length > 0xFFFF)
+        {
+            counts.ignored_count += 1;
+            return;
+        }
+    }
+    counts.applied_count += 1;
+
+    // A rename is two changes in a row, anything else in between means we lost half of one.
+    if (rename_from_length >= 0 && change.action != EFileAction::RenamedTo)
+    {
+        Report(EDivergence::UnpairedRename, rename_from, rename_from_length);
+        rename_from_length = -1;
+    }
+
+    u64 hash = HashPath(path, path_length);
+    s32 slot_index = Find(path, path_length, hash);
+    switch (change.action)
+    {
+        case EFileAction::Added:
+        {
+            if (slot_index >= 0)
+            {
+                Report(EDivergence::DuplicateAdd, path, path_length);
+                slots[slot_index].is_directory = change.is_directory;
+            }
+            else Insert(path, path_length, change.is_directory, (u8)EFileAction::Added);
+        } break;
+        case EFileAction::Removed:
+        {
+            if (slot_index < 0)
+            {
+                Report(EDivergence::PhantomRemove, path, path_length);
+                break;
+            }
+            if (slots[slot_index].is_directory) RemoveChildren(path, path_length);
+            Remove(slot_index);
+        } break;
+        case EFileAction::Modified:
+        {
+            if (slot_index < 0)
+            {
+                Report(EDivergence::PhantomModify, path, path_length);
+                Insert(path, path_length, change.is_directory, (u8)EFileAction::Modified);
+            }
+        } break;
+        case EFileAction::RenamedFrom:
+        {
+            if (slot_index < 0) Report(EDivergence::PhantomRemove, path, path_length);
+            CopyMemory(rename_from, path, path_length * 2);
+            rename_from_length = path_length;
+        } break;
+        case EFileAction::RenamedTo:
+        {
+            bool is_directory = change.is_directory;
+            if (rename_from_length < 0) Report(EDivergence::UnpairedRename, path, path_length);
+            else
+            {
+                s32 from_index = Find(rename_from, rename_from_length, HashPath(rename_from, rename_from_length));
+                if (from_index >= 0)
+                {
+                    is_directory = slots[from_index].is_directory;
+                    Remove(from_index);
+                }
+            }
+
+            if (slot_index >= 0) Report(EDivergence::DuplicateAdd, path, path_length);
+            else Insert(path, path_length, is_directory, (u8)EFileAction::RenamedTo);
+            // NOTE: Only the directory itself is reported, everything in it moves along silently.
+            if (is_directory && rename_from_length >= 0) MoveChildren(rename_from, rename_from_length, path, path_length);
+            rename_from_length = -1;
+        } break;
+        case EFileAction::TooManyChanges:
+        {
+            counts.overflow_count += 1;
+            overflowed = (Prefix*)GrowArray(allocator, overflowed, &overflowed_capacity, overflowed_count + 1, sizeof(Prefix));
+            paths = (char16_t*)GrowArray(allocator, paths, &path_capacity, path_count + path_length, sizeof(char16_t));
+            CopyMemory(paths + path_count, path, path_length * 2);
+            overflowed[overflowed_count++] = {(u32)path_count, path_length};
+            path_count += path_length;
+        } break;
+        default: break;
+    }
+}
+
+bool ChangeOracle::Verify(Counts* out_counts)
+{
+    DirectorySnapshot snapshot;
+    snapshot.allocator = allocator;
+    if (!snapshot.Scan(root, root_length, is_recursive, 0, false, thread_count))
+    {
+        snapshot.Destroy();
+        return false;
+    }
+
+    // Everything on disk should be in the model...
+    for (s32 i = 0; i < slot_capacity; ++i) slots[i].is_seen = false;
+    char16_t path[MAX_PATH];
+    for (s32 i = 0; i < snapshot.directory_count; ++i)
+    {
+        const DirectorySnapshot::Directory* directory = &snapshot.directories[i];
+        for (s32 j = 0; j < directory->entry_count; ++j)
+        {
+            const DirectorySnapshot::Entry* entry = &snapshot.entries[directory->first_entry + j];
+            s32 path_length = directory->path_length + (directory->path_length ? 1 : 0) + entry->name_length;
+            if (path_length >= MAX_PATH) continue;
+            CopyMemory(path, snapshot.names + directory->path_offset, directory->path_length * 2);
+            if (directory->path_length) path[directory->path_length] = u'\\';
+            CopyMemory(path + path_length - entry->name_length, snapshot.names + entry->name_offset, entry->name_length * 2);
+
+            s32 slot_index = Find(path, path_length, HashPath(path, path_length));
+            if (slot_index < 0) Report(EDivergence::MissedAdd, path, path_length);
+            else slots[slot_index].is_seen = true;
+        }
+    }
+
+    // ...and everything in the model should be on disk.
+    for (s32 i = 0; i < slot_capacity; ++i)
+    {
+        const Slot* slot = &slots[i];
+        if (slot->state != ESlot::Live || slot->is_seen) continue;
+        EDivergence divergence = (slot->origin == (u8)EFileAction::RenamedTo) ? EDivergence::WrongRenameTarget : EDivergence::MissedRemove;
+        Report(divergence, paths + slot->path_offset, slot->path_length);
+    }
+    if (rename_from_length >= 0) Report(EDivergence::UnpairedRename, rename_from, rename_from_length);
+
+    // Start over from what is really there, so one mistake isn't reported again at every Verify().
+    Load(&snapshot);
+    snapshot.Destroy();
+
+    if (out_counts) *out_counts = counts;
+    for (s32 i = 0; i < (s32)EDivergence::Count; ++i) totals.divergences[i] += counts.divergences[i];
+    totals.explained_by_overflow += counts.explained_by_overflow;
+    totals.overflow_count += counts.overflow_count;
+    totals.applied_count += counts.applied_count;
+    totals.ignored_count += counts.ignored_count;
+    counts = {};
+    return true;
+}
+
+void ChangeOracle::Reset()
+{
+    if (slots) ZeroMemory(slots, sizeof(Slot) * slot_capacity);
+    used_slot_count = 0;
+    live_slot_count = 0;
+    path_count = 0;
+    overflowed_count = 0;
+    rename_from_length = -1;
+}
+
+void ChangeOracle::Load(const DirectorySnapshot* snapshot)
+{
+    Reset();
+    char16_t path[MAX_PATH];
+    for (s32 i = 0; i < snapshot->directory_count; ++i)
+    {
+        const DirectorySnapshot::Directory* directory = &snapshot->directories[i];
+        for (s32 j = 0; j < directory->entry_count; ++j)
+        {
+            const DirectorySnapshot::Entry* entry = &snapshot->entries[directory->first_entry + j];
+            s32 path_length = directory->path_length + (directory->path_length ? 1 : 0) + entry->name_length;
+            if (path_length >= MAX_PATH) continue;
+            CopyMemory(path, snapshot->names + directory->path_offset, directory->path_length * 2);
+            if (directory->path_length) path[directory->path_length] = u'\\';
+            CopyMemory(path + path_length - entry->name_length, snapshot->names + entry->name_offset, entry->name_length * 2);
+            Insert(path, path_length, (entry->attributes & FILE_ATTRIBUTE_DIRECTORY) != 0, (u8)EFileAction::None);
+        }
+    }
+}
+
+s32 ChangeOracle::Find(const char16_t* path, s32 path_length, u64 hash) const
+{
+    if (!slot_capacity) return -1;
+    s32 mask = slot_capacity - 1;
+    for (s32 i = (s32)(hash & mask);; i = (i + 1) & mask)
+    {
+        const Slot* slot = &slots[i];
+        if (slot->state == ESlot::Empty) return -1;
+        if (slot->state == ESlot::Live && slot->hash == hash && slot->path_length == path_length &&
+            !memcmp(paths + slot->path_offset, path, path_length * 2)) return i;
+    }
+}
+
+void ChangeOracle::Insert(const char16_t* path, s32 path_length, bool is_directory, u8 origin)
+{
+    // Keep at least a quarter of the slots empty, so probes stay short and always end.
+    if ((used_slot_count + 1) * 4 > slot_capacity * 3) Grow();
+
+    // NOTE: The path can't point into the pool, since growing the pool would move it.
+    paths = (char16_t*)GrowArray(allocator, paths, &path_capacity, path_count + path_length, sizeof(char16_t));
+    CopyMemory(paths + path_count, path, path_length * 2);
+
+    u64 hash = HashPath(path, path_length);
+    s32 mask = slot_capacity - 1;
+    s32 i = (s32)(hash & mask);
+    while (slots[i].state == ESlot::Live) i = (i + 1) & mask;
+    if (slots[i].state == ESlot::Empty) used_slot_count += 1;
+    live_slot_count += 1;
+
+    Slot* slot = &slots[i];
+    slot->hash = hash;
+    slot->path_offset = (u32)path_count;
+    slot->path_length = (u16)path_length;
+    slot->state = ESlot::Live;
+    slot->origin = origin;
+    slot->is_directory = is_directory;
+    slot->is_seen = false;
+    path_count += path_length;
+}
+
+void ChangeOracle::Remove(s32 slot_index)
+{
+    assert(slots[slot_index].state == ESlot::Live);
+    slots[slot_index].state = ESlot::Dead;
+    live_slot_count -= 1;
+}
+
+void ChangeOracle::RemoveChildren(const char16_t* path, s32 path_length)
+{
+    for (s32 i = 0; i < slot_capacity; ++i)
+    {
+        const Slot* slot = &slots[i];
+        if (slot->state == ESlot::Live && slot->path_length > path_length && IsUnder(paths + slot->path_offset, slot->path_length, path, path_length)) Remove(i);
+    }
+}
+
+void ChangeOracle::MoveChildren(const char16_t* from, s32 from_length, const char16_t* to, s32 to_length)
+{
+    // Take the children out first, since putting them back in can grow (and rehash) the table.
+    Slot* moved = 0;
+    s32 moved_count = 0;
+    s32 moved_capacity = 0;
+    for (s32 i = 0; i < slot_capacity; ++i)
+    {
+        const Slot* slot = &slots[i];
+        if (slot->state != ESlot::Live || slot->path_length <= from_length || !IsUnder(paths + slot->path_offset, slot->path_length, from, from_length)) continue;
+        moved = (Slot*)GrowArray(allocator, moved, &moved_capacity, moved_count + 1, sizeof(Slot));
+        moved[moved_count++] = *slot;
+        Remove(i);
+    }
+
+    char16_t path[MAX_PATH];
+    for (s32 i = 0; i < moved_count; ++i)
+    {
+        s32 rest_length = moved[i].path_length - from_length;
+        if (to_length + rest_length >= MAX_PATH) continue;
+        CopyMemory(path, to, to_length * 2);
+        CopyMemory(path + to_length, paths + moved[i].path_offset + from_length, rest_length * 2);
+        Insert(path, to_length + rest_length, moved[i].is_directory, moved[i].origin);
+    }
+    Free(allocator, moved);
+}
+
+void ChangeOracle::Grow()
+{
+    s32 new_capacity = (slot_capacity) ? slot_capacity : 1024;
+    while ((live_slot_count + 1) * 2 > new_capacity) new_capacity *= 2;
+
+    // Dead slots are dropped along the way, so this may not actually grow the table, just clean it.
+    Slot* old_slots = slots;
+    s32 old_capacity = slot_capacity;
+    slots = (Slot*)Allocate(allocator, sizeof(Slot) * new_capacity);
+    ZeroMemory(slots, sizeof(Slot) * new_capacity);
+    slot_capacity = new_capacity;
+    used_slot_count = live_slot_count;
+
+    s32 mask = new_capacity - 1;
+    for (s32 i = 0; i < old_capacity; ++i)
+    {
+        if (old_slots[i].state != ESlot::Live) continue;
+        s32 j = (s32)(old_slots[i].hash & mask);
+        while (slots[j].state != ESlot::Empty) j = (j + 1) & mask;
+        slots[j] = old_slots[i];
+    }
+    Free(allocator, old_slots);
+}
+
+bool ChangeOracle::IsOverflowed(const char16_t* path, s32 path_length) const
+{
+    for (s32 i = 0; i < overflowed_count; ++i)
+    {
+        if (IsUnder(path, path_length, paths + overflowed[i].path_offset, overflowed[i].path_length)) return true;
+    }
+    return false;
+}
+
+void ChangeOracle::Report(EDivergence divergence, const char16_t* path, s32 path_length)
+{
+    bool is_explained_by_overflow = IsOverflowed(path, path_length);
+    if (is_explained_by_overflow) counts.explained_by_overflow += 1;
+    else counts.divergences[(s32)divergence] += 1;
+    if (callback) callback(callback_context, divergence, path, path_length, is_explained_by_overflow);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+/*
+ChangeOracle checks that a stream of changes from a DirectoryWatcher actually describes what happened on disk.
+It keeps a model of a watched tree, just the relative path of every file and directory in it, and applies each
+change to the model as it's read. Once the tree has gone quiet, Verify() scans the real tree (in parallel, with
+DirectorySnapshot) and compares the two. Anything that doesn't line up is a divergence:
+
+    MissedAdd           On disk, but the changes never added it.
+    MissedRemove        Added by the changes, but not on disk any more.
+    WrongRenameTarget   Renamed to a name that isn't on disk.
+    PhantomRemove       Removed (or renamed away) by a change, but it was never there.
+    PhantomModify       Modified by a change, but it was never there. Usually means its addition was missed.
+    DuplicateAdd        Added by a change, but it was already there.
+    UnpairedRename      A RenamedFrom without a RenamedTo right after it, or the other way around.
+
+The last four are noticed as the changes are applied, the first three by Verify(). After comparing, Verify()
+reloads the model from the scan, so a long soak test can stop making changes every so often, let the watcher
+catch up, verify, and carry on from a clean slate.
+
+A TooManyChanges change says that anything under its directory may have changed, so divergences under that
+directory are counted as explained_by_overflow rather than as the kind they are, until the next Verify(). One with
+an empty path, the root's path or the path of a directory above the root covers the whole root.
+
+Open() scans the tree to seed the model, so call it while the tree is quiet, after the directory is being
+watched. Apply() and Verify() aren't thread safe, call them from the thread that reads the changes.
+
+NOTE: The watcher doesn't report the contents of a directory that is moved into the tree, only the directory
+itself, so those show up as missed additions. That is the correct answer: a consumer that doesn't scan such a
+directory when it appears really does end up with the wrong picture.
+*/
+
+#include "DirectoryWatcher.h"
+#include "DirectorySnapshot.h"
+
+struct ChangeOracle
+{
+    enum struct EDivergence
+    {
+        MissedAdd = 0,
+        MissedRemove,
+        WrongRenameTarget,
+        PhantomRemove,
+        PhantomModify,
+        DuplicateAdd,
+        UnpairedRename,
+        Count
+    };
+
+    struct Counts
+    {
+        u64 divergences[(s32)EDivergence::Count];
+        u64 explained_by_overflow; // Divergences under a directory that had a TooManyChanges.
+        u64 overflow_count; // TooManyChanges changes.
+        u64 applied_count; // Changes applied to the model.
+        u64 ignored_count; // Changes for paths outside the root, or too long to keep.
+    };
+
+    // Called for every divergence as it's found. Paths are relative to the root.
+    typedef void (*DivergenceCallback)(void* context, EDivergence divergence, const char16_t* path, s32 path_length, bool is_explained_by_overflow);
+
+    const DirectoryWatcher::Allocator* allocator = 0; // Null means malloc() and free().
+    DivergenceCallback callback = 0;
+    void* callback_context = 0;
+    s32 thread_count = 4; // Threads used to scan the tree.
+
+    Counts counts = {}; // Since the last Verify().
+    Counts totals = {}; // Since Open(), up to the last Verify().
+
+    // Remembers the root, which should be spelled the same as it was for AddDirectory(), and seeds the model from a scan.
+    bool Open(const char* root_path, bool is_recursive);
+    void Close();
+    // Applies one change to the model.
+    void Apply(const DirectoryWatcher::FileChange& change);
+    // Compares the model with a fresh scan of the tree, and then reloads the model from that scan. Optionally returns the
+    // counts since the last Verify(). False if the tree couldn't be scanned.
+    bool Verify(Counts* out_counts = 0);
+
+private:
+
+    enum struct ESlot : u8
+    {
+        Empty = 0,
+        Live,
+        Dead
+    };
+
+    struct Slot
+    {
+        u64 hash;
+        u32 path_offset; // In the path pool, in char16_t units.
+        u16 path_length;
+        ESlot state;
+        u8 origin; // EFileAction that put it in the model, None if it came from a scan.
+        bool is_directory;
+        bool is_seen; // Found on disk, while verifying.
+    };
+
+    struct Prefix
+    {
+        u32 path_offset;
+        s32 path_length;
+    };
+
+    char16_t root[MAX_PATH] = {};
+    s32 root_length = 0;
+    bool is_recursive = false;
+
+    Slot* slots = 0;
+    s32 slot_capacity = 0; // Always a power of two.
+    s32 used_slot_count = 0; // Live and dead.
+    s32 live_slot_count = 0;
+    char16_t* paths = 0;
+    s32 path_count = 0;
+    s32 path_capacity = 0;
+
+    Prefix* overflowed = 0; // Directories that had a TooManyChanges since the last Verify().
+    s32 overflowed_count = 0;
+    s32 overflowed_capacity = 0;
+
+    char16_t rename_from[MAX_PATH] = {};
+    s32 rename_from_length = -1; // -1 when there's no RenamedFrom waiting for its RenamedTo.
+
+    void Reset();
+    void Load(const DirectorySnapshot* snapshot);
+    s32 Find(const char16_t* path, s32 path_length, u64 hash) const;
+    void Insert(const char16_t* path, s32 path_length, bool is_directory, u8 origin);
+    void Remove(s32 slot_index);
+    void RemoveChildren(const char16_t* path, s32 path_length);
+    void MoveChildren(const char16_t* from, s32 from_length, const char16_t* to, s32 to_length);
+    void Grow();
+    bool IsOverflowed(const char16_t* path, s32 path_length) const;
+    void Report(EDivergence divergence, const char16_t* path, s32 path_length);
+};
@@ -0,0 +1,239 @@
+#include "DirectoryCrawler.h"
+#include "DirectoryWatcherInternal.h"
+
+s32 DirectoryCrawler::GetWorkerCount(s32 thread_count)
+{
+    if (thread_count > 0) return thread_count;
+    SYSTEM_INFO info = {};
+    GetSystemInfo(&info);
+    return (s32)info.dwNumberOfProcessors;
+}
+
+bool DirectoryCrawler::Crawl(const char16_t* root_path, s32 root_path_length, bool is_recursive, s32 thread_count)
+{
+    assert(root_path && root_path_length > 0 && callbacks.begin_directory && callbacks.entry && callbacks.end_directory);
+    this->root_path = root_path;
+    this->root_path_length = root_path_length;
+    this->is_recursive = is_recursive;
+    worker_count = GetWorkerCount(thread_count);
+    next_worker = 0;
+    pending_job_count = 0;
+    did_fail = 0;
+
+    // One allocation for the workers and their list buffers.
+    workers = (Worker*)Allocate(allocator, worker_count * (sizeof(Worker) + ListBufferSize));
+    u8* buffers = (u8*)(workers + worker_count);
+    for (s32 i = 0; i < worker_count; ++i)
+    {
+        workers[i].deque = {};
+        workers[i].deque.allocator = allocator;
+        workers[i].buffer = buffers + (size_t)i * ListBufferSize;
+    }
+
+    // The root is the only job to begin with, the workers spread out from there.
+    PushJob(0, 0, 0, 0, 0);
+
+    // The calling thread acts as the first worker, the rest run on the process thread pool.
+    PTP_WORK work = 0;
+    if (worker_count > 1)
+    {
+        work = CreateThreadpoolWork((PTP_WORK_CALLBACK)DirectoryCrawler::CrawlWorkProc, this, 0);
+        for (s32 i = 1; i < worker_count; ++i) SubmitThreadpoolWork(work);
+    }
+    RunWorker();
+    if (work)
+    {
+        WaitForThreadpoolWorkCallbacks(work, false);
+        CloseThreadpoolWork(work);
+    }
+
+    for (s32 i = 0; i < worker_count; ++i) Free(allocator, workers[i].deque.jobs);
+    Free(allocator, workers);
+    workers = 0;
+    return !did_fail;
+}
+
+void DirectoryCrawler::Descend(s32 worker_index, const char16_t* parent, s32 parent_length, const char16_t* name, s32 name_length)
+{
+    assert(worker_index >= 0 && worker_index < worker_count);
+    if (is_recursive) PushJob(worker_index, parent, parent_length, name, name_length);
+}
+
+void __stdcall DirectoryCrawler::CrawlWorkProc(void* instance, void* arg, void* work)
+{
+    ((DirectoryCrawler*)arg)->RunWorker();
+}
+
+void DirectoryCrawler::RunWorker()
+{
+    s32 index = InterlockedIncrement((LPLONG)&next_worker) - 1;
+    assert(index < worker_count);
+    Worker* self = &workers[index];
+
+    while (true)
+    {
+        Job job = {};
+        bool has_job = self->deque.Pop(&job);
+
+        // Out of local work, go looking for someone to steal from, starting with our neighbour.
+        for (s32 i = 1; !has_job && i < worker_count; ++i)
+        {
+            has_job = workers[(index + i) % worker_count].deque.Steal(&job);
+        }
+
+        if (!has_job)
+        {
+            // Another thread may still be listing a directory and about to push more work.
+            if (!pending_job_count) break;
+            SwitchToThread();
+            continue;
+        }
+
+        ListDirectory(index, job);
+        Free(allocator, job.path);
+        InterlockedDecrement((LPLONG)&pending_job_count);
+    }
+}
+
+void DirectoryCrawler::ListDirectory(s32 worker_index, Job job)
+{
+    bool is_root = (job.path_length == 0);
+    auto fail = [&](u32 error)
+    {
+        if (is_root) did_fail = true;
+        if (callbacks.fail_directory) callbacks.fail_directory(callbacks.context, worker_index, job.path, job.path_length, error);
+    };
+
+    // Room for the root and the relative path.
+    char16_t full_path[MAX_PATH * 2];
+    s32 full_path_length = 0;
+    if (is_root)
+    {
+        if (root_path_length + 1 > MAX_PATH * 2) {fail(ERROR_FILENAME_EXCED_RANGE); return;}
+        CopyMemory(full_path, root_path, root_path_length * 2);
+        full_path_length = root_path_length;
+        full_path[full_path_length] = u'\0';
+    }
+    else full_path_length = JoinPath(full_path, MAX_PATH * 2, root_path, root_path_length, job.path, job.path_length);
+    if (full_path_length < 0) {fail(ERROR_FILENAME_EXCED_RANGE); return;}
+
+    u32 mode = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    void* directory = CreateFileW((LPCWSTR)full_path, FILE_LIST_DIRECTORY, mode, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (directory == INVALID_HANDLE_VALUE) {fail(GetLastError()); return;}
+
+    FILE_BASIC_INFO basic = {};
+    if (!GetFileInformationByHandleEx(directory, FileBasicInfo, &basic, sizeof(basic)))
+    {
+        fail(GetLastError());
+        CloseHandle(directory);
+        return;
+    }
+    u64 modification_time = (u64)basic.LastWriteTime.QuadPart;
+    if (callbacks.filter_directory && !callbacks.filter_directory(callbacks.context, worker_index, job.path, job.path_length, modification_time))
+    {
+        CloseHandle(directory);
+        return;
+    }
+
+    // Only report the directory once its first batch of entries is in hand, so a failure is reported as just that.
+    u8* buffer = workers[worker_index].buffer;
+    bool has_entries = GetFileInformationByHandleEx(directory, FileFullDirectoryInfo, buffer, ListBufferSize) != 0;
+    u32 error = (has_entries) ? 0 : GetLastError();
+    if (!has_entries && error != ERROR_NO_MORE_FILES)
+    {
+        fail(error);
+        CloseHandle(directory);
+        return;
+    }
+
+    callbacks.begin_directory(callbacks.context, worker_index, job.path, job.path_length, modification_time);
+    while (has_entries)
+    {
+        FILE_FULL_DIR_INFO* info = 0;
+        s32 offset = 0;
+        do
+        {
+            info = (FILE_FULL_DIR_INFO*)(buffer + offset);
+            offset += info->NextEntryOffset;
+
+            const char16_t* name = (const char16_t*)info->FileName;
+            s32 name_length = (s32)(info->FileNameLength / 2);
+            if ((name_length == 1 && name[0] == u'.') || (name_length == 2 && name[0] == u'.' && name[1] == u'.')) continue;
+
+            Entry entry = {};
+            entry.name = name;
+            entry.name_length = name_length;
+            entry.creation_time = (u64)info->CreationTime.QuadPart;
+            entry.modification_time = (u64)info->LastWriteTime.QuadPart;
+            entry.change_time = (u64)info->ChangeTime.QuadPart;
+            entry.access_time = (u64)info->LastAccessTime.QuadPart;
+            entry.size = (u64)info->EndOfFile.QuadPart;
+            entry.attributes = info->FileAttributes;
+            callbacks.entry(callbacks.context, worker_index, &entry);
+
+            // NOTE: Like a recursive ReadDirectoryChangesExW watch, we don't follow junctions or symbolic links.
+            bool is_directory = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) && !(entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+            if (is_recursive && is_directory) PushJob(worker_index, job.path, job.path_length, name, name_length);
+        } while (info->NextEntryOffset);
+
+        has_entries = GetFileInformationByHandleEx(directory, FileFullDirectoryInfo, buffer, ListBufferSize) != 0;
+    }
+    CloseHandle(directory);
+    callbacks.end_directory(callbacks.context, worker_index);
+}
+
+void DirectoryCrawler::PushJob(s32 worker_index, const char16_t* parent, s32 parent_length, const char16_t* name, s32 name_length)
+{
+    Job job = {};
+    s32 capacity = parent_length + 1 + name_length + 1;
+    job.path = (char16_t*)Allocate(allocator, capacity * sizeof(char16_t));
+    job.path_length = JoinPath(job.path, capacity, parent, parent_length, name, name_length);
+
+    InterlockedIncrement((LPLONG)&pending_job_count);
+    workers[worker_index].deque.Push(job);
+}
+
+void DirectoryCrawler::WorkDeque::Push(Job job)
+{
+    Lock();
+    if (bottom == capacity)
+    {
+        // Slide everything back to the start before growing, since steals leave a gap at the top.
+        s32 count = bottom - top;
+        if (top) MoveMemory(jobs, jobs + top, count * sizeof(Job));
+        top = 0;
+        bottom = count;
+        jobs = (Job*)GrowArray(allocator, jobs, &capacity, count + 1, sizeof(Job));
+    }
+    jobs[bottom++] = job;
+    Unlock();
+}
+
+bool DirectoryCrawler::WorkDeque::Pop(Job* job)
+{
+    bool result = false;
+    Lock();
+    if (bottom > top)
+    {
+        *job = jobs[--bottom];
+        result = true;
+    }
+    Unlock();
+    return result;
+}
+
+bool DirectoryCrawler::WorkDeque::Steal(Job* job)
+{
+    bool result = false;
+    Lock();
+    if (bottom > top)
+    {
+        *job = jobs[top++];
+        result = true;
+    }
+    Unlock();
+    return result;
+}
+
+void DirectoryCrawler::WorkDeque::Lock() {lock.Lock();}
+void DirectoryCrawler::WorkDeque::Unlock() {lock.Unlock();}
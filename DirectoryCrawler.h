@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+DirectoryCrawler lists every directory under a root using several threads at once, and hands what it finds
+to a set of callbacks. DirectorySnapshot::Scan() is built on it, and anything else that needs to walk a big
+tree quickly (a first scan before watching, catching up after a TooManyChanges) can use it the same way.
+
+A recursive walk on one thread spends most of its time waiting on the file system, one directory at a time.
+Here each thread owns a deque of directories still to be listed. It pushes the subdirectories it finds onto
+the bottom of its own deque and pops from there too, so it mostly works depth first on directories whose
+metadata is still warm. When it runs dry, it steals from the top of another thread's deque, which is where
+the biggest unexplored subtrees are. That keeps every thread busy even on very lopsided trees.
+
+Each directory is opened once, and everything else is done through that handle: its own times come from
+GetFileInformationByHandleEx(FileBasicInfo), and its entries from GetFileInformationByHandleEx(
+FileFullDirectoryInfo) into a 64KB buffer per thread, which returns hundreds of entries per call rather
+than the handful FindNextFile() does. (Win32 has no way to open a path relative to a directory handle, so
+the full path is still built for the open.) Junctions and symbolic links to directories are reported, but
+not followed, the same as a recursive ReadDirectoryChangesExW watch.
+
+Callbacks for a directory are all made on one thread, in order: filter (optional), then begin, entry for each
+entry, and end. Different directories are reported on different threads at the same time, so give each
+thread its own output, indexed by the worker index the callbacks get. Nothing is sorted.
+*/
+
+#include "DirectoryWatcher.h"
+
+struct DirectoryCrawler
+{
+    static const s32 ListBufferSize = 64 * 1024; // Per thread.
+
+    struct Entry
+    {
+        const char16_t* name; // Not null terminated.
+        s32 name_length;
+        u64 creation_time;
+        u64 modification_time;
+        u64 change_time;
+        u64 access_time;
+        u64 size;
+        u32 attributes;
+    };
+
+    struct Callbacks
+    {
+        void* context = 0;
+        // Optional. Called once a directory is open, before it's listed. Return false to skip listing it (calling Descend() for
+        // any subdirectories that should still be crawled). Paths are relative to the root, which itself has an empty path.
+        bool (*filter_directory)(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time) = 0;
+        void (*begin_directory)(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time) = 0;
+        void (*entry)(void* context, s32 worker_index, const Entry* entry) = 0;
+        void (*end_directory)(void* context, s32 worker_index) = 0;
+        // Optional. Called instead of the others when a directory couldn't be opened or listed, with the error from GetLastError().
+        void (*fail_directory)(void* context, s32 worker_index, const char16_t* path, s32 path_length, u32 error) = 0;
+    };
+
+    const DirectoryWatcher::Allocator* allocator = 0; // Null means malloc() and free().
+    Callbacks callbacks;
+
+    // Gets the number of threads Crawl() will use for the given thread count, so per-thread outputs can be set up beforehand.
+    static s32 GetWorkerCount(s32 thread_count);
+    // Lists the tree under root_path, on the calling thread and thread_count - 1 thread pool threads (0 means one per processor).
+    // Returns once everything has been listed. False if the root itself couldn't be listed.
+    bool Crawl(const char16_t* root_path, s32 root_path_length, bool is_recursive, s32 thread_count);
+    // Queues a subdirectory to be crawled. Only valid from inside filter_directory, for directories it skipped.
+    void Descend(s32 worker_index, const char16_t* parent, s32 parent_length, const char16_t* name, s32 name_length);
+
+private:
+
+    struct Job
+    {
+        char16_t* path; // Relative path of the directory to list, allocated by whoever pushed the job.
+        s32 path_length;
+    };
+
+    struct WorkDeque
+    {
+        DirectoryWatcher::QueueLock lock;
+        Job* jobs = 0;
+        s32 capacity = 0;
+        s32 top = 0; // Other threads steal from the top.
+        s32 bottom = 0; // The owning thread pushes and pops at the bottom.
+        const DirectoryWatcher::Allocator* allocator = 0;
+
+        void Push(Job job);
+        bool Pop(Job* job);
+        bool Steal(Job* job);
+
+        inline void Lock();
+        inline void Unlock();
+    };
+
+    struct Worker
+    {
+        WorkDeque deque;
+        u8* buffer; // ListBufferSize bytes, for GetFileInformationByHandleEx().
+    };
+
+    const char16_t* root_path = 0;
+    s32 root_path_length = 0;
+    bool is_recursive = false;
+    Worker* workers = 0;
+    s32 worker_count = 0;
+    volatile s32 next_worker = 0;
+    volatile s32 pending_job_count = 0; // Jobs that have been pushed but not finished yet.
+    volatile s32 did_fail = 0;
+
+    void RunWorker();
+    void ListDirectory(s32 worker_index, Job job);
+    void PushJob(s32 worker_index, const char16_t* parent, s32 parent_length, const char16_t* name, s32 name_length);
+
+    static void __stdcall CrawlWorkProc(void* instance, void* arg, void* work);
+};
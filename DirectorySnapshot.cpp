@@ -0,0 +1,337 @@
+#include "DirectorySnapshot.h"
+#include "DirectoryWatcherInternal.h"
+
+// NOTE: A heap sort, since qsort() has no way to pass the string pool along to the comparison.
+// Snapshots are sorted once per scan, so this doesn't need to be clever.
+template <typename T, typename Less>
+static void HeapSort(T* items, s32 count, Less less)
+{
+    auto sift_down = [&](s32 root, s32 end)
+    {
+        while (2 * root + 1 < end)
+        {
+            s32 child = 2 * root + 1;
+            if (child + 1 < end && less(items[child], items[child + 1])) child += 1;
+            if (!less(items[root], items[child])) return;
+            T temp = items[root]; items[root] = items[child]; items[child] = temp;
+            root = child;
+        }
+    };
+    for (s32 start = count / 2 - 1; start >= 0; --start) sift_down(start, count);
+    for (s32 end = count - 1; end > 0; --end)
+    {
+        T temp = items[0]; items[0] = items[end]; items[end] = temp;
+        sift_down(0, end);
+    }
+}
+
+bool DirectorySnapshot::Scan(const char16_t* root_path, s32 root_path_length, bool is_recursive, const DirectorySnapshot* previous, bool skip_unchanged, s32 thread_count)
+{
+    assert(root_path && root_path_length > 0 && previous != this);
+    directory_count = 0;
+    entry_count = 0;
+    name_count = 0;
+
+    DirectoryCrawler crawler;
+    crawler.allocator = allocator;
+
+    ScanContext context = {};
+    context.crawler = &crawler;
+    context.previous = previous;
+    context.skip_unchanged = skip_unchanged && previous;
+    context.worker_count = DirectoryCrawler::GetWorkerCount(thread_count);
+    context.workers = (ScanWorker*)Allocate(allocator, context.worker_count * (sizeof(ScanWorker) + sizeof(DirectorySnapshot)));
+
+    DirectorySnapshot* outputs = (DirectorySnapshot*)(context.workers + context.worker_count);
+    for (s32 i = 0; i < context.worker_count; ++i)
+    {
+        outputs[i] = {};
+        outputs[i].allocator = allocator;
+        context.workers[i].output = &outputs[i];
+        context.workers[i].first_entry = 0;
+    }
+
+    crawler.callbacks.context = &context;
+    crawler.callbacks.filter_directory = DirectorySnapshot::FilterDirectoryProc;
+    crawler.callbacks.begin_directory = DirectorySnapshot::BeginDirectoryProc;
+    crawler.callbacks.entry = DirectorySnapshot::EntryProc;
+    crawler.callbacks.end_directory = DirectorySnapshot::EndDirectoryProc;
+    crawler.callbacks.fail_directory = DirectorySnapshot::FailDirectoryProc;
+    bool result = crawler.Crawl(root_path, root_path_length, is_recursive, context.worker_count);
+
+    for (s32 i = 0; i < context.worker_count; ++i)
+    {
+        Append(&outputs[i]);
+        outputs[i].Destroy();
+    }
+    Free(allocator, context.workers);
+
+    SortDirectories();
+    return result;
+}
+
+void DirectorySnapshot::Destroy()
+{
+    const DirectoryWatcher::Allocator* kept_allocator = allocator;
+    Free(allocator, directories);
+    Free(allocator, entries);
+    Free(allocator, names);
+    *this = {};
+    allocator = kept_allocator;
+}
+
+s32 DirectorySnapshot::FindDirectory(const char16_t* path, s32 path_length) const
+{
+    s32 low = 0;
+    s32 high = directory_count - 1;
+    while (low <= high)
+    {
+        s32 middle = low + (high - low) / 2;
+        const Directory* directory = &directories[middle];
+        s32 order = CompareNames(names + directory->path_offset, directory->path_length, path, path_length);
+        if (order == 0) return middle;
+        else if (order < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+    return -1;
+}
+
+void DirectorySnapshot::Diff(const DirectorySnapshot* from, const DirectorySnapshot* to, DiffCallback callback, void* context)
+{
+    assert(from && to && callback);
+    typedef DirectoryWatcher::EFileAction EFileAction;
+
+    char16_t path[MAX_PATH]; // NOTE: Relative paths, so MAX_PATH is enough here too. Anything longer is skipped.
+
+    // Reports one entry, given the directory it belongs to.
+    auto report = [&](const DirectorySnapshot* snapshot, const Directory* directory, const Entry* entry, EFileAction action)
+    {
+        s32 path_length = JoinPath(path, MAX_PATH, snapshot->names + directory->path_offset, directory->path_length,
+                                   snapshot->names + entry->name_offset, entry->name_length);
+        if (path_length >= 0) callback(context, action, path, path_length, entry);
+    };
+
+    s32 i = 0;
+    s32 j = 0;
+    while (i < from->directory_count || j < to->directory_count)
+    {
+        const Directory* old_directory = (i < from->directory_count) ? &from->directories[i] : 0;
+        const Directory* new_directory = (j < to->directory_count) ? &to->directories[j] : 0;
+
+        s32 order = 0;
+        if (!old_directory) order = 1;
+        else if (!new_directory) order = -1;
+        else order = CompareNames(from->names + old_directory->path_offset, old_directory->path_length,
+                                  to->names + new_directory->path_offset, new_directory->path_length);
+
+        if (order < 0)
+        {
+            // The whole directory went away.
+            for (s32 k = 0; k < old_directory->entry_count; ++k)
+                report(from, old_directory, &from->entries[old_directory->first_entry + k], EFileAction::Removed);
+            i += 1;
+        }
+        else if (order > 0)
+        {
+            // The whole directory is new.
+            for (s32 k = 0; k < new_directory->entry_count; ++k)
+                report(to, new_directory, &to->entries[new_directory->first_entry + k], EFileAction::Added);
+            j += 1;
+        }
+        else
+        {
+            // Same directory in both, merge the two sorted listings.
+            const Entry* old_entries = from->entries + old_directory->first_entry;
+            const Entry* new_entries = to->entries + new_directory->first_entry;
+            s32 a = 0;
+            s32 b = 0;
+            while (a < old_directory->entry_count || b < new_directory->entry_count)
+            {
+                const Entry* old_entry = (a < old_directory->entry_count) ? &old_entries[a] : 0;
+                const Entry* new_entry = (b < new_directory->entry_count) ? &new_entries[b] : 0;
+
+                s32 entry_order = 0;
+                if (!old_entry) entry_order = 1;
+                else if (!new_entry) entry_order = -1;
+                else entry_order = CompareNames(from->names + old_entry->name_offset, old_entry->name_length,
+                                                to->names + new_entry->name_offset, new_entry->name_length);
+
+                if (entry_order < 0) {report(from, old_directory, old_entry, EFileAction::Removed); a += 1;}
+                else if (entry_order > 0) {report(to, new_directory, new_entry, EFileAction::Added); b += 1;}
+                else
+                {
+                    if (old_entry->modification_time != new_entry->modification_time || old_entry->size != new_entry->size)
+                        report(to, new_directory, new_entry, EFileAction::Modified);
+                    a += 1;
+                    b += 1;
+                }
+            }
+            i += 1;
+            j += 1;
+        }
+    }
+}
+
+void DirectorySnapshot::AddDirectory(const char16_t* path, s32 path_length, u64 modification_time)
+{
+    directories = (Directory*)GrowArray(allocator, directories, &directory_capacity, directory_count + 1, sizeof(Directory));
+    names = (char16_t*)GrowArray(allocator, names, &name_capacity, name_count + path_length, sizeof(char16_t));
+
+    Directory* directory = &directories[directory_count++];
+    directory->modification_time = modification_time;
+    directory->path_offset = name_count;
+    directory->path_length = path_length;
+    directory->first_entry = entry_count;
+    directory->entry_count = 0;
+
+    CopyMemory(names + name_count, path, path_length * 2);
+    name_count += path_length;
+}
+
+DirectorySnapshot::Entry* DirectorySnapshot::AddEntry(const char16_t* name, s32 name_length)
+{
+    assert(directory_count);
+    entries = (Entry*)GrowArray(allocator, entries, &entry_capacity, entry_count + 1, sizeof(Entry));
+    names = (char16_t*)GrowArray(allocator, names, &name_capacity, name_count + name_length, sizeof(char16_t));
+
+    Entry* entry = &entries[entry_count++];
+    *entry = {};
+    entry->name_offset = name_count;
+    entry->name_length = name_length;
+    directories[directory_count - 1].entry_count += 1;
+
+    CopyMemory(names + name_count, name, name_length * 2);
+    name_count += name_length;
+    return entry;
+}
+
+void DirectorySnapshot::Append(const DirectorySnapshot* other)
+{
+    directories = (Directory*)GrowArray(allocator, directories, &directory_capacity, directory_count + other->directory_count, sizeof(Directory));
+    entries = (Entry*)GrowArray(allocator, entries, &entry_capacity, entry_count + other->entry_count, sizeof(Entry));
+    names = (char16_t*)GrowArray(allocator, names, &name_capacity, name_count + other->name_count, sizeof(char16_t));
+
+    for (s32 i = 0; i < other->directory_count; ++i)
+    {
+        Directory directory = other->directories[i];
+        directory.path_offset += name_count;
+        directory.first_entry += entry_count;
+        directories[directory_count + i] = directory;
+    }
+    for (s32 i = 0; i < other->entry_count; ++i)
+    {
+        Entry entry = other->entries[i];
+        entry.name_offset += name_count;
+        entries[entry_count + i] = entry;
+    }
+    if (other->name_count) CopyMemory(names + name_count, other->names, other->name_count * 2);
+
+    directory_count += other->directory_count;
+    entry_count += other->entry_count;
+    name_count += other->name_count;
+}
+
+void DirectorySnapshot::SortDirectories()
+{
+    const char16_t* pool = names;
+    HeapSort(directories, directory_count, [pool](const Directory& a, const Directory& b)
+    {
+        return CompareNames(pool + a.path_offset, a.path_length, pool + b.path_offset, b.path_length) < 0;
+    });
+}
+
+void DirectorySnapshot::SortEntries(s32 first_entry, s32 count)
+{
+    const char16_t* pool = names;
+    HeapSort(entries + first_entry, count, [pool](const Entry& a, const Entry& b)
+    {
+        return CompareNames(pool + a.name_offset, a.name_length, pool + b.name_offset, b.name_length) < 0;
+    });
+}
+
+void DirectorySnapshot::CopyDirectory(const DirectorySnapshot* from, s32 directory_index)
+{
+    const Directory* directory = &from->directories[directory_index];
+    AddDirectory(from->names + directory->path_offset, directory->path_length, directory->modification_time);
+    for (s32 i = 0; i < directory->entry_count; ++i)
+    {
+        const Entry* source = &from->entries[directory->first_entry + i];
+        Entry* entry = AddEntry(from->names + source->name_offset, source->name_length);
+        u32 name_offset = entry->name_offset;
+        *entry = *source;
+        entry->name_offset = name_offset;
+    }
+}
+
+// Copies a directory and every directory under it that from has a listing for.
+void DirectorySnapshot::CopySubtree(const DirectorySnapshot* from, s32 directory_index)
+{
+    CopyDirectory(from, directory_index);
+    const Directory* directory = &from->directories[directory_index];
+    char16_t path[MAX_PATH];
+    for (s32 i = 0; i < directory->entry_count; ++i)
+    {
+        const Entry* entry = &from->entries[directory->first_entry + i];
+        if (!(entry->attributes & FILE_ATTRIBUTE_DIRECTORY) || (entry->attributes & FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+        s32 path_length = JoinPath(path, MAX_PATH, from->names + directory->path_offset, directory->path_length,
+                                   from->names + entry->name_offset, entry->name_length);
+        s32 child_index = (path_length >= 0) ? from->FindDirectory(path, path_length) : -1;
+        if (child_index >= 0) CopySubtree(from, child_index);
+    }
+}
+
+bool DirectorySnapshot::FilterDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time)
+{
+    ScanContext* scan = (ScanContext*)context;
+    if (!scan->skip_unchanged) return true;
+
+    const DirectorySnapshot* previous = scan->previous;
+    s32 previous_index = previous->FindDirectory(path, path_length);
+    if (previous_index < 0 || previous->directories[previous_index].modification_time != modification_time) return true;
+
+    // Nothing was added, removed or renamed in here since last time, reuse the old listing.
+    scan->workers[worker_index].output->CopyDirectory(previous, previous_index);
+    const Directory* directory = &previous->directories[previous_index];
+    for (s32 i = 0; i < directory->entry_count; ++i)
+    {
+        const Entry* entry = &previous->entries[directory->first_entry + i];
+        if ((entry->attributes & FILE_ATTRIBUTE_DIRECTORY) && !(entry->attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            scan->crawler->Descend(worker_index, path, path_length, previous->names + entry->name_offset, entry->name_length);
+    }
+    return false;
+}
+
+void DirectorySnapshot::BeginDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time)
+{
+    ScanWorker* worker = &((ScanContext*)context)->workers[worker_index];
+    worker->output->AddDirectory(path, path_length, modification_time);
+    worker->first_entry = worker->output->entry_count;
+}
+
+void DirectorySnapshot::EntryProc(void* context, s32 worker_index, const DirectoryCrawler::Entry* found)
+{
+    ScanWorker* worker = &((ScanContext*)context)->workers[worker_index];
+    Entry* entry = worker->output->AddEntry(found->name, found->name_length);
+    entry->creation_time = found->creation_time;
+    entry->modification_time = found->modification_time;
+    entry->access_time = found->access_time;
+    entry->size = found->size;
+    entry->attributes = found->attributes;
+}
+
+void DirectorySnapshot::EndDirectoryProc(void* context, s32 worker_index)
+{
+    ScanWorker* worker = &((ScanContext*)context)->workers[worker_index];
+    worker->output->SortEntries(worker->first_entry, worker->output->entry_count - worker->first_entry);
+}
+
+void DirectorySnapshot::FailDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u32 error)
+{
+    // If the directory is gone, leave it out and let the diff report its contents as removed. For anything
+    // else (a flaky network share, access denied...) keep the old listings of it and everything under it, since
+    // we never got to look at those either, rather than inventing removals.
+    ScanContext* scan = (ScanContext*)context;
+    if (!path_length || !scan->previous || error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) return;
+    s32 previous_index = scan->previous->FindDirectory(path, path_length);
+    if (previous_index >= 0) scan->workers[worker_index].output->CopySubtree(scan->previous, previous_index);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+/*
+DirectorySnapshot is a flat, in-memory copy of the metadata of a directory tree. It is used by the polling
+backend (see DirectoryWatcher::AddPolledDirectory()) for file systems that don't deliver change notifications,
+like some network shares and FUSE-style redirectors.
+
+The layout is deliberately simple: one record per directory, one record per directory entry (file or
+subdirectory), and every name stored in a single string pool. Directories are sorted by their path relative
+to the root, and the entries of each directory are stored contiguously and sorted by name, so comparing two
+snapshots of the same tree is a merge rather than a search.
+
+Scanning is done by several threads at once, with DirectoryCrawler (see DirectoryCrawler.h), each thread
+filling in its own snapshot which are stitched together and sorted at the end. Before listing a directory we check its
+modification time, and if it matches the previous snapshot we copy the old listing instead of asking the
+file system again. Adding, removing or renaming an entry always touches the directory's modification time,
+but writing to an existing file does not, so the caller should ask for a full scan every so often to pick
+up in-place modifications.
+*/
+
+#include "DirectoryWatcher.h"
+#include "DirectoryCrawler.h"
+
+struct DirectorySnapshot
+{
+    struct Entry
+    {
+        u64 creation_time;
+        u64 modification_time;
+        u64 access_time;
+        u64 size;
+        u32 attributes;
+        u32 name_offset; // Offset of the name in the string pool, in char16_t units.
+        s32 name_length; // Length of the name, in char16_t units, not including a null terminator (there isn't one).
+    };
+
+    struct Directory
+    {
+        u64 modification_time;
+        u32 path_offset; // Path relative to the scanned root, which itself has an empty path.
+        s32 path_length;
+        s32 first_entry;
+        s32 entry_count;
+    };
+
+    typedef void (*DiffCallback)(void* context, DirectoryWatcher::EFileAction action, const char16_t* path, s32 path_length, const Entry* entry);
+
+    const DirectoryWatcher::Allocator* allocator = 0; // Where the arrays come from. Null means malloc() and free().
+    Directory* directories = 0;
+    Entry* entries = 0;
+    char16_t* names = 0;
+    s32 directory_count = 0;
+    s32 directory_capacity = 0;
+    s32 entry_count = 0;
+    s32 entry_capacity = 0;
+    s32 name_count = 0;
+    s32 name_capacity = 0;
+
+    // Scans the tree under root_path, replacing anything already in the snapshot. If previous is given and skip_unchanged
+    // is set, directories whose modification time hasn't changed are copied from previous instead of being listed.
+    // Returns false if the root directory couldn't be read at all.
+    bool Scan(const char16_t* root_path, s32 root_path_length, bool is_recursive, const DirectorySnapshot* previous, bool skip_unchanged, s32 thread_count);
+    // Frees all memory held by the snapshot. The allocator is kept, so the snapshot can be reused.
+    void Destroy();
+    // Returns the index of the directory with the given relative path, or -1 if there isn't one.
+    s32 FindDirectory(const char16_t* path, s32 path_length) const;
+    // Reports every entry that was added, removed or modified between two snapshots of the same root.
+    // Paths passed to the callback are relative to the root.
+    static void Diff(const DirectorySnapshot* from, const DirectorySnapshot* to, DiffCallback callback, void* context);
+
+private:
+
+    struct ScanWorker
+    {
+        DirectorySnapshot* output;
+        s32 first_entry; // Of the directory being listed.
+    };
+
+    struct ScanContext
+    {
+        DirectoryCrawler* crawler;
+        const DirectorySnapshot* previous;
+        bool skip_unchanged;
+        ScanWorker* workers;
+        s32 worker_count;
+    };
+
+    void AddDirectory(const char16_t* path, s32 path_length, u64 modification_time);
+    Entry* AddEntry(const char16_t* name, s32 name_length);
+    void Append(const DirectorySnapshot* other);
+    void SortDirectories();
+    void SortEntries(s32 first_entry, s32 count);
+    void CopyDirectory(const DirectorySnapshot* from, s32 directory_index);
+    void CopySubtree(const DirectorySnapshot* from, s32 directory_index);
+
+    static bool FilterDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time);
+    static void BeginDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u64 modification_time);
+    static void EntryProc(void* context, s32 worker_index, const DirectoryCrawler::Entry* entry);
+    static void EndDirectoryProc(void* context, s32 worker_index);
+    static void FailDirectoryProc(void* context, s32 worker_index, const char16_t* path, s32 path_length, u32 error);
+};
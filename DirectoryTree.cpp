@@ -0,0 +1,816 @@
+#include "DirectoryTree.h"
+#include "DirectoryWatcherInternal.h"
+
+typedef DirectoryWatcher::EFileAction EFileAction;
+
+static u64 Mix(u64 x)
+{
+    // The splitmix64 finalizer, so that summing hashes doesn't let nearby values cancel out.
+    x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27; x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Hashes the extension of a name, everything after the last dot, ignoring case. Names without one hash like an empty extension.
+static u32 HashExtension(const char16_t* name, s32 name_length)
+{
+    s32 start = name_length;
+    while (start > 0 && name[start - 1] != u'.') start -= 1;
+    if (!start) start = name_length;
+
+    u32 hash = 2166136261u;
+    for (s32 i = start; i < name_length; ++i) hash = (hash ^ (u16)FoldPathChar(name[i])) * 16777619u;
+    return hash;
+}
+
+static bool EndsWith(const char16_t* name, s32 name_length, const char16_t* suffix, s32 suffix_length)
+{
+    if (suffix_length > name_length) return false;
+    for (s32 i = 0; i < suffix_length; ++i)
+    {
+        if (FoldPathChar(name[name_length - suffix_length + i]) != FoldPathChar(suffix[i])) return false;
+    }
+    return true;
+}
+
+bool DirectoryTree::Scan(const char* root_path, bool is_recursive, s32 thread_count)
+{
+    assert(root_path);
+    root_length = MultiByteToWideChar(CP_UTF8, 0, root_path, -1, (LPWSTR)root, MAX_PATH) - 1;
+    if (root_length <= 0) return false;
+
+    DirectorySnapshot snapshot;
+    snapshot.allocator = allocator;
+    bool result = snapshot.Scan(root, root_length, is_recursive, 0, false, thread_count);
+    if (result) Load(&snapshot);
+    snapshot.Destroy();
+    return result;
+}
+
+void DirectoryTree::Load(const DirectorySnapshot* snapshot)
+{
+    assert(snapshot);
+    Reset();
+
+    // Every entry becomes a node, and every name is already in the snapshot's pool, so size everything up front.
+    GrowNodes(snapshot->entry_count + 1);
+    names = (char16_t*)GrowArray(allocator, names, &name_capacity, snapshot->name_count, sizeof(char16_t));
+    children = (s32*)GrowArray(allocator, children, &child_capacity, snapshot->entry_count, sizeof(s32));
+    s32 hash_capacity = list_capacity;
+    lists = (ChildList*)GrowArray(allocator, lists, &list_capacity, snapshot->directory_count, sizeof(ChildList));
+    directory_hashes = (u64*)GrowArray(allocator, directory_hashes, &hash_capacity, snapshot->directory_count, sizeof(u64));
+
+    s32 root_node = AddNode(-1, 0, 0);
+    attributes[root_node] = FILE_ATTRIBUTE_DIRECTORY;
+
+    // Directories are sorted by path, so a directory always comes after its parent, which made a node for it.
+    for (s32 i = 0; i < snapshot->directory_count; ++i)
+    {
+        const DirectorySnapshot::Directory* directory = &snapshot->directories[i];
+        s32 node = Find(snapshot->names + directory->path_offset, directory->path_length);
+        if (node < 0 || !IsDirectory(node) || child_lists[node] >= 0) continue;
+        if (node == RootNode) modification_times[node] = directory->modification_time;
+        if (!directory->entry_count) continue;
+
+        // Entries are already sorted by name too, so they can go straight into the list.
+        ReserveList(node, directory->entry_count);
+        ChildList* list = &lists[child_lists[node]];
+        for (s32 j = 0; j < directory->entry_count; ++j)
+        {
+            const DirectorySnapshot::Entry* entry = &snapshot->entries[directory->first_entry + j];
+            if (entry->name_length > MaxNameLength) continue;
+
+            s32 child = AddNode(node, snapshot->names + entry->name_offset, entry->name_length);
+            sizes[child] = entry->size;
+            modification_times[child] = entry->modification_time;
+            attributes[child] = entry->attributes;
+            children[list->offset + list->count++] = child;
+        }
+    }
+
+    // Children always come after their parent here, so going backwards finishes each directory's hash before it's
+    // folded into its parent's.
+    for (s32 node = node_count - 1; node > RootNode; --node) directory_hashes[child_lists[parents[node]]] += GetEntryHash(node);
+}
+
+bool DirectoryTree::Apply(const DirectoryWatcher::FileChange& change)
+{
+    assert(node_count);
+
+    // Turn the full path back into one relative to the root.
+    char16_t full_path[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
+    s32 full_path_length = MultiByteToWideChar(CP_UTF8, 0, change.path, change.path_length, (LPWSTR)full_path, DIRECTORY_WATCHER_MAX_PATH_LENGTH);
+    if (change.action == EFileAction::TooManyChanges && full_path_length <= root_length)
+    {
+        // An empty path (a subscription that overflowed), the root itself or a directory above it all mean that anything
+        // in the tree may have changed, even though the path isn't under the root.
+        if (full_path_length <= 0) return false;
+        bool is_above_root = !memcmp(full_path, root, full_path_length * 2) &&
+                             (full_path_length == root_length || full_path[full_path_length - 1] == u'\\' || root[full_path_length] == u'\\');
+        if (is_above_root) return false;
+    }
+    if (full_path_length < root_length || memcmp(full_path, root, root_length * 2)) return true;
+    const char16_t* path = full_path + root_length;
+    s32 path_length = full_path_length - root_length;
+    if (path_length && root[root_length - 1] != u'\\')
+    {
+        // Spelled like the root, but really a sibling of it, like "C:\abc" for "C:\ab".
+        if (*path != u'\\') return true;
+        path += 1;
+        path_length -= 1;
+    }
+    if (change.action == EFileAction::TooManyChanges) return false;
+
+    bool result = true;
+    if (rename_from >= 0 && change.action != EFileAction::RenamedTo)
+    {
+        // Half a rename, so as far as we can tell it left the tree.
+        RemoveChild(parents[rename_from], rename_from);
+        FreeSubtree(rename_from);
+        rename_from = -1;
+        result = false;
+    }
+
+    if (!path_length)
+    {
+        if (change.action == EFileAction::Modified) SetMetadata(RootNode, change);
+        return result;
+    }
+
+    s32 name_start = path_length;
+    while (name_start > 0 && path[name_start - 1] != u'\\') name_start -= 1;
+    const char16_t* name = path + name_start;
+    s32 name_length = path_length - name_start;
+    s32 parent = (name_start) ? Find(path, name_start - 1) : RootNode;
+    if (parent < 0 || !IsDirectory(parent) || name_length > MaxNameLength)
+    {
+        if (change.action == EFileAction::RenamedTo) rename_from = -1;
+        return false;
+    }
+    s32 node = FindChild(parent, name, name_length);
+
+    switch (change.action)
+    {
+        case EFileAction::Added:
+        case EFileAction::Modified:
+        {
+            // NOTE: A Modified for something we don't have means we missed its addition, so add it now.
+            if (node < 0)
+            {
+                node = AddNode(parent, name, name_length);
+                InsertChild(parent, node);
+            }
+            else if (change.action == EFileAction::Added && IsDirectory(node) && !change.is_directory)
+            {
+                // A directory was replaced with a file of the same name.
+                RemoveChild(parent, node);
+                FreeSubtree(node);
+                node = AddNode(parent, name, name_length);
+                InsertChild(parent, node);
+            }
+            SetMetadata(node, change);
+        } break;
+        case EFileAction::Removed:
+        {
+            if (node >= 0)
+            {
+                RemoveChild(parent, node);
+                FreeSubtree(node);
+            }
+        } break;
+        case EFileAction::RenamedFrom:
+        {
+            rename_from = node;
+        } break;
+        case EFileAction::RenamedTo:
+        {
+            s32 moved = rename_from;
+            rename_from = -1;
+            if (moved < 0)
+            {
+                // Moved in from outside the tree. We can add the entry, but not whatever is in it.
+                if (change.is_directory) result = false;
+                if (node < 0)
+                {
+                    node = AddNode(parent, name, name_length);
+                    InsertChild(parent, node);
+                }
+                SetMetadata(node, change);
+                break;
+            }
+
+            // Renaming over an existing entry replaces it.
+            if (node >= 0 && node != moved)
+            {
+                RemoveChild(parent, node);
+                FreeSubtree(node);
+            }
+            // NOTE: Everything under a directory comes along with it, since children only know their parent.
+            RemoveChild(parents[moved], moved);
+            if (is_indexed) UnlinkSuffix(moved);
+            SetName(moved, name, name_length);
+            if (is_indexed) LinkSuffix(moved);
+            parents[moved] = parent;
+            InsertChild(parent, moved);
+            SetMetadata(moved, change);
+        } break;
+        default: break;
+    }
+
+    if (dead_name_count > 4096 && dead_name_count > name_count / 2) Compact();
+    else if (dead_child_count > 4096 && dead_child_count > child_count / 2) Compact();
+    return result;
+}
+
+void DirectoryTree::Destroy()
+{
+    const DirectoryWatcher::Allocator* kept_allocator = allocator;
+    Free(allocator, name_offsets);
+    Free(allocator, name_lengths);
+    Free(allocator, parents);
+    Free(allocator, child_lists);
+    Free(allocator, sizes);
+    Free(allocator, modification_times);
+    Free(allocator, attributes);
+    Free(allocator, lists);
+    Free(allocator, directory_hashes);
+    Free(allocator, children);
+    Free(allocator, names);
+    Free(allocator, stack);
+    Free(allocator, suffix_next);
+    Free(allocator, suffix_previous);
+    Free(allocator, suffix_buckets);
+    bool kept_is_indexed = is_indexed;
+    *this = {};
+    allocator = kept_allocator;
+    is_indexed = kept_is_indexed;
+}
+
+void DirectoryTree::EnableIndex()
+{
+    if (is_indexed) return;
+    is_indexed = true;
+    if (node_capacity)
+    {
+        suffix_next = (s32*)Allocate(allocator, (size_t)node_capacity * sizeof(s32));
+        suffix_previous = (s32*)Allocate(allocator, (size_t)node_capacity * sizeof(s32));
+    }
+    suffix_buckets = (s32*)Allocate(allocator, SuffixBucketCount * sizeof(s32));
+    for (s32 i = 0; i < SuffixBucketCount; ++i) suffix_buckets[i] = -1;
+    for (s32 node = RootNode + 1; node < node_count; ++node)
+    {
+        if (parents[node] != FreeNode) LinkSuffix(node);
+    }
+}
+
+s32 DirectoryTree::Query(const QueryFilter& filter, QueryCallback callback, void* context) const
+{
+    assert(callback);
+    if (!node_count) return 0;
+
+    char16_t under[MAX_PATH];
+    char16_t pattern[MAX_PATH];
+    char16_t suffix[MAX_PATH];
+    s32 under_length = (filter.under && *filter.under) ? MultiByteToWideChar(CP_UTF8, 0, filter.under, -1, (LPWSTR)under, MAX_PATH) - 1 : 0;
+    s32 pattern_length = (filter.pattern) ? MultiByteToWideChar(CP_UTF8, 0, filter.pattern, -1, (LPWSTR)pattern, MAX_PATH) - 1 : 0;
+    s32 suffix_length = (filter.suffix) ? MultiByteToWideChar(CP_UTF8, 0, filter.suffix, -1, (LPWSTR)suffix, MAX_PATH) - 1 : 0;
+    if (under_length < 0 || pattern_length < 0 || suffix_length < 0) return 0;
+
+    // Paths in the tree are always spelled with backslashes.
+    for (s32 i = 0; i < under_length; ++i) under[i] = (under[i] == u'/') ? u'\\' : under[i];
+    while (under_length && under[under_length - 1] == u'\\') under_length -= 1;
+    s32 top = Find(under, under_length);
+    if (top < 0) return 0;
+
+    auto matches = [&](s32 node, const char16_t* path)
+    {
+        bool is_directory = IsDirectory(node);
+        if (is_directory ? !filter.include_directories : !filter.include_files) return false;
+        if (modification_times[node] < filter.min_modification_time || modification_times[node] > filter.max_modification_time) return false;
+        if (sizes[node] < filter.min_size || sizes[node] > filter.max_size) return false;
+        if (suffix_length && !EndsWith(names + name_offsets[node], name_lengths[node], suffix, suffix_length)) return false;
+        return !filter.pattern || MatchesPattern(pattern, path);
+    };
+
+    char16_t path[MAX_PATH]; // NOTE: Relative paths, so MAX_PATH is enough here too. Anything longer is skipped.
+    s32 match_count = 0;
+
+    // With the index, a suffix that ends in an extension only has to look at the entries with that extension.
+    s32 extension_start = suffix_length;
+    while (extension_start > 0 && suffix[extension_start - 1] != u'.') extension_start -= 1;
+    if (is_indexed && extension_start > 0)
+    {
+        u32 hash = HashExtension(suffix + extension_start - 1, suffix_length - extension_start + 1);
+        for (s32 node = suffix_buckets[hash & (SuffixBucketCount - 1)]; node >= 0; node = suffix_next[node])
+        {
+            if (!EndsWith(names + name_offsets[node], name_lengths[node], suffix, suffix_length)) continue;
+
+            // Check it's under the directory we were asked about before doing anything more expensive.
+            s32 ancestor = parents[node];
+            while (ancestor != top && ancestor != RootNode) ancestor = parents[ancestor];
+            if (ancestor != top) continue;
+
+            if (!filter.is_recursive && parents[node] != top) continue;
+
+            s32 path_length = GetPath(node, path, MAX_PATH);
+            if (path_length < 0 || !matches(node, path)) continue;
+            match_count += 1;
+            if (!callback(context, this, node, path, path_length)) break;
+        }
+        return match_count;
+    }
+
+    // Otherwise walk everything under the directory. Children are sorted by name, so this visits paths in sorted order,
+    // the same as a sorted array of paths would, without having to keep one up to date.
+    struct Item
+    {
+        s32 node;
+        s32 parent_path_length;
+    };
+    const DirectoryWatcher::Allocator* scratch_allocator = allocator;
+    Item* items = 0;
+    s32 item_count = 0;
+    s32 item_capacity = 0;
+    auto push_children = [&](s32 directory, s32 path_length)
+    {
+        s32 count = 0;
+        const s32* nodes = GetChildren(directory, &count);
+        items = (Item*)GrowArray(scratch_allocator, items, &item_capacity, item_count + count, sizeof(Item));
+        for (s32 i = count - 1; i >= 0; --i) items[item_count++] = {nodes[i], path_length};
+    };
+
+    s32 top_length = GetPath(top, path, MAX_PATH);
+    if (top_length >= 0) push_children(top, top_length);
+    while (item_count)
+    {
+        Item item = items[--item_count];
+        s32 name_length = name_lengths[item.node];
+        s32 path_length = item.parent_path_length + (item.parent_path_length ? 1 : 0) + name_length;
+        if (path_length + 1 > MAX_PATH) continue;
+        if (item.parent_path_length) path[item.parent_path_length] = u'\\';
+        CopyMemory(path + path_length - name_length, names + name_offsets[item.node], name_length * 2);
+        path[path_length] = u'\0';
+
+        if (matches(item.node, path))
+        {
+            match_count += 1;
+            if (!callback(context, this, item.node, path, path_length)) break;
+        }
+        if (filter.is_recursive) push_children(item.node, path_length);
+    }
+    Free(scratch_allocator, items);
+    return match_count;
+}
+
+void DirectoryTree::Compact()
+{
+    // Copy every live name and list into fresh pools, in node order.
+    s32 new_name_capacity = name_count - dead_name_count + 1;
+    s32 new_child_capacity = child_count - dead_child_count + 1;
+    char16_t* new_names = (char16_t*)Allocate(allocator, (size_t)new_name_capacity * sizeof(char16_t));
+    s32* new_children = (s32*)Allocate(allocator, (size_t)new_child_capacity * sizeof(s32));
+    s32 new_name_count = 0;
+    s32 new_child_count = 0;
+    for (s32 node = 0; node < node_count; ++node)
+    {
+        if (parents[node] == FreeNode) continue;
+        CopyMemory(new_names + new_name_count, names + name_offsets[node], name_lengths[node] * 2);
+        name_offsets[node] = new_name_count;
+        new_name_count += name_lengths[node];
+
+        if (child_lists[node] < 0) continue;
+        ChildList* list = &lists[child_lists[node]];
+        CopyMemory(new_children + new_child_count, children + list->offset, list->count * sizeof(s32));
+        list->offset = new_child_count;
+        list->capacity = list->count;
+        new_child_count += list->count;
+    }
+
+    Free(allocator, names);
+    Free(allocator, children);
+    names = new_names;
+    name_count = new_name_count;
+    name_capacity = new_name_capacity;
+    children = new_children;
+    child_count = new_child_count;
+    child_capacity = new_child_capacity;
+    dead_name_count = 0;
+    dead_child_count = 0;
+}
+
+s32 DirectoryTree::Find(const char16_t* path, s32 path_length) const
+{
+    if (!node_count) return -1;
+    s32 node = RootNode;
+    s32 start = 0;
+    while (node >= 0 && start < path_length)
+    {
+        s32 end = start;
+        while (end < path_length && path[end] != u'\\') end += 1;
+        node = FindChild(node, path + start, end - start);
+        start = end + 1;
+    }
+    return node;
+}
+
+s32 DirectoryTree::FindChild(s32 directory, const char16_t* name, s32 name_length) const
+{
+    bool found = false;
+    s32 slot = FindSlot(directory, name, name_length, &found);
+    return (found) ? children[lists[child_lists[directory]].offset + slot] : -1;
+}
+
+s32 DirectoryTree::GetPath(s32 node, char16_t* out, s32 out_capacity) const
+{
+    // Measure first, then fill in from the end.
+    s32 length = 0;
+    for (s32 i = node; i != RootNode; i = parents[i]) length += name_lengths[i] + 1;
+    if (length) length -= 1;
+    if (length + 1 > out_capacity) return -1;
+
+    out[length] = u'\0';
+    s32 end = length;
+    for (s32 i = node; i != RootNode; i = parents[i])
+    {
+        end -= name_lengths[i];
+        CopyMemory(out + end, names + name_offsets[i], name_lengths[i] * 2);
+        if (end) out[--end] = u'\\';
+    }
+    return length;
+}
+
+const s32* DirectoryTree::GetChildren(s32 node, s32* out_count) const
+{
+    assert(out_count);
+    if (child_lists[node] < 0)
+    {
+        *out_count = 0;
+        return 0;
+    }
+    const ChildList* list = &lists[child_lists[node]];
+    *out_count = list->count;
+    return children + list->offset;
+}
+
+u64 DirectoryTree::GetEntryHash(s32 node) const
+{
+    u64 hash = 14695981039346656037ull;
+    const char16_t* name = names + name_offsets[node];
+    for (s32 i = 0; i < name_lengths[node]; ++i) hash = (hash ^ (u16)name[i]) * 1099511628211ull;
+
+    // Directories stand for what's in them, files for their size and modification time.
+    if (IsDirectory(node)) return Mix(hash + Mix(GetDirectoryHash(node) ^ 0x9E3779B97F4A7C15ull));
+    return Mix(hash + Mix(sizes[node] + Mix(modification_times[node])));
+}
+
+u64 DirectoryTree::GetMemoryUsage() const
+{
+    u64 per_node = sizeof(u32) + sizeof(u8) + sizeof(s32) + sizeof(s32) + sizeof(u64) + sizeof(u64) + sizeof(u32);
+    return per_node * node_capacity + (sizeof(ChildList) + sizeof(u64)) * (u64)list_capacity + sizeof(s32) * (u64)child_capacity +
+           sizeof(char16_t) * (u64)name_capacity + sizeof(s32) * (u64)stack_capacity +
+           ((is_indexed) ? 2 * sizeof(s32) * (u64)node_capacity + sizeof(s32) * (u64)SuffixBucketCount : 0);
+}
+
+void DirectoryTree::Diff(const DirectoryTree* from, const DirectoryTree* to, DiffCallback callback, void* context)
+{
+    assert(from && to && callback);
+    if (!from->node_count || !to->node_count) return;
+
+    // A pair of nodes with the same path, or one node that is only in one of the trees. The path buffer holds the
+    // path of the pair's parent when it's popped, because everything pushed after it was under that same parent.
+    struct Pair
+    {
+        s32 from_node;
+        s32 to_node;
+        s32 parent_path_length;
+    };
+
+    const DirectoryWatcher::Allocator* allocator = to->allocator;
+    Pair* pairs = 0;
+    s32 pair_count = 0;
+    s32 pair_capacity = 0;
+    auto push = [&](s32 from_node, s32 to_node, s32 parent_path_length)
+    {
+        pairs = (Pair*)GrowArray(allocator, pairs, &pair_capacity, pair_count + 1, sizeof(Pair));
+        pairs[pair_count++] = {from_node, to_node, parent_path_length};
+    };
+
+    char16_t path[MAX_PATH]; // NOTE: Relative paths, so MAX_PATH is enough here too. Anything longer is skipped.
+    push(RootNode, RootNode, 0);
+    while (pair_count)
+    {
+        Pair pair = pairs[--pair_count];
+        const DirectoryTree* tree = (pair.to_node >= 0) ? to : from;
+        s32 node = (pair.to_node >= 0) ? pair.to_node : pair.from_node;
+
+        s32 path_length = 0;
+        if (node != RootNode)
+        {
+            s32 name_length = tree->name_lengths[node];
+            path_length = pair.parent_path_length + (pair.parent_path_length ? 1 : 0) + name_length;
+            if (path_length + 1 > MAX_PATH) continue;
+            if (pair.parent_path_length) path[pair.parent_path_length] = u'\\';
+            CopyMemory(path + path_length - name_length, tree->names + tree->name_offsets[node], name_length * 2);
+            path[path_length] = u'\0';
+        }
+
+        if (pair.from_node < 0 || pair.to_node < 0)
+        {
+            // Only in one of the trees, so everything under it is too.
+            EFileAction action = (pair.to_node >= 0) ? EFileAction::Added : EFileAction::Removed;
+            callback(context, action, path, path_length, tree, node);
+            s32 count = 0;
+            const s32* nodes = tree->GetChildren(node, &count);
+            for (s32 i = 0; i < count; ++i)
+            {
+                if (pair.to_node >= 0) push(-1, nodes[i], path_length);
+                else push(nodes[i], -1, path_length);
+            }
+            continue;
+        }
+
+        bool was_directory = from->IsDirectory(pair.from_node);
+        bool is_directory = to->IsDirectory(pair.to_node);
+        if (was_directory != is_directory)
+        {
+            push(pair.from_node, -1, pair.parent_path_length);
+            push(-1, pair.to_node, pair.parent_path_length);
+            continue;
+        }
+        if (node != RootNode && (from->modification_times[pair.from_node] != to->modification_times[pair.to_node] ||
+                                 from->sizes[pair.from_node] != to->sizes[pair.to_node]))
+        {
+            callback(context, EFileAction::Modified, path, path_length, to, pair.to_node);
+        }
+        if (!is_directory) continue;
+        // Nothing under it changed, so there's no need to look.
+        if (from->GetDirectoryHash(pair.from_node) == to->GetDirectoryHash(pair.to_node)) continue;
+
+        // Same directory in both, merge the two sorted lists of children.
+        s32 old_count = 0;
+        s32 new_count = 0;
+        const s32* old_children = from->GetChildren(pair.from_node, &old_count);
+        const s32* new_children = to->GetChildren(pair.to_node, &new_count);
+        s32 a = 0;
+        s32 b = 0;
+        while (a < old_count || b < new_count)
+        {
+            s32 order = 0;
+            if (a == old_count) order = 1;
+            else if (b == new_count) order = -1;
+            else order = CompareNames(from->names + from->name_offsets[old_children[a]], from->name_lengths[old_children[a]],
+                                      to->names + to->name_offsets[new_children[b]], to->name_lengths[new_children[b]]);
+
+            if (order < 0) push(old_children[a++], -1, path_length);
+            else if (order > 0) push(-1, new_children[b++], path_length);
+            else push(old_children[a++], new_children[b++], path_length);
+        }
+    }
+    Free(allocator, pairs);
+}
+
+void DirectoryTree::Reset()
+{
+    node_count = 0;
+    live_node_count = 0;
+    list_count = 0;
+    child_count = 0;
+    name_count = 0;
+    free_node = -1;
+    free_list = -1;
+    dead_child_count = 0;
+    dead_name_count = 0;
+    rename_from = -1;
+    if (is_indexed)
+    {
+        if (!suffix_buckets) suffix_buckets = (s32*)Allocate(allocator, SuffixBucketCount * sizeof(s32));
+        for (s32 i = 0; i < SuffixBucketCount; ++i) suffix_buckets[i] = -1;
+    }
+}
+
+s32 DirectoryTree::AddNode(s32 parent, const char16_t* name, s32 name_length)
+{
+    assert(name_length <= MaxNameLength);
+    s32 node = free_node;
+    if (node >= 0) free_node = child_lists[node];
+    else
+    {
+        GrowNodes(node_count + 1);
+        node = node_count++;
+    }
+    live_node_count += 1;
+
+    parents[node] = parent;
+    child_lists[node] = -1;
+    sizes[node] = 0;
+    modification_times[node] = 0;
+    attributes[node] = 0;
+    name_lengths[node] = 0;
+    SetName(node, name, name_length);
+    if (is_indexed && node != RootNode) LinkSuffix(node);
+    return node;
+}
+
+void DirectoryTree::SetName(s32 node, const char16_t* name, s32 name_length)
+{
+    dead_name_count += name_lengths[node];
+    names = (char16_t*)GrowArray(allocator, names, &name_capacity, name_count + name_length, sizeof(char16_t));
+    CopyMemory(names + name_count, name, name_length * 2);
+    name_offsets[node] = name_count;
+    name_lengths[node] = (u8)name_length;
+    name_count += name_length;
+}
+
+void DirectoryTree::SetMetadata(s32 node, const DirectoryWatcher::FileChange& change)
+{
+    u64 old_hash = (node != RootNode) ? GetEntryHash(node) : 0;
+    sizes[node] = change.size;
+    modification_times[node] = change.modification_time;
+    attributes[node] = change.attributes;
+    if (change.is_directory) attributes[node] |= FILE_ATTRIBUTE_DIRECTORY;
+    // NOTE: The root's own metadata isn't part of any hash, there's nothing above it to hold it.
+    if (node != RootNode) UpdateHashes(parents[node], old_hash, GetEntryHash(node));
+}
+
+void DirectoryTree::InsertChild(s32 directory, s32 node)
+{
+    bool found = false;
+    s32 slot = FindSlot(directory, names + name_offsets[node], name_lengths[node], &found);
+    assert(!found);
+
+    ReserveList(directory, (child_lists[directory] >= 0) ? lists[child_lists[directory]].count + 1 : 4);
+    ChildList* list = &lists[child_lists[directory]];
+    s32* items = children + list->offset;
+    MoveMemory(items + slot + 1, items + slot, (list->count - slot) * sizeof(s32));
+    items[slot] = node;
+    list->count += 1;
+    UpdateHashes(directory, 0, GetEntryHash(node));
+}
+
+void DirectoryTree::RemoveChild(s32 directory, s32 node)
+{
+    bool found = false;
+    s32 slot = FindSlot(directory, names + name_offsets[node], name_lengths[node], &found);
+    assert(found);
+
+    ChildList* list = &lists[child_lists[directory]];
+    s32* items = children + list->offset;
+    MoveMemory(items + slot, items + slot + 1, (list->count - slot - 1) * sizeof(s32));
+    list->count -= 1;
+    UpdateHashes(directory, GetEntryHash(node), 0);
+}
+
+void DirectoryTree::UpdateHashes(s32 directory, u64 old_hash, u64 new_hash)
+{
+    // A directory's hash is the sum of its children's, so one child changing is a subtraction and an addition. That
+    // changes the directory's own entry hash in its parent, and so on up to the root.
+    while (old_hash != new_hash)
+    {
+        u64 old_directory_hash = (directory != RootNode) ? GetEntryHash(directory) : 0;
+        assert(child_lists[directory] >= 0);
+        directory_hashes[child_lists[directory]] += new_hash - old_hash;
+        if (directory == RootNode) break;
+
+        old_hash = old_directory_hash;
+        new_hash = GetEntryHash(directory);
+        directory = parents[directory];
+    }
+}
+
+void DirectoryTree::FreeSubtree(s32 node)
+{
+    s32 count = 0;
+    auto push = [&](s32 item)
+    {
+        stack = (s32*)GrowArray(allocator, stack, &stack_capacity, count + 1, sizeof(s32));
+        stack[count++] = item;
+    };
+
+    push(node);
+    while (count)
+    {
+        s32 item = stack[--count];
+        if (item == rename_from) rename_from = -1;
+        if (child_lists[item] >= 0)
+        {
+            s32 list_index = child_lists[item];
+            ChildList* list = &lists[list_index];
+            for (s32 i = 0; i < list->count; ++i) push(children[list->offset + i]);
+            list = &lists[list_index];
+
+            dead_child_count += list->capacity;
+            list->offset = (u32)free_list;
+            list->count = 0;
+            list->capacity = 0;
+            free_list = list_index;
+        }
+
+        if (is_indexed && item != RootNode) UnlinkSuffix(item);
+        dead_name_count += name_lengths[item];
+        name_lengths[item] = 0;
+        parents[item] = FreeNode;
+        child_lists[item] = free_node;
+        free_node = item;
+        live_node_count -= 1;
+    }
+}
+
+s32 DirectoryTree::FindSlot(s32 directory, const char16_t* name, s32 name_length, bool* out_found) const
+{
+    *out_found = false;
+    if (child_lists[directory] < 0) return 0;
+    const ChildList* list = &lists[child_lists[directory]];
+    const s32* items = children + list->offset;
+
+    s32 low = 0;
+    s32 high = list->count - 1;
+    while (low <= high)
+    {
+        s32 middle = low + (high - low) / 2;
+        s32 order = CompareNames(names + name_offsets[items[middle]], name_lengths[items[middle]], name, name_length);
+        if (order == 0)
+        {
+            *out_found = true;
+            return middle;
+        }
+        else if (order < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+    return low;
+}
+
+void DirectoryTree::GrowNodes(s32 needed)
+{
+    if (needed <= node_capacity) return;
+
+    // All the node arrays grow together, so they share one capacity.
+    s32 capacity = 0;
+    auto grow = [&](void* data, s32 element_size)
+    {
+        capacity = node_capacity;
+        return GrowArray(allocator, data, &capacity, needed, element_size);
+    };
+    name_offsets = (u32*)grow(name_offsets, sizeof(u32));
+    name_lengths = (u8*)grow(name_lengths, sizeof(u8));
+    parents = (s32*)grow(parents, sizeof(s32));
+    child_lists = (s32*)grow(child_lists, sizeof(s32));
+    sizes = (u64*)grow(sizes, sizeof(u64));
+    modification_times = (u64*)grow(modification_times, sizeof(u64));
+    attributes = (u32*)grow(attributes, sizeof(u32));
+    if (is_indexed)
+    {
+        suffix_next = (s32*)grow(suffix_next, sizeof(s32));
+        suffix_previous = (s32*)grow(suffix_previous, sizeof(s32));
+    }
+    node_capacity = capacity;
+}
+
+void DirectoryTree::LinkSuffix(s32 node)
+{
+    s32* head = &suffix_buckets[HashExtension(names + name_offsets[node], name_lengths[node]) & (SuffixBucketCount - 1)];
+    suffix_previous[node] = -1;
+    suffix_next[node] = *head;
+    if (*head >= 0) suffix_previous[*head] = node;
+    *head = node;
+}
+
+void DirectoryTree::UnlinkSuffix(s32 node)
+{
+    if (suffix_previous[node] >= 0) suffix_next[suffix_previous[node]] = suffix_next[node];
+    else suffix_buckets[HashExtension(names + name_offsets[node], name_lengths[node]) & (SuffixBucketCount - 1)] = suffix_next[node];
+    if (suffix_next[node] >= 0) suffix_previous[suffix_next[node]] = suffix_previous[node];
+}
+
+void DirectoryTree::ReserveList(s32 directory, s32 needed)
+{
+    if (child_lists[directory] < 0)
+    {
+        s32 list_index = free_list;
+        if (list_index >= 0) free_list = (s32)lists[list_index].offset;
+        else
+        {
+            s32 hash_capacity = list_capacity;
+            lists = (ChildList*)GrowArray(allocator, lists, &list_capacity, list_count + 1, sizeof(ChildList));
+            directory_hashes = (u64*)GrowArray(allocator, directory_hashes, &hash_capacity, list_count + 1, sizeof(u64));
+            list_index = list_count++;
+        }
+        lists[list_index] = {0, 0, 0};
+        directory_hashes[list_index] = 0;
+        child_lists[directory] = list_index;
+    }
+
+    ChildList* list = &lists[child_lists[directory]];
+    if (needed <= list->capacity) return;
+
+    // Move the list to the end of the pool with room to grow, leaving a hole behind for Compact().
+    s32 new_capacity = (list->capacity) ? list->capacity : 4;
+    while (new_capacity < needed) new_capacity *= 2;
+    if (list->capacity == 0 && !list->count) new_capacity = needed;
+    children = (s32*)GrowArray(allocator, children, &child_capacity, child_count + new_capacity, sizeof(s32));
+    CopyMemory(children + child_count, children + list->offset, list->count * sizeof(s32));
+    dead_child_count += list->capacity;
+    list->offset = child_count;
+    list->capacity = new_capacity;
+    child_count += new_capacity;
+}
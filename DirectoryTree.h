@@ -0,0 +1,179 @@
+#pragma once
+
+/*
+DirectoryTree is a live, in-memory copy of a directory tree that is kept up to date from the changes a
+DirectoryWatcher reports. Scan() fills it in once, then Apply() each change as it's read, and the tree
+follows along without going back to the disk.
+
+Where DirectorySnapshot is a flat record per entry that is rebuilt from scratch on every scan, this is laid
+out for holding millions of entries for a long time, and for changing in place. Every entry is a node, and
+each field of a node lives in its own array, indexed by node: name offset, name length, parent, size,
+modification time and attributes. Code that only looks at one field (sizes, say) walks one dense array, and
+nothing is paid for pointers or padding. Names are stored in one string pool. Each directory has a list of its
+child nodes, stored contiguously in a shared child pool and sorted by name, so finding a path is a binary
+search per component, and comparing two trees is a merge. That comes to 37 bytes per node, plus the name
+(two bytes per character) and 20 bytes per directory with children, so a typical tree of 10 million entries
+with names of a dozen characters or so fits in under 64 bytes per entry, about 600MB (GetMemoryUsage() has
+the real figure, spare capacity included).
+
+Because nodes point at their parent rather than holding their path, renaming or moving a directory is just
+a new name and a new parent for one node, however much is under it. Removing an entry frees its node (and
+everything under it) for reuse. Names and child lists that are replaced leave holes in their pools, which
+are squeezed out by Compact(), called automatically once more than half of a pool is holes.
+
+Apply() returns false when the tree can no longer be trusted to match the disk: a TooManyChanges (inside the
+tree, for the root or a directory above it, or with an empty path from an overflowed subscription), a change
+whose parent directory isn't in the tree, or a directory moved in from outside the tree (the watcher only
+reports the directory itself, not what's in it). Scan() again to get back in step.
+
+Each directory also keeps a Merkle-style hash of everything under it: the sum of a hash of each child's name
+with its size and modification time (for a file) or its own directory hash (for a directory). A sum can be
+updated in place, so applying a change costs one step per level up to the root, and the root hash is always
+current. Two trees with the same root hash hold the same thing, so checking for any change at all is one
+comparison, and Diff() only goes into directories whose hashes differ. After an overflow or a restart, scan
+into a second tree and Diff() it against the live one: the cost of the comparison is in what changed, not
+in the size of the tree.
+
+Query() answers questions like "every *.hlsl under shaders\ changed since T" from memory, without touching
+the disk. Filters are a directory to look under, a glob pattern, a name suffix, and ranges of modification
+time and size. With nothing else to go on it walks the tree under the directory, and since children are
+sorted that yields paths in sorted order, the same as a sorted array of every path would, without the cost
+of keeping one up to date. EnableIndex() adds an index of entries by extension, a hash table of buckets
+chained through two more arrays (8 bytes per node), kept up to date by Apply() along with everything else.
+A query with a suffix that ends in an extension then only looks at the entries with that extension.
+
+Names are compared ordinally, the way the file system hands them back, so paths should be spelled with the
+same case as they are on disk. None of this is thread safe; call Apply() from the thread that reads the
+changes.
+*/
+
+#include "DirectoryWatcher.h"
+#include "DirectorySnapshot.h"
+
+struct DirectoryTree
+{
+    static const s32 RootNode = 0; // The root has an empty name and a parent of -1.
+    static const s32 FreeNode = -2; // The parent of a node that isn't in use.
+    static const s32 MaxNameLength = 255; // In char16_t units, the longest name NTFS allows. Longer names are left out.
+
+    struct ChildList
+    {
+        u32 offset; // In the child pool.
+        s32 count;
+        s32 capacity;
+    };
+
+    static const s32 SuffixBucketCount = 4096; // Must be a power of two.
+
+    struct QueryFilter
+    {
+        const char* under = 0; // Relative path of the directory to look in. Null or empty means the root.
+        bool is_recursive = true; // Look at everything under it, rather than just what's directly in it.
+        const char* pattern = 0; // Optional. Matched against the path relative to the root, same rules as SubscriptionFilter.
+        const char* suffix = 0; // Optional. The name has to end with this, ignoring case, like ".hlsl".
+        u64 min_modification_time = 0;
+        u64 max_modification_time = ~0ull;
+        u64 min_size = 0;
+        u64 max_size = ~0ull;
+        bool include_files = true;
+        bool include_directories = false;
+    };
+
+    // Called for each match, with its path relative to the root. Return false to stop the query.
+    typedef bool (*QueryCallback)(void* context, const DirectoryTree* tree, s32 node, const char16_t* path, s32 path_length);
+
+    // The path is relative to the root. The node is in from for Removed, and in to for everything else.
+    typedef void (*DiffCallback)(void* context, DirectoryWatcher::EFileAction action, const char16_t* path, s32 path_length, const DirectoryTree* tree, s32 node);
+
+    const DirectoryWatcher::Allocator* allocator = 0; // Where the arrays come from. Null means malloc() and free().
+
+    // One element per node, all node_capacity long.
+    u32* name_offsets = 0; // Offset of the name in the string pool, in char16_t units. Not null terminated.
+    u8* name_lengths = 0;
+    s32* parents = 0;
+    s32* child_lists = 0; // Index of the node's list of children, or -1 for files and directories without any. Links the free nodes.
+    u64* sizes = 0;
+    u64* modification_times = 0;
+    u32* attributes = 0;
+    s32 node_count = 0; // Nodes used so far, including free ones.
+    s32 node_capacity = 0;
+    s32 live_node_count = 0;
+
+    ChildList* lists = 0;
+    u64* directory_hashes = 0; // One per list, the hash of everything under the directory that owns it.
+    s32 list_count = 0;
+    s32 list_capacity = 0;
+    s32* children = 0;
+    s32 child_count = 0;
+    s32 child_capacity = 0;
+    char16_t* names = 0;
+    s32 name_count = 0;
+    s32 name_capacity = 0;
+
+    // Scans the tree under root_path (spelled the same as it was for AddDirectory()), replacing anything already in the tree.
+    // False if the root couldn't be read.
+    bool Scan(const char* root_path, bool is_recursive, s32 thread_count);
+    // Replaces the contents of the tree with a snapshot, keeping the root Apply() expects.
+    void Load(const DirectorySnapshot* snapshot);
+    // Applies one change to the tree. False if the tree may no longer match the disk and should be scanned again.
+    bool Apply(const DirectoryWatcher::FileChange& change);
+    // Frees all memory held by the tree. The allocator is kept, so the tree can be reused.
+    void Destroy();
+    // Squeezes the holes out of the string and child pools.
+    void Compact();
+    // Starts keeping an index of entries by extension for Query(). It stays on for the life of the tree, Destroy() included.
+    void EnableIndex();
+    // Calls callback for every entry that passes the filter. Returns the number of matches.
+    s32 Query(const QueryFilter& filter, QueryCallback callback, void* context) const;
+
+    // Returns the node with the given relative path, or -1 if there isn't one.
+    s32 Find(const char16_t* path, s32 path_length) const;
+    s32 FindChild(s32 directory, const char16_t* name, s32 name_length) const;
+    // Writes the relative path of a node, null terminated. Returns its length, or -1 if it doesn't fit.
+    s32 GetPath(s32 node, char16_t* out, s32 out_capacity) const;
+    // Returns the children of a node, sorted by name, or null for a node without any.
+    const s32* GetChildren(s32 node, s32* out_count) const;
+    bool IsDirectory(s32 node) const {return (attributes[node] & FILE_ATTRIBUTE_DIRECTORY) != 0;}
+    // Hash of the names, sizes and modification times of everything under a directory. Zero for an empty one.
+    u64 GetDirectoryHash(s32 directory) const {return (child_lists[directory] >= 0) ? directory_hashes[child_lists[directory]] : 0;}
+    // The same, for the whole tree. If two trees of the same root have the same root hash, nothing changed between them.
+    u64 GetRootHash() const {return (node_count) ? GetDirectoryHash(RootNode) : 0;}
+    // Hash of one entry: its name, plus its size and modification time for a file, or its directory hash for a directory.
+    u64 GetEntryHash(s32 node) const;
+    // Bytes held by the tree, including unused capacity.
+    u64 GetMemoryUsage() const;
+
+    // Reports every entry that was added, removed or modified between two trees of the same root. Directories with the
+    // same hash in both are skipped.
+    static void Diff(const DirectoryTree* from, const DirectoryTree* to, DiffCallback callback, void* context);
+
+private:
+
+    char16_t root[MAX_PATH] = {};
+    s32 root_length = 0;
+    s32 free_node = -1;
+    s32 free_list = -1; // Lists that aren't in use, linked through their offset.
+    s32 dead_child_count = 0; // Slots in the child pool that no list owns any more.
+    s32 dead_name_count = 0; // Characters in the string pool that no node owns any more.
+    s32 rename_from = -1; // Node named by a RenamedFrom, waiting for its RenamedTo.
+    s32* stack = 0; // Scratch space for FreeSubtree().
+    s32 stack_capacity = 0;
+    bool is_indexed = false;
+    s32* suffix_next = 0; // Per node, the next and previous entries with an extension in the same bucket.
+    s32* suffix_previous = 0;
+    s32* suffix_buckets = 0; // First entry in each bucket, or -1.
+
+    void Reset();
+    s32 AddNode(s32 parent, const char16_t* name, s32 name_length);
+    void SetName(s32 node, const char16_t* name, s32 name_length);
+    void SetMetadata(s32 node, const DirectoryWatcher::FileChange& change);
+    void InsertChild(s32 directory, s32 node);
+    void RemoveChild(s32 directory, s32 node);
+    void FreeSubtree(s32 node);
+    s32 FindSlot(s32 directory, const char16_t* name, s32 name_length, bool* out_found) const;
+    void GrowNodes(s32 needed);
+    void ReserveList(s32 directory, s32 needed);
+    void UpdateHashes(s32 directory, u64 old_hash, u64 new_hash);
+    void LinkSuffix(s32 node);
+    void UnlinkSuffix(s32 node);
+};
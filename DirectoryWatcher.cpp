@@ -1,213 +1,1526 @@
 #include "DirectoryWatcher.h"
+#include "ChangeJournal.h"
+#include "NotificationRecording.h"
+#include "SharedChangeRing.h"
+#include "DirectoryWatcherInternal.h"
+#ifndef DIRECTORY_WATCHER_FIXED_CAPACITY
+#include "DirectorySnapshot.h"
+#endif
 
-void DirectoryWatcher::Initialize()
+// A change shared between every subscription that wants it. Freed when the last one is done with it.
+struct SharedChange
 {
+    volatile s32 reference_count;
+    DirectoryWatcher::FileChange change;
+};
+
+struct DirectoryWatcher::Subscription
+{
+    static const s32 InitialCapacity = 16;
+
+    DirectoryWatcher::QueueLock lock;
+    SharedChange** data;
+    s32 capacity;
+    s32 max_capacity; // 0 means no limit.
+    s32 count;
+    s32 front_index;
+    bool did_overflow; // Set when changes were dropped, the next read reports TooManyChanges instead.
+    bool is_in_rename; // Set after a RenamedFrom was delivered, so the RenamedTo that follows is delivered too.
+    u64 oldest_change_tick; // When the change at the front of the queue was pushed.
+    WakeupProc wakeup_proc; // Armed by ArmWakeup(), cleared when it fires.
+    void* wakeup_context;
+
+    u32 action_mask;
+    char* path_prefix;
+    s32 path_prefix_length;
+    char* path_pattern; // Null if there isn't one.
+
+    DirectoryWatcher::Handler* handler; // Set if changes are pushed to a handler instead of being read by the caller.
+
+    Subscription* next;
+
+    inline void Lock() {lock.Lock();}
+    inline void Unlock() {lock.Unlock();}
+};
+
+struct DirectoryWatcher::Handler
+{
+    DirectoryWatcher* watcher;
+    Subscription* subscription;
+    ChangeHandlerProc proc;
+    void* context;
+    EDispatchMode mode;
+    s32 max_batch_count;
+    s32 max_batch_delay_ms;
+    FileChange* batch; // max_batch_count changes, filled by whoever is delivering.
+
+    QueueLock deliver_lock; // Held while delivering, so batches reach the handler one at a time and in order.
+    PTP_TIMER timer; // ThreadPool mode only.
+    PTP_WORK work;
+    volatile s32 is_timer_set;
+    volatile s32 is_work_queued;
+};
+
+void DirectoryWatcher::Initialize() {Initialize(Settings());}
+
+void DirectoryWatcher::Initialize(const Settings& in_settings)
+{
+    settings = in_settings;
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    settings.max_watched_directories = 0; // The watch budget relies on polling, which isn't available here.
+#endif
     requests = 0;
+    next_request_id = 0;
+    subscriptions = 0;
+    InitializeSRWLock(&subscription_lock);
+    inline_handler_count = 0;
+    InitializeSRWLock(&push_lock);
+    history_lock = {};
+    sequence = 0;
+    history_count = 0;
+    history_front_index = 0;
+    history = 0;
+    if (settings.history_count > 0)
+    {
+        history = (FileChange*)settings.allocator.Allocate(sizeof(FileChange) * settings.history_count, EMemoryTag::History);
+        assert(history);
+    }
+    // Anything that differs between runs will do, it only has to stop cursors from one instance matching another.
+    LARGE_INTEGER counter = {};
+    QueryPerformanceCounter(&counter);
+    instance_id = (u64)counter.QuadPart ^ ((u64)(size_t)this << 32) ^ GetTickCount64();
+
+    journal = 0;
+    did_journal_fail = false;
+    if (settings.journal_directory)
+    {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        journal = (ChangeJournal*)settings.allocator.Allocate(sizeof(ChangeJournal), EMemoryTag::Journal);
+        assert(journal);
+        *journal = {};
+        if (!journal->Open(settings.journal_directory, instance_id, ((u64)now.dwHighDateTime << 32) | now.dwLowDateTime, settings.journal_segment_size, &settings.allocator))
+        {
+            journal->Close();
+            settings.allocator.Free(journal, EMemoryTag::Journal);
+            journal = 0;
+            did_journal_fail = true;
+        }
+    }
+    shared_ring = 0;
+    if (settings.shared_ring_name)
+    {
+        shared_ring = (SharedChangeRing*)settings.allocator.Allocate(sizeof(SharedChangeRing), EMemoryTag::SharedRing);
+        assert(shared_ring);
+        *shared_ring = {};
+        if (!shared_ring->Open(settings.shared_ring_name, settings.shared_ring_count, instance_id))
+        {
+            settings.allocator.Free(shared_ring, EMemoryTag::SharedRing);
+            shared_ring = 0;
+        }
+    }
+    recorder = 0;
+    if (settings.record_path)
+    {
+        recorder = (NotificationRecorder*)settings.allocator.Allocate(sizeof(NotificationRecorder), EMemoryTag::Recording);
+        assert(recorder);
+        *recorder = {};
+        bool did_open = recorder->Open(settings.record_path, &settings.allocator);
+        assert(did_open); // Asking for a recording and not getting one is almost certainly a mistake.
+        if (!did_open)
+        {
+            settings.allocator.Free(recorder, EMemoryTag::Recording);
+            recorder = 0;
+        }
+    }
+
+    poll_timer = 0;
+    is_polling = 0;
+    promotion_count = 0;
+    demotion_count = 0;
     should_terminate = false;
-    outstanding_request_count = 0;
-    queue.Create();
-    thread_handle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)DirectoryWatcher::ThreadProc, this, 0, 0);
+    merged_wakeup = 0;
+    for (s32 i = 0; i < LaneCount; ++i) lane_credits[i] = 0;
+
+    // One thread, and one segment of the default queue, per shard.
+    shard_count = (settings.watcher_thread_count > 1) ? settings.watcher_thread_count : 1;
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    if (shard_count > DIRECTORY_WATCHER_MAX_SHARDS) shard_count = DIRECTORY_WATCHER_MAX_SHARDS;
+    shards = shard_storage;
+#else
+    shards = (Shard*)settings.allocator.AllocateAligned(sizeof(Shard) * shard_count, EMemoryTag::Queue);
+    assert(shards);
+#endif
+    for (s32 i = 0; i < shard_count; ++i)
+    {
+        Shard* shard = &shards[i];
+        shard->watcher = this;
+        shard->outstanding_request_count = 0;
+        shard->directory_count = 0;
+        shard->change_count = 0;
+        for (s32 lane = 0; lane < LaneCount; ++lane) shard->lanes[lane].Create(settings.max_queue_count, settings.queue_full_policy, &settings.allocator);
+        shard->thread_handle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)DirectoryWatcher::ThreadProc, shard, 0, 0);
+    }
+}
+
+void DirectoryWatcher::ShutDown()
+{
+    should_terminate = true;
+
+    // Stop the poll timer first, and wait for any rescan in progress, since polled requests are freed below.
+    if (poll_timer)
+    {
+        SetThreadpoolTimer((PTP_TIMER)poll_timer, 0, 0, 0);
+        WaitForThreadpoolTimerCallbacks((PTP_TIMER)poll_timer, true);
+        CloseThreadpoolTimer((PTP_TIMER)poll_timer);
+        poll_timer = 0;
+    }
+
+    ReadChangesRequest* current = requests;
+    while (current)
+    {
+        ReadChangesRequest* request = current;
+        current = current->next;
+        if (request->mode == EWatchMode::Polled || request->mode == EWatchMode::Replayed)
+        {
+            // Polled and replayed requests have no I/O in flight, so nothing else will free them.
+            FreeRequest(request);
+        }
+        else
+        {
+            CancelIo(request->directory);
+            CloseHandle(request->directory);
+        }
+    }
+
+    // Closing the handles queues the aborted completions, and the wake gets a thread with nothing in flight to
+    // notice it's done. The shards are freed below, so every thread has to be gone first.
+    for (s32 i = 0; i < shard_count; ++i)
+    {
+        QueueUserAPC(DirectoryWatcher::ThreadWakeProc, shards[i].thread_handle, 0);
+        WaitForSingleObject(shards[i].thread_handle, INFINITE);
+        CloseHandle(shards[i].thread_handle);
+        for (s32 lane = 0; lane < LaneCount; ++lane) shards[i].lanes[lane].Destroy();
+    }
+#ifndef DIRECTORY_WATCHER_FIXED_CAPACITY
+    settings.allocator.FreeAligned(shards, EMemoryTag::Queue);
+#endif
+    shards = 0;
+    shard_count = 0;
+
+    if (history) settings.allocator.Free(history, EMemoryTag::History);
+    history = 0;
+
+    if (recorder)
+    {
+        recorder->Close();
+        settings.allocator.Free(recorder, EMemoryTag::Recording);
+        recorder = 0;
+    }
+
+    // Everything that's going to be pushed has been, so this writes out the last of it.
+    if (journal)
+    {
+        journal->Close();
+        settings.allocator.Free(journal, EMemoryTag::Journal);
+        journal = 0;
+    }
+    if (shared_ring)
+    {
+        shared_ring->Close();
+        settings.allocator.Free(shared_ring, EMemoryTag::SharedRing);
+        shared_ring = 0;
+    }
+
+    AcquireSRWLockExclusive(&subscription_lock);
+    while (subscriptions)
+    {
+        Subscription* subscription = subscriptions;
+        subscriptions = subscription->next;
+        DestroySubscription(subscription);
+    }
+    ReleaseSRWLockExclusive(&subscription_lock);
+}
+
+bool DirectoryWatcher::AddDirectory(const char* directory, bool is_recursive, s32 change_buffer_size, EPriority priority)
+{
+    assert(shards && directory && change_buffer_size > 0);
+    ReadChangesRequest* request = CreateRequest(directory, is_recursive, change_buffer_size, priority);
+    if (!request) return false;
+
+    // Over the watch budget, start out polled. The buffers are kept so the directory can be promoted later.
+    if (settings.max_watched_directories > 0 && CountWatchedDirectories() >= settings.max_watched_directories)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+        if (!GetFileAttributesExW((LPWSTR)request->path, GetFileExInfoStandard, &attributes) || !(attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            FreeRequest(request);
+            return false;
+        }
+        BeginPolling(request);
+        AppendRequest(request);
+        return true;
+    }
+
+    // Go ahead and open the directory handle.
+    u32 mode = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    u32 flags = FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED;
+    request->directory = CreateFileW((LPWSTR)request->path, FILE_LIST_DIRECTORY, mode, 0, OPEN_EXISTING, flags, 0);
+
+    // Add the request to the list, or free the buffer if we didn't get a valid directory handle.
+    if (request->directory != (void*)-1)
+    {
+        AppendRequest(request);
+        QueueUserAPC(DirectoryWatcher::ThreadAddDirectoryProc, request->shard->thread_handle, (u64)request);
+        return true;
+    }
+    else
+    {
+        FreeRequest(request);
+        return false;
+    }
+}
+
+bool DirectoryWatcher::AddPolledDirectory(const char* directory, bool is_recursive, EPriority priority)
+{
+    assert(shards && directory);
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    return false; // Polling needs memory proportional to the size of the tree.
+#else
+    ReadChangesRequest* request = CreateRequest(directory, is_recursive, 0, priority);
+    if (!request) return false;
+
+    // We don't keep a handle open, but make sure the directory is actually there before agreeing to poll it.
+    WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+    if (GetFileAttributesExW((LPWSTR)request->path, GetFileExInfoStandard, &attributes) && (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        BeginPolling(request);
+        AppendRequest(request);
+        return true;
+    }
+    else
+    {
+        FreeRequest(request);
+        return false;
+    }
+#endif
+}
+
+// Checks that every event in a recorded notification buffer lies inside it, so ProcessNotification() can walk it safely.
+static bool IsValidNotificationBuffer(const u8* buffer, u32 size)
+{
+    const u32 header_size = (u32)offsetof(FILE_NOTIFY_EXTENDED_INFORMATION, FileName);
+    for (u32 offset = 0;;)
+    {
+        if (offset % sizeof(DWORD) || size - offset < header_size) return false;
+        FILE_NOTIFY_EXTENDED_INFORMATION event;
+        CopyMemory(&event, buffer + offset, header_size);
+        if (event.FileNameLength % 2 || event.FileNameLength / 2 >= MAX_PATH || event.FileNameLength > size - offset - header_size) return false;
+        if (!event.NextEntryOffset) return true;
+        if (event.NextEntryOffset >= size - offset) return false;
+        offset += event.NextEntryOffset;
+    }
+}
+
+bool DirectoryWatcher::Replay(const char* recording_path, EReplaySpeed speed, double speed_scale)
+{
+    assert(shards && recording_path);
+    NotificationRecordingReader reader;
+    if (!reader.Open(recording_path)) return false;
+
+    // Directory ids in the recording are whatever the recording watcher handed out, so map them to our own requests.
+    struct ReplayedDirectory
+    {
+        s32 recorded_id;
+        ReadChangesRequest* request;
+    };
+    ReplayedDirectory* directories = 0;
+    s32 directory_count = 0;
+    s32 directory_capacity = 0;
+
+    LARGE_INTEGER frequency = {};
+    QueryPerformanceFrequency(&frequency);
+    double ticks_per_recorded_tick = (double)frequency.QuadPart / (double)reader.header.ticks_per_second;
+    if (speed == EReplaySpeed::Scaled && speed_scale > 0.0) ticks_per_recorded_tick /= speed_scale;
+    LARGE_INTEGER start = {};
+    QueryPerformanceCounter(&start);
+
+    NotificationRecording::Chunk chunk;
+    const u8* payload = 0;
+    while (reader.Next(&chunk, &payload))
+    {
+        if (chunk.type == NotificationRecording::EChunkType::Directory)
+        {
+            // Paths are recorded the way we keep them, in UTF-16, but CreateRequest() takes UTF-8.
+            char path[MAX_PATH * 3];
+            s32 path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)payload, chunk.size / 2, path, sizeof(path) - 1, 0, 0);
+            if (path_length <= 0) continue;
+            path[path_length] = '\0';
+
+            ReadChangesRequest* request = CreateRequest(path, chunk.is_recursive != 0, 0, EPriority::Normal);
+            if (!request) continue;
+            request->mode = EWatchMode::Replayed;
+            AppendRequest(request);
+
+            if (directory_count == directory_capacity)
+            {
+                s32 new_capacity = (directory_capacity) ? directory_capacity * 2 : 16;
+                ReplayedDirectory* new_directories = (ReplayedDirectory*)settings.allocator.Allocate(sizeof(ReplayedDirectory) * new_capacity, EMemoryTag::Recording);
+                assert(new_directories);
+                if (directory_count) CopyMemory(new_directories, directories, sizeof(ReplayedDirectory) * directory_count);
+                if (directories) settings.allocator.Free(directories, EMemoryTag::Recording);
+                directories = new_directories;
+                directory_capacity = new_capacity;
+            }
+            directories[directory_count++] = {chunk.directory_id, request};
+            continue;
+        }
+
+        ReadChangesRequest* request = 0;
+        for (s32 i = 0; i < directory_count && !request; ++i)
+        {
+            if (directories[i].recorded_id == chunk.directory_id) request = directories[i].request;
+        }
+        if (!request) continue;
+
+        // Sleep most of the way, then spin, so notifications come out about as far apart as they went in.
+        if (speed != EReplaySpeed::Max)
+        {
+            s64 due = start.QuadPart + (s64)((double)chunk.time * ticks_per_recorded_tick);
+            for (;;)
+            {
+                LARGE_INTEGER now = {};
+                QueryPerformanceCounter(&now);
+                if (now.QuadPart >= due) break;
+                s64 remaining_ms = (due - now.QuadPart) * 1000 / frequency.QuadPart;
+                if (remaining_ms > 1) Sleep((u32)(remaining_ms - 1));
+                else YieldProcessor();
+            }
+        }
+
+        // NOTE: ProcessNotification() only reads the buffer, so it's fine to hand it the mapped file. It does trust it
+        // to be laid out the way the kernel would, so a damaged chunk is skipped rather than followed off the end.
+        bool has_buffer = chunk.type == NotificationRecording::EChunkType::Notification && chunk.size > 0;
+        if (has_buffer && !IsValidNotificationBuffer(payload, chunk.size)) continue;
+        ProcessNotification(request, (has_buffer) ? (u8*)payload : 0);
+        DispatchInlineHandlers();
+    }
+
+    if (directories) settings.allocator.Free(directories, EMemoryTag::Recording);
+    reader.Close();
+    return true;
+}
+
+DirectoryWatcher::ReadChangesRequest* DirectoryWatcher::CreateRequest(const char* directory, bool is_recursive, s32 change_buffer_size, EPriority priority)
+{
+     // Get the number of bytes in the converted string, including the null terminator, so we know
+     // how big of a buffer we will need.
+    s32 path_count = MultiByteToWideChar(CP_UTF8, 0, directory, -1, 0, 0);
+
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    // Claim the first free slot. The buffer size is capped at whatever the slots were compiled with.
+    if (path_count <= 0 || path_count > MAX_PATH) return 0;
+    RequestSlot* slot = 0;
+    for (s32 i = 0; !slot && i < DIRECTORY_WATCHER_MAX_DIRECTORIES; ++i)
+    {
+        if (InterlockedCompareExchange((LPLONG)&request_slot_used[i], 1, 0) == 0) slot = &request_slots[i];
+    }
+    if (!slot) return 0;
+
+    ReadChangesRequest* request = &slot->request;
+    *request = {};
+    request->buffers = slot->buffers;
+    request->buffer_size = (change_buffer_size < DIRECTORY_WATCHER_BUFFER_SIZE) ? change_buffer_size : DIRECTORY_WATCHER_BUFFER_SIZE;
+    request->path = slot->path;
+#else
+    // Allocate space for the request struct, two buffers, and the directory path. The struct's size is a whole
+    // number of cache lines, so the buffers start on a line of their own.
+    u8* memory = (u8*)settings.allocator.AllocateAligned(sizeof(ReadChangesRequest) + (2 * change_buffer_size) + (2 * path_count), EMemoryTag::Request);
+    assert(memory && path_count > 0); // Make sure we got our memory, and that the path is a valid string.
+
+    ReadChangesRequest* request = (ReadChangesRequest*)memory;
+    *request = {};
+    request->buffers = memory + sizeof(ReadChangesRequest);
+    request->buffer_size = change_buffer_size;
+
+    request->path = (char16_t*)(request->buffers + (2 * change_buffer_size));
+#endif
+    request->path_length = MultiByteToWideChar(CP_UTF8, 0, directory, -1, (LPWSTR)request->path, path_count) - 1;
+    request->utf8_path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)request->path, request->path_length, 0, 0, 0, 0);
+
+    request->watcher = this;
+    request->shard = AssignShard(request->path, request->path_length);
+    // Priorities without a lane of their own (fixed-capacity builds) share the lowest one there is.
+    request->lane = ((s32)priority < LaneCount) ? (s32)priority : LaneCount - 1;
+    request->buffer_index = 0;
+    request->is_recursive = is_recursive;
+    request->mode = EWatchMode::Watched;
+    request->last_change_tick = GetTickCount64();
+    request->next = 0;
+
+    // NOTE(Frog): We can pack our request pointer into the event handle, since ReadDirectoryChangesW doesn't
+    // touch it when using a completion routine.
+    request->overlapped = {};
+    request->overlapped.hEvent = request;
+    return request;
+}
+
+void DirectoryWatcher::AppendRequest(ReadChangesRequest* request)
+{
+    request->id = next_request_id++;
+
+    // NOTE: The poll timer walks this list from a thread pool thread, so the request has to be completely filled in
+    // before it gets linked. Requests are never removed from the list until ShutDown().
+    ReadChangesRequest* last = requests;
+    if (last)
+    {
+        while (last->next) last = last->next;
+        InterlockedExchangePointer((void**)&last->next, request);
+    }
+    else InterlockedExchangePointer((void**)&requests, request);
+
+    if (recorder) recorder->Record(NotificationRecording::EChunkType::Directory, request->id, request->is_recursive, request->path, request->path_length * 2);
+}
+
+bool DirectoryWatcher::TryGetNextChange(FileChange* out_change)
+{
+    if (LaneCount == 1) return PopLane(0, out_change);
+
+    // Weighted round robin over the lanes, highest priority first. A lane that comes up empty gives up the rest of
+    // its turns, so it can't save them up for later, and once every lane has had its turns a new round starts.
+    // Each lane gets at least one turn a round, which is what keeps a busy High lane from starving the others.
+    // NOTE: The credits aren't locked. Two threads taking changes at once could upset the weights, but not the changes.
+    for (s32 round = 0; round < 2; ++round)
+    {
+        for (s32 lane = 0; lane < LaneCount; ++lane)
+        {
+            if (lane_credits[lane] <= 0) continue;
+            if (PopLane(lane, out_change))
+            {
+                lane_credits[lane] -= 1;
+                return true;
+            }
+            lane_credits[lane] = 0;
+        }
+        for (s32 lane = 0; lane < LaneCount; ++lane) lane_credits[lane] = (settings.lane_weights[lane] > 1) ? settings.lane_weights[lane] : 1;
+    }
+    return false;
+}
+
+bool DirectoryWatcher::PopLane(s32 lane, FileChange* out_change)
+{
+    if (shard_count == 1) return shards[0].lanes[lane].Pop(out_change);
+
+    // A directory only ever pushes to its own shard, so taking from any segment keeps its changes in order. Taking
+    // the oldest front change every time keeps the lane in sequence order as well.
+    Shard* oldest = 0;
+    u64 oldest_sequence = 0;
+    for (s32 i = 0; i < shard_count; ++i)
+    {
+        u64 front_sequence = 0;
+        if (shards[i].lanes[lane].PeekSequence(&front_sequence) && (!oldest || front_sequence < oldest_sequence))
+        {
+            oldest = &shards[i];
+            oldest_sequence = front_sequence;
+        }
+    }
+    return oldest && oldest->lanes[lane].Pop(out_change);
+}
+
+static void ReleaseSharedChange(const DirectoryWatcher::Allocator* allocator, SharedChange* shared)
+{
+    if (InterlockedDecrement((LPLONG)&shared->reference_count) == 0) allocator->Free(shared, DirectoryWatcher::EMemoryTag::Subscription);
+}
+
+static bool IsPathPrefix(const char* prefix, s32 prefix_length, const char* path, s32 path_length)
+{
+    if (prefix_length > path_length) return false;
+    for (s32 i = 0; i < prefix_length; ++i)
+    {
+        if (FoldPathChar(prefix[i]) != FoldPathChar(path[i])) return false;
+    }
+    // "data/asset" shouldn't match "data/assets/thing.png".
+    return prefix_length == path_length || path[prefix_length] == '\\' || path[prefix_length] == '/' ||
+           prefix[prefix_length - 1] == '\\' || prefix[prefix_length - 1] == '/';
+}
+
+DirectoryWatcher::Subscription* DirectoryWatcher::Subscribe(const SubscriptionFilter& filter)
+{
+    s32 prefix_length = (filter.path_prefix) ? (s32)strlen(filter.path_prefix) : 0;
+    s32 pattern_size = (filter.path_pattern) ? (s32)strlen(filter.path_pattern) + 1 : 0;
+    Subscription* subscription = (Subscription*)settings.allocator.Allocate(sizeof(Subscription) + prefix_length + 1 + pattern_size, EMemoryTag::Subscription);
+    assert(subscription);
+
+    *subscription = {};
+    subscription->max_capacity = (filter.max_queue_count > 0) ? filter.max_queue_count : 0;
+    subscription->capacity = (subscription->max_capacity && subscription->max_capacity < Subscription::InitialCapacity) ? subscription->max_capacity : Subscription::InitialCapacity;
+    subscription->data = (SharedChange**)settings.allocator.Allocate(sizeof(SharedChange*) * subscription->capacity, EMemoryTag::Subscription);
+    assert(subscription->data);
+    subscription->action_mask = filter.action_mask;
+    subscription->path_prefix = (char*)(subscription + 1);
+    subscription->path_prefix_length = prefix_length;
+    if (prefix_length) CopyMemory(subscription->path_prefix, filter.path_prefix, prefix_length);
+    subscription->path_prefix[prefix_length] = '\0';
+    if (pattern_size)
+    {
+        subscription->path_pattern = subscription->path_prefix + prefix_length + 1;
+        CopyMemory(subscription->path_pattern, filter.path_pattern, pattern_size);
+    }
+
+    AcquireSRWLockExclusive(&subscription_lock);
+    subscription->next = subscriptions;
+    subscriptions = subscription;
+    ReleaseSRWLockExclusive(&subscription_lock);
+    return subscription;
+}
+
+void DirectoryWatcher::Unsubscribe(Subscription* subscription)
+{
+    assert(subscription);
+    AcquireSRWLockExclusive(&subscription_lock);
+    Subscription** link = &subscriptions;
+    while (*link && *link != subscription) link = &(*link)->next;
+    assert(*link); // Not one of ours, or already unsubscribed.
+    if (*link) *link = subscription->next;
+    ReleaseSRWLockExclusive(&subscription_lock);
+
+    DestroySubscription(subscription);
+}
+
+bool DirectoryWatcher::TryGetNextChange(Subscription* subscription, FileChange* out_change)
+{
+    assert(subscription && out_change);
+    SharedChange* shared = 0;
+    bool result = false;
+
+    subscription->Lock();
+    if (subscription->count)
+    {
+        // Same rule as the default queue, don't hand out half of a rename.
+        SharedChange* front = subscription->data[subscription->front_index];
+        if (subscription->count > 1 || front->change.action != EFileAction::RenamedFrom)
+        {
+            shared = front;
+            subscription->front_index = (subscription->front_index + 1) % subscription->capacity;
+            subscription->count -= 1;
+        }
+    }
+    if (!shared && subscription->did_overflow)
+    {
+        // Whatever came after the queued changes was dropped, so anything may have changed since.
+        *out_change = {};
+        out_change->action = EFileAction::TooManyChanges;
+        out_change->is_directory = true;
+        out_change->directory_id = -1;
+        subscription->did_overflow = false;
+        result = true;
+    }
+    subscription->Unlock();
+
+    if (shared)
+    {
+        *out_change = shared->change;
+        ReleaseSharedChange(&settings.allocator, shared);
+        result = true;
+    }
+    return result;
+}
+
+bool DirectoryWatcher::ArmWakeup(Subscription* subscription, WakeupProc proc, void* context)
+{
+    assert(proc);
+    if (!subscription && shard_count == 1 && LaneCount == 1) return shards[0].lanes[0].ArmWakeup(proc, context);
+    if (!subscription)
+    {
+        // Arm every segment and lane, and let whichever one fills first claim the wakeup. Clear out any left over from
+        // the last time first, they'd trip the assert in ThreadSafeQueue::ArmWakeup().
+        assert(!merged_wakeup); // Someone else is already waiting.
+        DisarmMergedWakeups();
+
+        // The proc and context are published together as one pointer, so a wakeup can't pair one with the other's
+        // predecessor. Fill in the record that wasn't used last time, in case whoever claimed that one is still reading it.
+        merged_wakeup_index ^= 1;
+        MergedWakeup* record = &merged_wakeup_records[merged_wakeup_index];
+        record->proc = proc;
+        record->context = context;
+        InterlockedExchangePointer((void* volatile*)&merged_wakeup, record);
+
+        s32 queue_count = shard_count * LaneCount;
+        for (s32 i = 0; i < queue_count; ++i)
+        {
+            if (shards[i / LaneCount].lanes[i % LaneCount].ArmWakeup(MergedWakeupProc, this)) continue;
+
+            // There's a change already. Take the wakeup back, unless a push beat us to it and has already called it.
+            if (!InterlockedExchangePointer((void* volatile*)&merged_wakeup, 0)) return true;
+            DisarmMergedWakeups();
+            return false;
+        }
+        return true;
+    }
+
+    subscription->Lock();
+    assert(!subscription->wakeup_proc); // Someone else is already waiting.
+    bool has_change = subscription->did_overflow || subscription->count > 1 ||
+                      (subscription->count == 1 && subscription->data[subscription->front_index]->change.action != EFileAction::RenamedFrom);
+    if (!has_change)
+    {
+        subscription->wakeup_proc = proc;
+        subscription->wakeup_context = context;
+    }
+    subscription->Unlock();
+    return !has_change;
+}
+
+void DirectoryWatcher::MergedWakeupProc(void* context)
+{
+    DirectoryWatcher* watcher = (DirectoryWatcher*)context;
+    MergedWakeup* record = (MergedWakeup*)InterlockedExchangePointer((void* volatile*)&watcher->merged_wakeup, 0);
+    if (!record) return; // Another lane got there first, or the wakeup was taken back.
+
+    // Whoever swapped the record out owns it, nobody writes it again until the waiter has been woken and arms again.
+    WakeupProc proc = record->proc;
+    void* user_context = record->context;
+    // The other lanes are still armed, and would fire into the next ArmWakeup() whenever they got a change.
+    watcher->DisarmMergedWakeups();
+    proc(user_context);
+}
+
+void DirectoryWatcher::DisarmMergedWakeups()
+{
+    for (s32 i = 0; i < shard_count * LaneCount; ++i) shards[i / LaneCount].lanes[i % LaneCount].DisarmWakeup();
+}
+
+void DirectoryWatcher::PublishChange(const FileChange& change)
+{
+    SharedChange* shared = 0;
+
+    AcquireSRWLockShared(&subscription_lock);
+    for (Subscription* subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        bool is_wanted = false;
+        if (change.action == EFileAction::TooManyChanges)
+        {
+            // Anything under the prefix may have changed if the marker's path is above it or below it.
+            is_wanted = !change.path_length || !subscription->path_prefix_length ||
+                        IsPathPrefix(subscription->path_prefix, subscription->path_prefix_length, change.path, change.path_length) ||
+                        IsPathPrefix(change.path, change.path_length, subscription->path_prefix, subscription->path_prefix_length);
+        }
+        else if (change.action == EFileAction::RenamedTo && subscription->is_in_rename) is_wanted = true;
+        else
+        {
+            is_wanted = (subscription->action_mask & (1u << (u32)change.action)) &&
+                        (!subscription->path_prefix_length || IsPathPrefix(subscription->path_prefix, subscription->path_prefix_length, change.path, change.path_length)) &&
+                        (!subscription->path_pattern || MatchesPattern(subscription->path_pattern, change.path));
+        }
+
+        // NOTE: Both halves of a rename are pushed under one hold of push_lock, so nothing else can come in between.
+        if (change.action == EFileAction::RenamedFrom || change.action == EFileAction::RenamedTo) subscription->is_in_rename = is_wanted && change.action == EFileAction::RenamedFrom;
+        if (!is_wanted) continue;
+
+        // Only make the shared copy once somebody actually wants it. It starts with a reference for us, dropped below.
+        if (!shared)
+        {
+            shared = (SharedChange*)settings.allocator.Allocate(sizeof(SharedChange), EMemoryTag::Subscription);
+            assert(shared);
+            shared->reference_count = 1;
+            shared->change = change;
+        }
+
+        subscription->Lock();
+        if (subscription->count == subscription->capacity && (!subscription->max_capacity || subscription->capacity < subscription->max_capacity))
+        {
+            s32 new_capacity = subscription->capacity * 2;
+            if (subscription->max_capacity && new_capacity > subscription->max_capacity) new_capacity = subscription->max_capacity;
+            SharedChange** new_data = (SharedChange**)settings.allocator.Allocate(sizeof(SharedChange*) * new_capacity, EMemoryTag::Subscription);
+            assert(new_data);
+            for (s32 i = 0; i < subscription->count; ++i) new_data[i] = subscription->data[(subscription->front_index + i) % subscription->capacity];
+            settings.allocator.Free(subscription->data, EMemoryTag::Subscription);
+            subscription->data = new_data;
+            subscription->capacity = new_capacity;
+            subscription->front_index = 0;
+        }
+
+        if (subscription->count < subscription->capacity)
+        {
+            InterlockedIncrement((LPLONG)&shared->reference_count);
+            subscription->data[(subscription->front_index + subscription->count) % subscription->capacity] = shared;
+            if (!subscription->count) subscription->oldest_change_tick = GetTickCount64();
+            subscription->count += 1;
+        }
+        else subscription->did_overflow = true;
+
+        WakeupProc wakeup_proc = 0;
+        void* wakeup_context = subscription->wakeup_context;
+        bool has_change = subscription->did_overflow || subscription->count > 1 || change.action != EFileAction::RenamedFrom;
+        if (subscription->wakeup_proc && has_change)
+        {
+            wakeup_proc = subscription->wakeup_proc;
+            subscription->wakeup_proc = 0;
+        }
+        bool is_batch_full = subscription->handler && (subscription->count >= subscription->handler->max_batch_count || subscription->did_overflow);
+        subscription->Unlock();
+
+        // Thread pool handlers get a full batch right away, otherwise the timer makes sure a partial one isn't held for too long.
+        if (wakeup_proc) wakeup_proc(wakeup_context);
+
+        Handler* handler = subscription->handler;
+        if (handler && handler->mode == EDispatchMode::ThreadPool)
+        {
+            if (is_batch_full)
+            {
+                if (InterlockedExchange((LPLONG)&handler->is_work_queued, 1) == 0) SubmitThreadpoolWork(handler->work);
+            }
+            else if (InterlockedExchange((LPLONG)&handler->is_timer_set, 1) == 0)
+            {
+                LARGE_INTEGER due; // Negative means relative, in 100 nanosecond units.
+                due.QuadPart = -(LONGLONG)handler->max_batch_delay_ms * 10000;
+                FILETIME due_time = {(DWORD)due.LowPart, (DWORD)due.HighPart};
+                SetThreadpoolTimer(handler->timer, &due_time, 0, 0);
+            }
+        }
+    }
+    ReleaseSRWLockShared(&subscription_lock);
+
+    if (shared) ReleaseSharedChange(&settings.allocator, shared);
+}
+
+void DirectoryWatcher::DestroySubscription(Subscription* subscription)
+{
+    if (Handler* handler = subscription->handler)
+    {
+        // The subscription is already out of the list, so nothing new can start. Wait for whatever is already running.
+        if (handler->mode == EDispatchMode::ThreadPool)
+        {
+            SetThreadpoolTimer(handler->timer, 0, 0, 0);
+            WaitForThreadpoolTimerCallbacks(handler->timer, true);
+            WaitForThreadpoolWorkCallbacks(handler->work, true);
+            CloseThreadpoolTimer(handler->timer);
+            CloseThreadpoolWork(handler->work);
+        }
+        else if (handler->mode == EDispatchMode::Inline) InterlockedDecrement((LPLONG)&inline_handler_count);
+        settings.allocator.Free(handler->batch, EMemoryTag::Subscription);
+        settings.allocator.Free(handler, EMemoryTag::Subscription);
+    }
+
+    for (s32 i = 0; i < subscription->count; ++i)
+    {
+        ReleaseSharedChange(&settings.allocator, subscription->data[(subscription->front_index + i) % subscription->capacity]);
+    }
+    settings.allocator.Free(subscription->data, EMemoryTag::Subscription);
+    settings.allocator.Free(subscription, EMemoryTag::Subscription);
+}
+
+DirectoryWatcher::Handler* DirectoryWatcher::AddHandler(const HandlerSettings& handler_settings)
+{
+    assert(handler_settings.proc);
+    Handler* handler = (Handler*)settings.allocator.Allocate(sizeof(Handler), EMemoryTag::Subscription);
+    assert(handler);
+
+    *handler = {};
+    handler->watcher = this;
+    handler->proc = handler_settings.proc;
+    handler->context = handler_settings.context;
+    handler->mode = handler_settings.mode;
+    handler->max_batch_count = (handler_settings.max_batch_count > 0) ? handler_settings.max_batch_count : 1;
+    handler->max_batch_delay_ms = (handler_settings.max_batch_delay_ms > 0) ? handler_settings.max_batch_delay_ms : 0;
+    handler->batch = (FileChange*)settings.allocator.Allocate(sizeof(FileChange) * handler->max_batch_count, EMemoryTag::Subscription);
+    assert(handler->batch);
+    if (handler->mode == EDispatchMode::ThreadPool)
+    {
+        handler->timer = CreateThreadpoolTimer((PTP_TIMER_CALLBACK)DirectoryWatcher::HandlerTimerProc, handler, 0);
+        handler->work = CreateThreadpoolWork((PTP_WORK_CALLBACK)DirectoryWatcher::HandlerWorkProc, handler, 0);
+        assert(handler->timer && handler->work);
+    }
+    else if (handler->mode == EDispatchMode::Inline) InterlockedIncrement((LPLONG)&inline_handler_count);
+
+    // Hook the handler up before anything can be published to it.
+    handler->subscription = Subscribe(handler_settings.filter);
+    AcquireSRWLockExclusive(&subscription_lock);
+    handler->subscription->handler = handler;
+    ReleaseSRWLockExclusive(&subscription_lock);
+    return handler;
+}
+
+void DirectoryWatcher::RemoveHandler(Handler* handler)
+{
+    assert(handler);
+    Unsubscribe(handler->subscription); // Frees the handler too.
+}
+
+s32 DirectoryWatcher::DispatchHandlers()
+{
+    s32 call_count = 0;
+    u64 now = GetTickCount64();
+
+    AcquireSRWLockShared(&subscription_lock);
+    for (Subscription* subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        Handler* handler = subscription->handler;
+        if (!handler || handler->mode != EDispatchMode::CallerPump) continue;
+
+        subscription->Lock();
+        bool is_due = subscription->did_overflow || subscription->count >= handler->max_batch_count ||
+                      (subscription->count && now - subscription->oldest_change_tick >= (u64)handler->max_batch_delay_ms);
+        subscription->Unlock();
+        if (is_due) call_count += DeliverBatches(handler);
+    }
+    ReleaseSRWLockShared(&subscription_lock);
+    return call_count;
+}
+
+s32 DirectoryWatcher::DeliverBatches(Handler* handler)
+{
+    s32 call_count = 0;
+    handler->deliver_lock.Lock();
+    for (;;)
+    {
+        s32 batch_count = 0;
+        while (batch_count < handler->max_batch_count && TryGetNextChange(handler->subscription, handler->batch + batch_count)) batch_count += 1;
+        if (!batch_count) break;
+
+        handler->proc(handler->context, handler->batch, batch_count);
+        call_count += 1;
+        if (batch_count < handler->max_batch_count) break;
+    }
+    handler->deliver_lock.Unlock();
+    return call_count;
+}
+
+void DirectoryWatcher::DispatchInlineHandlers()
+{
+    if (!inline_handler_count) return;
+
+    AcquireSRWLockShared(&subscription_lock);
+    for (Subscription* subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        if (subscription->handler && subscription->handler->mode == EDispatchMode::Inline) DeliverBatches(subscription->handler);
+    }
+    ReleaseSRWLockShared(&subscription_lock);
+}
+
+void __stdcall DirectoryWatcher::HandlerTimerProc(void* instance, void* arg, void* timer)
+{
+    Handler* handler = (Handler*)arg;
+    InterlockedExchange((LPLONG)&handler->is_timer_set, 0);
+    if (InterlockedExchange((LPLONG)&handler->is_work_queued, 1) == 0) SubmitThreadpoolWork(handler->work);
+}
+
+void __stdcall DirectoryWatcher::HandlerWorkProc(void* instance, void* arg, void* work)
+{
+    // Clear the flag first, so changes that arrive while we're delivering queue up another run rather than getting stuck.
+    Handler* handler = (Handler*)arg;
+    InterlockedExchange((LPLONG)&handler->is_work_queued, 0);
+    handler->watcher->DeliverBatches(handler);
+}
+
+u32 __stdcall DirectoryWatcher::ThreadProc(void* arg)
+{
+    Shard* shard = (Shard*)arg;
+    DirectoryWatcher* watcher = shard->watcher;
+    while (shard->outstanding_request_count || !watcher->should_terminate) SleepEx((u32)-1, true);
+    return 0;
+}
+
+void __stdcall DirectoryWatcher::ThreadWakeProc(u64 arg) {/*Nothing to do, the loop in ThreadProc() just needs to look again.*/}
+
+void __stdcall DirectoryWatcher::ThreadAddDirectoryProc(u64 arg)
+{
+    DirectoryWatcher::ReadChangesRequest* request = (DirectoryWatcher::ReadChangesRequest*)arg;
+    DirectoryWatcher* watcher = request->watcher;
+
+    // ShutDown() got here first and already closed the handle.
+    if (watcher->should_terminate)
+    {
+        watcher->FreeRequest(request);
+        return;
+    }
+
+    // If the file system doesn't support change notifications (some network shares, FAT volumes without
+    // extended information...), quietly switch this directory over to polling instead.
+    if (watcher->BeginRead(request))
+    {
+        InterlockedIncrement(&request->shard->outstanding_request_count);
+        request->is_reading = true;
+    }
+    else watcher->BeginPolling(request);
+}
+
+void __stdcall DirectoryWatcher::ThreadCancelDirectoryProc(u64 arg)
+{
+    // NOTE: CancelIo() only cancels I/O started by the calling thread, so demotions have to be done from here.
+    // The completion routine sees ERROR_OPERATION_ABORTED and finishes switching the request over to polling.
+    DirectoryWatcher::ReadChangesRequest* request = (DirectoryWatcher::ReadChangesRequest*)arg;
+    CancelIo(request->directory);
+}
+
+void __stdcall DirectoryWatcher::NotificationCompletion(u32 error_code, u32 bytes_transferred, OVERLAPPED* overlapped)
+{
+    DirectoryWatcher::ReadChangesRequest* request = (DirectoryWatcher::ReadChangesRequest*)overlapped->hEvent;
+    DirectoryWatcher* watcher = request->watcher;
+
+    // This occurs on shutdown, close the request and return.
+    if (watcher->should_terminate)
+    {
+        InterlockedDecrement(&request->shard->outstanding_request_count);
+        watcher->FreeRequest(request);
+        return;
+    }
+
+    // The watch was cancelled to make room in the watch budget. The poll timer already took a baseline snapshot.
+    // NOTE: Any other abort is handled like a broken watch below. The request is still in the list, so it can't be freed here.
+    if (error_code == ERROR_OPERATION_ABORTED && request->mode == EWatchMode::Demoting)
+    {
+        InterlockedDecrement(&request->shard->outstanding_request_count);
+        watcher->BeginPolling(request);
+        return;
+    }
+
+    bool did_overflow = (!error_code && !bytes_transferred);
+    request->last_change_tick = GetTickCount64();
+
+    // Capture the buffer exactly as it came in. The read below goes into the other buffer, so this one stays put.
+    if (watcher->recorder)
+    {
+        u8* completed = request->buffers + (request->buffer_size * (request->buffer_index ^ 1));
+        if (error_code || did_overflow) watcher->recorder->Record(NotificationRecording::EChunkType::Overflow, request->id, request->is_recursive, 0, 0);
+        else watcher->recorder->Record(NotificationRecording::EChunkType::Notification, request->id, request->is_recursive, completed, bytes_transferred);
+    }
+
+    // Cycle between the two change buffers, immediately kick off another read request (so we don't miss anything),
+    // and process the change buffer we just received.
+    u8* buffer = request->buffers + (request->buffer_size * (request->buffer_index ^ 1));
+    if (!error_code && watcher->BeginRead(request))
+    {
+        watcher->ProcessNotification(request, (did_overflow) ? 0 : buffer);
+        watcher->DispatchInlineHandlers();
+        return;
+    }
+
+    // The watch broke, which usually means a network share went away. Fall back to polling, and report the directory
+    // as having too many changes, since we can't know what happened between the last notification and the first scan.
+    InterlockedDecrement(&request->shard->outstanding_request_count);
+    if (!error_code && !did_overflow) watcher->ProcessNotification(request, buffer);
+    watcher->ProcessNotification(request, 0);
+    watcher->BeginPolling(request);
+    watcher->DispatchInlineHandlers();
+}
+
+void DirectoryWatcher::ProcessNotification(ReadChangesRequest* request, u8* buffer)
+{
+    const char16_t* directory_path = request->path;
+    s32 directory_path_length = request->path_length;
+
+    // NOTE(Frog): If we get a null buffer, it means that it overflowed. We will enqueue an error and return.
+    if (!buffer)
+    {
+        FileChange change = {};
+        change.action = EFileAction::TooManyChanges;
+        change.is_directory = true;
+        change.path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)directory_path, directory_path_length, change.path, DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1, 0, 0);
+        change.path[change.path_length] = L'\0';
+        PushChange(request, change);
+        return;
+    }
+
+    // The buffer has been filled with notify event structs, which have a variable size depending on the path length.
+    // Each event stores the offset of the next one, so we will process them one at a time.
+    FILE_NOTIFY_EXTENDED_INFORMATION* event = 0;
+    s32 offset = 0;
+    FileChange rename_from; // Held back until its RenamedTo comes along, so the two can be pushed together.
+    bool has_rename_from = false;
+    do
+    {
+        event = (FILE_NOTIFY_EXTENDED_INFORMATION*)(buffer + offset);
+        offset += event->NextEntryOffset;
+
+        s32 combined_path_length = directory_path_length;
+        // Append the "filename" (in reality the path from the monitored directory) to the directory path.
+        char16_t combined_path[MAX_PATH]; // NOTE(Frog): This is a relative path, which is why MAX_PATH is safe here.
+        // NOTE: Only as long as the directory path leaves room for it, so check rather than trust the lengths.
+        s32 name_length = (s32)(event->FileNameLength / 2);
+        bool does_path_fit = directory_path_length > 0 && directory_path_length + 1 + name_length < MAX_PATH;
+        if (does_path_fit)
+        {
+            CopyMemory(combined_path, directory_path, combined_path_length * 2);
+            if (combined_path[combined_path_length - 1] != L'\\') combined_path[combined_path_length++] = L'\\';
+            CopyMemory(combined_path + combined_path_length, event->FileName, name_length * 2);
+            combined_path_length += name_length;
+            combined_path[combined_path_length] = L'\0';
+        }
+
+        // Figure out what change occured to the file/directory.
+        EFileAction action;
+        switch (event->Action)
+        {
+            case FILE_ACTION_ADDED: action = EFileAction::Added; break;
+            case FILE_ACTION_REMOVED: action = EFileAction::Removed; break;
+            case FILE_ACTION_MODIFIED: action = EFileAction::Modified; break;
+            case FILE_ACTION_RENAMED_OLD_NAME: action = EFileAction::RenamedFrom; break;
+            case FILE_ACTION_RENAMED_NEW_NAME: action = EFileAction::RenamedTo; break;
+            default: action = EFileAction::None; break;
+        }
+
+        // Fill in the extended info about the file.
+        FileChange change = {};
+        change.creation_time = event->CreationTime.QuadPart;
+        change.modification_time = event->LastModificationTime.QuadPart;
+        change.change_time = event->LastChangeTime.QuadPart;
+        change.access_time = event->LastAccessTime.QuadPart;
+        change.size = event->FileSize.QuadPart;
+        change.attributes = event->FileAttributes;
+
+        change.action = action;
+        change.is_directory = (change.attributes & FILE_ATTRIBUTE_DIRECTORY);
+        change.path_length = (does_path_fit) ? WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)combined_path, combined_path_length + 1, change.path, DIRECTORY_WATCHER_MAX_PATH_LENGTH, 0, 0) - 1 : -1;
+
+        // A RenamedFrom without a RenamedTo right after it goes out on its own, the same as any other change.
+        if (has_rename_from && (change.path_length < 0 || action != EFileAction::RenamedTo))
+        {
+            PushChange(request, rename_from);
+            has_rename_from = false;
+        }
+
+        // The path didn't fit (in a shrunk FileChange, or at all), so the best we can do is point the caller at the directory.
+        if (change.path_length < 0) ProcessNotification(request, 0);
+        else if (action == EFileAction::RenamedFrom)
+        {
+            rename_from = change;
+            has_rename_from = true;
+        }
+        else if (has_rename_from)
+        {
+            PushChange(request, rename_from, &change);
+            has_rename_from = false;
+        }
+        else PushChange(request, change);
+    } while (event->NextEntryOffset);
+    if (has_rename_from) PushChange(request, rename_from);
+}
+
+void DirectoryWatcher::PushChange(ReadChangesRequest* request, FileChange& change, FileChange* rename_to)
+{
+    // Changes can come from every watcher thread and the poll timer at the same time, take turns so sequences stay in order
+    // everywhere. A rename is pushed in one go, so no other directory's change can land between its two halves.
+    AcquireSRWLockExclusive(&push_lock);
+    FileChange* changes[2] = {&change, rename_to};
+    for (s32 i = 0; i < 2 && changes[i]; ++i)
+    {
+        FileChange& pushed = *changes[i];
+        history_lock.Lock();
+        pushed.sequence = ++sequence;
+        pushed.root_sequence = ++request->sequence;
+        pushed.directory_id = request->id;
+        if (history)
+        {
+            if (history_count < settings.history_count) history[(history_front_index + history_count++) % settings.history_count] = pushed;
+            else
+            {
+                history[history_front_index] = pushed;
+                history_front_index = (history_front_index + 1) % settings.history_count;
+            }
+        }
+        history_lock.Unlock();
+
+        request->shard->change_count += 1;
+        if (journal) journal->Append(pushed);
+        if (shared_ring) shared_ring->Publish(pushed);
+        if (settings.use_default_queue) request->shard->lanes[request->lane].Push(pushed, request->id, request->utf8_path_length);
+        if (subscriptions) PublishChange(pushed);
+    }
+    ReleaseSRWLockExclusive(&push_lock);
+    // Once per push rather than per change, and outside the lock, since it can be a system call.
+    if (shared_ring) shared_ring->Wake();
+}
+
+// Jump consistent hash (Lamping and Veach): the same key always gets the same bucket, and going from n to n + 1
+// buckets only moves a 1 / (n + 1) share of the keys.
+static s32 JumpConsistentHash(u64 key, s32 bucket_count)
+{
+    s64 bucket = -1;
+    s64 next = 0;
+    while (next < bucket_count)
+    {
+        bucket = next;
+        key = key * 2862933555777941757ull + 1;
+        next = (s64)((double)(bucket + 1) * ((double)(1ll << 31) / (double)((key >> 33) + 1)));
+    }
+    return (s32)bucket;
+}
+
+DirectoryWatcher::Shard* DirectoryWatcher::AssignShard(const char16_t* path, s32 path_length)
+{
+    Shard* shard = &shards[0];
+    if (shard_count > 1 && settings.shard_policy == EShardPolicy::PathHash)
+    {
+        // Hash the path the way Windows compares it, so "Data/Assets" and "data\assets" end up on the same thread.
+        u64 hash = 14695981039346656037ull;
+        for (s32 i = 0; i < path_length; ++i)
+        {
+            char16_t c = path[i];
+            if (c == u'/') c = u'\\';
+            else if (c >= u'A' && c <= u'Z') c += (u'a' - u'A');
+            hash = (hash ^ (u64)c) * 1099511628211ull;
+        }
+        shard = &shards[JumpConsistentHash(hash, shard_count)];
+    }
+    else if (shard_count > 1)
+    {
+        // NOTE: Directories are added from one thread at a time in practice, so this doesn't bother being exact under contention.
+        for (s32 i = 1; i < shard_count; ++i)
+        {
+            Shard* candidate = &shards[i];
+            if (candidate->directory_count < shard->directory_count ||
+                (candidate->directory_count == shard->directory_count && candidate->change_count < shard->change_count)) shard = candidate;
+        }
+    }
+    InterlockedIncrement((LPLONG)&shard->directory_count);
+    return shard;
+}
+
+DirectoryWatcher::Cursor DirectoryWatcher::GetCursor()
+{
+    history_lock.Lock();
+    Cursor cursor = {instance_id, sequence};
+    history_lock.Unlock();
+    return cursor;
+}
+
+DirectoryWatcher::EHistoryResult DirectoryWatcher::ChangesSince(const Cursor& since, FileChange* out_changes, s32 max_count, s32* out_count, Cursor* out_next)
+{
+    assert(out_count && out_next && (out_changes || !max_count));
+    EHistoryResult result = EHistoryResult::Changes;
+    s32 count = 0;
+
+    history_lock.Lock();
+    u64 oldest_sequence = sequence - history_count + 1; // The ring always holds the newest changes, with no gaps.
+    if (since.instance != instance_id || since.sequence > sequence || since.sequence + 1 < oldest_sequence)
+    {
+        result = EHistoryResult::FreshInstance;
+        *out_next = {instance_id, sequence};
+    }
+    else
+    {
+        s32 first = (s32)(since.sequence + 1 - oldest_sequence);
+        count = history_count - first;
+        if (count > max_count) count = max_count;
+        for (s32 i = 0; i < count; ++i) out_changes[i] = history[(history_front_index + first + i) % settings.history_count];
+        *out_next = {instance_id, since.sequence + count};
+    }
+    history_lock.Unlock();
+
+    *out_count = count;
+    return result;
+}
+
+bool DirectoryWatcher::BeginRead(ReadChangesRequest* request)
+{
+    u32 filters = FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME;
+    u8* buffer = request->buffers + (request->buffer_size * request->buffer_index);
+    request->buffer_index ^= 1; // Toggle between buffer index 0 and 1 for every notification.
+    return ReadDirectoryChangesExW(request->directory, buffer, request->buffer_size, request->is_recursive, filters, 0, &request->overlapped,
+                                   (LPOVERLAPPED_COMPLETION_ROUTINE)DirectoryWatcher::NotificationCompletion, ReadDirectoryNotifyExtendedInformation);
 }
 
-void DirectoryWatcher::ShutDown()
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+void DirectoryWatcher::BeginPolling(ReadChangesRequest* request)
 {
-    should_terminate = true;
+    // No polling in fixed-capacity builds (see the notes in DirectoryWatcher.h). Report the directory and give up on it.
+    // The request stays in the list until ShutDown(), so its slot can't be reused while someone might still look at it.
+    if (request->directory && request->directory != (void*)-1) CloseHandle(request->directory);
+    request->directory = 0;
+    request->is_reading = false;
+    request->mode = EWatchMode::Polled;
+    ProcessNotification(request, 0);
+}
 
-    ReadChangesRequest* current = requests;
-    while (current)
+void DirectoryWatcher::DestroySnapshot(DirectorySnapshot* snapshot) {assert(!snapshot);}
+#else
+void DirectoryWatcher::BeginPolling(ReadChangesRequest* request)
+{
+    // The directory handle is only needed for ReadDirectoryChangesExW. Polled requests get freed by ShutDown().
+    // A demoted directory keeps the snapshot that was taken before its watch was cancelled.
+    if (request->directory && request->directory != (void*)-1) CloseHandle(request->directory);
+    request->directory = 0;
+    request->is_reading = false;
+    request->poll_count = 0;
+    request->mode = EWatchMode::Polled;
+
+    // Start the timer when the first polled directory shows up. The first scan just records the initial state.
+    if (!InterlockedCompareExchangePointer(&poll_timer, (void*)-1, 0))
     {
-        ReadChangesRequest* request = current;
-        CancelIo(request->directory);
-        CloseHandle(request->directory);
-        current = current->next;
+        PTP_TIMER timer = CreateThreadpoolTimer((PTP_TIMER_CALLBACK)DirectoryWatcher::PollTimerProc, this, 0);
+        assert(timer);
+
+        FILETIME due = {}; // An absolute time in the past, so it fires right away and then every poll_interval_ms.
+        SetThreadpoolTimer(timer, &due, settings.poll_interval_ms, 0);
+        InterlockedExchangePointer(&poll_timer, timer);
     }
-    CloseHandle(thread_handle);
-    queue.Destroy();
 }
 
-bool DirectoryWatcher::AddDirectory(const char* directory, bool is_recursive, s32 change_buffer_size)
+void __stdcall DirectoryWatcher::PollTimerProc(void* instance, void* arg, void* timer)
 {
-    assert(thread_handle && directory && change_buffer_size > 0);
+    DirectoryWatcher* watcher = (DirectoryWatcher*)arg;
 
-     // Get the number of bytes in the converted string, including the null terminator, so we know
-     // how big of a buffer we will need.
-    s32 path_count = MultiByteToWideChar(CP_UTF8, 0, directory, -1, 0, 0);
+    // Thread pool timers don't wait for the previous callback to finish, so skip this tick if a scan is still running.
+    if (InterlockedExchange((LPLONG)&watcher->is_polling, 1) == 1) return;
 
-    // Allocate space for the request struct, two buffers, and the directory path.
-    u8* memory = (u8*)malloc(sizeof(ReadChangesRequest) + (2 * change_buffer_size) + (2 * path_count));
-    assert(memory && path_count > 0); // Make sure we got our memory, and that the path is a valid string.
+    for (ReadChangesRequest* request = watcher->requests; request && !watcher->should_terminate; request = request->next)
+    {
+        if (request->mode == EWatchMode::Polled) watcher->Poll(request);
+        else if (request->mode == EWatchMode::Promoting && request->is_reading)
+        {
+            // The watch is up, so one last rescan covers anything that changed while it was starting.
+            watcher->Poll(request);
+            watcher->DestroySnapshot(request->snapshot);
+            request->snapshot = 0;
+            request->mode = EWatchMode::Watched;
+        }
+    }
+    if (watcher->settings.max_watched_directories > 0 && !watcher->should_terminate) watcher->Rebalance();
+    watcher->DispatchInlineHandlers();
+    InterlockedExchange((LPLONG)&watcher->is_polling, 0);
+}
 
-    ReadChangesRequest* request = (ReadChangesRequest*)memory;
-    request->buffers = memory + sizeof(ReadChangesRequest);
-    request->buffer_size = change_buffer_size;
+void DirectoryWatcher::Poll(ReadChangesRequest* request)
+{
+    DirectorySnapshot* previous = request->snapshot;
+    DirectorySnapshot* current = CreateSnapshot();
 
-    request->path = (char16_t*)(request->buffers + (2 * change_buffer_size));
-    request->path_length = MultiByteToWideChar(CP_UTF8, 0, directory, -1, (LPWSTR)request->path, path_count) - 1;
+    s32 full_scan_interval = (settings.poll_full_scan_interval > 0) ? settings.poll_full_scan_interval : 1;
+    bool skip_unchanged = (request->poll_count % full_scan_interval) != 0;
+    request->poll_count += 1;
 
-    // Go ahead and open the directory handle.
-    u32 mode = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
-    u32 flags = FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED;
-    request->directory = CreateFileW((LPWSTR)request->path, FILE_LIST_DIRECTORY, mode, 0, OPEN_EXISTING, flags, 0);
+    if (!current->Scan(request->path, request->path_length, request->is_recursive, previous, skip_unchanged, settings.poll_thread_count))
+    {
+        // Couldn't read the root at all (network hiccup?). Keep the old snapshot and try again next time.
+        DestroySnapshot(current);
+        return;
+    }
 
-    // Fill in the rest of the data, or free the buffer if we didn't get a valid directory handle.
-    if (request->directory != (void*)-1)
+    request->had_poll_changes = false;
+    if (previous)
     {
-        request->watcher = this;
-        request->buffer_index = 0;
-        request->is_recursive = is_recursive;
-        request->next = 0;
+        DirectorySnapshot::Diff(previous, current, [](void* context, EFileAction action, const char16_t* path, s32 path_length, const DirectorySnapshot::Entry* entry)
+        {
+            ReadChangesRequest* request = (ReadChangesRequest*)context;
+            request->had_poll_changes = true;
+
+            // Build the same kind of path ReadDirectoryChangesExW events get: the watched directory plus the relative path.
+            char16_t combined_path[MAX_PATH * 2];
+            s32 combined_path_length = request->path_length;
+            if (combined_path_length + 1 + path_length + 1 > MAX_PATH * 2) return;
+            CopyMemory(combined_path, request->path, combined_path_length * 2);
+            if (combined_path[combined_path_length - 1] != L'\\') combined_path[combined_path_length++] = L'\\';
+            CopyMemory(combined_path + combined_path_length, path, path_length * 2);
+            combined_path_length += path_length;
+            combined_path[combined_path_length] = L'\0';
+
+            FileChange change = {};
+            change.creation_time = entry->creation_time;
+            change.modification_time = entry->modification_time;
+            change.access_time = entry->access_time;
+            change.size = entry->size;
+            change.attributes = entry->attributes;
 
-        // NOTE(Frog): We can pack our request pointer into the event handle, since ReadDirectoryChangesW doesn't
-        // touch it when using a completion routine.
-        request->overlapped = {};
-        request->overlapped.hEvent = request;
+            change.action = action;
+            change.is_directory = (change.attributes & FILE_ATTRIBUTE_DIRECTORY);
+            change.path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)combined_path, combined_path_length + 1, change.path, DIRECTORY_WATCHER_MAX_PATH_LENGTH, 0, 0) - 1;
+            if (change.path_length < 0) request->watcher->ProcessNotification(request, 0);
+            else request->watcher->PushChange(request, change);
+        }, request);
 
-        // Append this request to the list.
-        ReadChangesRequest* last = requests;
-        if (last)
+        DestroySnapshot(previous);
+    }
+    request->snapshot = current;
+    if (request->had_poll_changes) request->last_change_tick = GetTickCount64();
+}
+
+void DirectoryWatcher::Rebalance()
+{
+    // Only directories that were added with change buffers can be promoted. The others were asked to be polled,
+    // or are on a file system that doesn't support watching.
+    ReadChangesRequest* hottest = 0;
+    ReadChangesRequest* coldest = 0;
+    s32 watched_count = 0;
+    u64 now = GetTickCount64();
+    for (ReadChangesRequest* request = requests; request; request = request->next)
+    {
+        EWatchMode mode = request->mode;
+        if (mode == EWatchMode::Polled)
+        {
+            bool can_promote = request->buffer_size > 0 && request->had_poll_changes;
+            if (can_promote && (!hottest || request->last_change_tick > hottest->last_change_tick)) hottest = request;
+        }
+        else if (mode != EWatchMode::Replayed)
         {
-            while (last->next) last = last->next;
-            last->next = request;
+            watched_count += 1;
+            bool is_cold = (mode == EWatchMode::Watched) && (now - request->last_change_tick >= (u64)settings.watch_cold_after_ms);
+            if (is_cold && (!coldest || request->last_change_tick < coldest->last_change_tick)) coldest = request;
         }
-        else requests = request;
+    }
+    if (!hottest) return;
 
-        QueueUserAPC(DirectoryWatcher::ThreadAddDirectoryProc, thread_handle, (u64)request);
-        return true;
+    if (watched_count < settings.max_watched_directories)
+    {
+        // Room in the budget: reopen the directory and start the watch on the watcher thread. The snapshot
+        // stays around until the watch is running, see PollTimerProc().
+        u32 mode = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+        u32 flags = FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED;
+        void* directory = CreateFileW((LPWSTR)hottest->path, FILE_LIST_DIRECTORY, mode, 0, OPEN_EXISTING, flags, 0);
+        if (directory == (void*)-1) return;
+
+        hottest->directory = directory;
+        hottest->buffer_index = 0;
+        hottest->mode = EWatchMode::Promoting;
+        promotion_count += 1;
+        QueueUserAPC(DirectoryWatcher::ThreadAddDirectoryProc, hottest->shard->thread_handle, (u64)hottest);
     }
-    else
+    else if (coldest)
     {
-        free(request);
-        return false;
+        // No room, so swap out the quietest watch. Take the baseline first, so nothing is lost between the watch
+        // being cancelled and the first rescan. The promotion happens on a later tick, once the budget frees up.
+        DirectorySnapshot* baseline = CreateSnapshot();
+        if (!baseline->Scan(coldest->path, coldest->path_length, coldest->is_recursive, 0, false, settings.poll_thread_count))
+        {
+            DestroySnapshot(baseline);
+            return;
+        }
+        coldest->snapshot = baseline;
+        coldest->mode = EWatchMode::Demoting;
+        demotion_count += 1;
+        QueueUserAPC(DirectoryWatcher::ThreadCancelDirectoryProc, coldest->shard->thread_handle, (u64)coldest);
     }
 }
 
-bool DirectoryWatcher::TryGetNextChange(FileChange* out_change) {return queue.Pop(out_change);}
-
-u32 __stdcall DirectoryWatcher::ThreadProc(void* arg)
+DirectorySnapshot* DirectoryWatcher::CreateSnapshot()
 {
-    DirectoryWatcher* watcher = (DirectoryWatcher*)arg;
-    while (watcher->outstanding_request_count || !watcher->should_terminate) SleepEx((u32)-1, true);
-    return 0;
+    DirectorySnapshot* snapshot = (DirectorySnapshot*)settings.allocator.Allocate(sizeof(DirectorySnapshot), EMemoryTag::Snapshot);
+    assert(snapshot);
+    *snapshot = {};
+    snapshot->allocator = &settings.allocator;
+    return snapshot;
 }
 
-void __stdcall DirectoryWatcher::ThreadAddDirectoryProc(u64 arg)
+void DirectoryWatcher::DestroySnapshot(DirectorySnapshot* snapshot)
 {
-    DirectoryWatcher::ReadChangesRequest* request = (DirectoryWatcher::ReadChangesRequest*)arg;
-    DirectoryWatcher* watcher = request->watcher;
-
-    InterlockedIncrement(&watcher->outstanding_request_count);
-    watcher->BeginRead(request);
+    if (!snapshot) return;
+    snapshot->Destroy();
+    settings.allocator.Free(snapshot, EMemoryTag::Snapshot);
 }
+#endif
 
-void __stdcall DirectoryWatcher::NotificationCompletion(u32 error_code, u32 bytes_transferred, OVERLAPPED* overlapped)
+s32 DirectoryWatcher::CountWatchedDirectories()
 {
-    DirectoryWatcher::ReadChangesRequest* request = (DirectoryWatcher::ReadChangesRequest*)overlapped->hEvent;
-    DirectoryWatcher* watcher = request->watcher;
-
-    // This occurs on shutdown, close the request and return.
-    if (error_code == ERROR_OPERATION_ABORTED || watcher->should_terminate)
+    s32 count = 0;
+    for (ReadChangesRequest* request = requests; request; request = request->next)
     {
-        InterlockedDecrement(&watcher->outstanding_request_count);
-        free(request);
-        return;
+        if (request->mode != EWatchMode::Polled && request->mode != EWatchMode::Replayed) count += 1;
     }
-    else if (error_code) assert(false);
-
-    bool did_overflow = (!error_code && !bytes_transferred);
-
-    // Cycle between the two change buffers, immediately kick off another read request (so we don't miss anything),
-    // and process the change buffer we just received.
-    u8* buffer = request->buffers + (request->buffer_size * (request->buffer_index ^ 1));
-    watcher->BeginRead(request);
-    watcher->ProcessNotification((did_overflow) ? 0 : buffer, request->path, request->path_length);
+    return count;
 }
 
-void DirectoryWatcher::ProcessNotification(u8* buffer, const char16_t* directory_path, s32 directory_path_length)
+DirectoryWatcher::Stats DirectoryWatcher::GetStats()
 {
-    // NOTE(Frog): If we get a null buffer, it means that it overflowed. We will enqueue an error and return.
-    if (!buffer)
+    Stats stats = {};
+    for (ReadChangesRequest* request = requests; request; request = request->next)
     {
-        FileChange change = {};
-        change.action = EFileAction::TooManyChanges;
-        change.is_directory = true;
-        change.path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)directory_path, directory_path_length, change.path, MAX_PATH * 3, 0, 0);
-        change.path[change.path_length] = L'\0';
-        queue.Push(change);
-        return;
+        if (request->mode == EWatchMode::Polled)
+        {
+            stats.polled_directory_count += 1;
+            if (request->buffer_size > 0) stats.watches_saved += 1;
+        }
+        else if (request->mode != EWatchMode::Replayed) stats.watched_directory_count += 1;
     }
-
-    // The buffer has been filled with notify event structs, which have a variable size depending on the path length.
-    // Each event stores the offset of the next one, so we will process them one at a time.
-    FILE_NOTIFY_EXTENDED_INFORMATION* event = 0;
-    s32 offset = 0;
-    do
+    stats.promotion_count = promotion_count;
+    stats.demotion_count = demotion_count;
+    for (s32 i = 0; i < shard_count; ++i)
     {
-        event = (FILE_NOTIFY_EXTENDED_INFORMATION*)(buffer + offset);
-        offset += event->NextEntryOffset;
-
-        s32 combined_path_length = directory_path_length;
-        // Append the "filename" (in reality the path from the monitored directory) to the directory path.
-        char16_t combined_path[MAX_PATH]; // NOTE(Frog): This is a relative path, which is why MAX_PATH is safe here.
-        CopyMemory(combined_path, directory_path, combined_path_length * 2);
-        if (combined_path[combined_path_length - 1] != L'\\') combined_path[combined_path_length++] = L'\\';
-        CopyMemory(combined_path + combined_path_length, event->FileName, event->FileNameLength);
-        combined_path_length += (event->FileNameLength / 2);
-        combined_path[combined_path_length] = L'\0';
-
-        // Figure out what change occured to the file/directory.
-        EFileAction action;
-        switch (event->Action)
+        for (s32 lane = 0; lane < LaneCount; ++lane)
         {
-            case FILE_ACTION_ADDED: action = EFileAction::Added; break;
-            case FILE_ACTION_REMOVED: action = EFileAction::Removed; break;
-            case FILE_ACTION_MODIFIED: action = EFileAction::Modified; break;
-            case FILE_ACTION_RENAMED_OLD_NAME: action = EFileAction::RenamedFrom; break;
-            case FILE_ACTION_RENAMED_NEW_NAME: action = EFileAction::RenamedTo; break;
-            default: action = EFileAction::None; break;
+            stats.dropped_change_count += shards[i].lanes[lane].dropped_count;
+            stats.lock_spin_count += shards[i].lanes[lane].lock.spin_count;
+            stats.lock_park_count += shards[i].lanes[lane].lock.park_count;
         }
-
-        // Fill in the extended info about the file.
-        FileChange change = {};
-        change.creation_time = event->CreationTime.QuadPart;
-        change.modification_time = event->LastModificationTime.QuadPart;
-        change.change_time = event->LastChangeTime.QuadPart;
-        change.access_time = event->LastAccessTime.QuadPart;
-        change.size = event->FileSize.QuadPart;
-        change.attributes = event->FileAttributes;
-
-        change.action = action;
-        change.is_directory = (change.attributes & FILE_ATTRIBUTE_DIRECTORY);
-        change.path_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)combined_path, combined_path_length + 1, change.path, MAX_PATH * 3, 0, 0) - 1;
-        queue.Push(change);
-    } while (event->NextEntryOffset);
+    }
+    stats.journal_error_count = (journal) ? journal->error_count : (s32)did_journal_fail;
+    stats.is_sharing_changes = (shared_ring != 0);
+    return stats;
 }
 
-void DirectoryWatcher::BeginRead(ReadChangesRequest* request)
+void DirectoryWatcher::FreeRequest(ReadChangesRequest* request)
 {
-    u32 filters = FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME;
-    u8* buffer = request->buffers + (request->buffer_size * request->buffer_index);
-    request->buffer_index ^= 1; // Toggle between buffer index 0 and 1 for every notification.
-    ReadDirectoryChangesExW(request->directory, buffer, request->buffer_size, request->is_recursive, filters, 0, &request->overlapped,
-                            (LPOVERLAPPED_COMPLETION_ROUTINE)DirectoryWatcher::NotificationCompletion, ReadDirectoryNotifyExtendedInformation);
+    InterlockedDecrement((LPLONG)&request->shard->directory_count);
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    s32 slot_index = (s32)((RequestSlot*)request - request_slots);
+    assert(slot_index >= 0 && slot_index < DIRECTORY_WATCHER_MAX_DIRECTORIES);
+    InterlockedExchange((LPLONG)&request_slot_used[slot_index], 0);
+#else
+    DestroySnapshot(request->snapshot);
+    settings.allocator.FreeAligned(request, EMemoryTag::Request);
+#endif
 }
 
-void DirectoryWatcher::ThreadSafeQueue::Create()
+void DirectoryWatcher::ThreadSafeQueue::Create(s32 max_count, EQueueFullPolicy policy, const Allocator* in_allocator)
 {
-    lock = 0;
-    data = (FileChange*)malloc(sizeof(FileChange) * InitialCapacity);
-    capacity = InitialCapacity;
+    lock = {};
+    allocator = in_allocator;
+    full_policy = policy;
+    dropped_count = 0;
+    wakeup_proc = 0;
+    wakeup_context = 0;
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    data = storage;
+    capacity = DIRECTORY_WATCHER_QUEUE_CAPACITY;
+    max_capacity = DIRECTORY_WATCHER_QUEUE_CAPACITY;
+#else
+    max_capacity = (max_count > 0) ? ((max_count > 2) ? max_count : 2) : 0; // Room for at least one whole rename.
+    capacity = (max_capacity && max_capacity < InitialCapacity) ? max_capacity : InitialCapacity;
+    data = (QueuedChange*)allocator->Allocate(sizeof(QueuedChange) * capacity, EMemoryTag::Queue);
+#endif
     count = 0;
     front_index = 0;
+    is_dropping_rename = false;
 }
 
-void DirectoryWatcher::ThreadSafeQueue::Push(FileChange element)
+void DirectoryWatcher::ThreadSafeQueue::Push(const FileChange& element, s32 directory_id, s32 directory_path_length)
 {
     Lock();
-    if (count == capacity) Grow();
-    s32 back_index = (front_index + count) % capacity;
-    data[back_index] = element;
-    count += 1;
+
+    // A rename is queued whole or not at all, so if its RenamedFrom didn't make it in, its RenamedTo doesn't either.
+    if (element.action == EFileAction::RenamedTo && is_dropping_rename)
+    {
+        is_dropping_rename = false;
+        dropped_count += 1;
+        Unlock();
+        return;
+    }
+
+    // A RenamedFrom only goes in with room for its RenamedTo behind it, which is pushed straight after it. Nothing
+    // else can be pushed in between, and the consumer doesn't pop a RenamedFrom on its own, so the RenamedTo always fits.
+    s32 needed = (element.action == EFileAction::RenamedFrom) ? 2 : 1;
+    bool has_room = true;
+    if (count + needed > capacity && (!max_capacity || capacity < max_capacity)) Grow();
+    if (count + needed > capacity) has_room = MakeRoom(element, directory_id);
+    if (has_room)
+    {
+        s32 back_index = (front_index + count) % capacity;
+        data[back_index].change = element;
+        data[back_index].directory_id = directory_id;
+        data[back_index].directory_path_length = directory_path_length;
+        count += 1;
+    }
+    else if (element.action == EFileAction::RenamedFrom) is_dropping_rename = true;
+
+    // Only wake the reader once Pop() will actually return something, which isn't the case for half of a rename.
+    WakeupProc proc = 0;
+    void* context = wakeup_context;
+    if (wakeup_proc && (count > 1 || (count == 1 && data[front_index].change.action != EFileAction::RenamedFrom)))
+    {
+        proc = wakeup_proc;
+        wakeup_proc = 0;
+    }
     Unlock();
+    if (proc) proc(context);
 }
 
 bool DirectoryWatcher::ThreadSafeQueue::Pop(FileChange* element)
@@ -219,11 +1532,11 @@ bool DirectoryWatcher::ThreadSafeQueue::Pop(FileChange* element)
     // Note(Frog): Since a rename sends two events, in very rare cases the processing thread might poll in
     // between the "rename from" and "rename to" events being added to the queue. In that case, we will
     // not return the "rename from" event until the matching event comes through.
-    bool has_split_rename = (count == 1 && (data[front_index].action == EFileAction::RenamedFrom));
+    bool has_split_rename = (count == 1 && (data[front_index].change.action == EFileAction::RenamedFrom));
     if (count && !has_split_rename)
     {
 
-        *element = data[front_index];
+        *element = data[front_index].change;
         count -= 1;
         front_index = (front_index + 1) % capacity;
         result = true;
@@ -233,10 +1546,43 @@ bool DirectoryWatcher::ThreadSafeQueue::Pop(FileChange* element)
     return result;
 }
 
+bool DirectoryWatcher::ThreadSafeQueue::PeekSequence(u64* out_sequence)
+{
+    Lock();
+    bool has_change = (count > 1 || (count == 1 && data[front_index].change.action != EFileAction::RenamedFrom));
+    if (has_change) *out_sequence = data[front_index].change.sequence;
+    Unlock();
+    return has_change;
+}
+
+bool DirectoryWatcher::ThreadSafeQueue::ArmWakeup(WakeupProc proc, void* context)
+{
+    Lock();
+    assert(!wakeup_proc); // Someone else is already waiting.
+    bool has_change = (count > 1 || (count == 1 && data[front_index].change.action != EFileAction::RenamedFrom));
+    if (!has_change)
+    {
+        wakeup_proc = proc;
+        wakeup_context = context;
+    }
+    Unlock();
+    return !has_change;
+}
+
+void DirectoryWatcher::ThreadSafeQueue::DisarmWakeup()
+{
+    Lock();
+    wakeup_proc = 0;
+    wakeup_context = 0;
+    Unlock();
+}
+
 void DirectoryWatcher::ThreadSafeQueue::Destroy()
 {
     Lock();
-    free(data);
+#ifndef DIRECTORY_WATCHER_FIXED_CAPACITY
+    allocator->Free(data, EMemoryTag::Queue);
+#endif
     data = 0;
     count = 0;
     capacity = 0;
@@ -247,24 +1593,361 @@ void DirectoryWatcher::ThreadSafeQueue::Destroy()
 void DirectoryWatcher::ThreadSafeQueue::Grow()
 {
     assert(data && capacity);
-
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    assert(false); // Fixed-capacity queues are always at their maximum size.
+#else
     s32 new_capacity = capacity * GrowRate;
-    FileChange* new_data = (FileChange*)malloc(sizeof(FileChange) * new_capacity);
+    if (max_capacity && new_capacity > max_capacity) new_capacity = max_capacity;
+    QueuedChange* new_data = (QueuedChange*)allocator->Allocate(sizeof(QueuedChange) * new_capacity, EMemoryTag::Queue);
+    assert(new_data);
 
     if (front_index + count > capacity)
     {
         s32 block1_count = (capacity - front_index);
         s32 block2_count = count - block1_count;
-        CopyMemory(new_data, data + front_index, block1_count * sizeof(FileChange));
-        CopyMemory(new_data + block1_count, data, block2_count * sizeof(FileChange));
+        CopyMemory(new_data, data + front_index, block1_count * sizeof(QueuedChange));
+        CopyMemory(new_data + block1_count, data, block2_count * sizeof(QueuedChange));
     }
-    else CopyMemory(new_data, data + front_index, count * sizeof(FileChange));
+    else CopyMemory(new_data, data + front_index, count * sizeof(QueuedChange));
 
-    free(data);
+    allocator->Free(data, EMemoryTag::Queue);
     data = new_data;
     capacity = new_capacity;
     front_index = 0;
+#endif
+}
+
+// Called with the lock held and no room for the element (and the RenamedTo behind it, if it's a RenamedFrom). Returns
+// true if there's now room, or false if it has been dropped or folded into something that's already queued.
+// NOTE: Never called for a RenamedTo whose RenamedFrom is queued, Push() made room for both halves up front.
+bool DirectoryWatcher::ThreadSafeQueue::MakeRoom(const FileChange& element, s32 directory_id)
+{
+    s32 needed = (element.action == EFileAction::RenamedFrom) ? 2 : 1;
+    dropped_count += 1;
+    switch (full_policy)
+    {
+        case EQueueFullPolicy::DropNewest: return false;
+        case EQueueFullPolicy::DropOldest:
+        {
+            // Renames go as a pair, so a RenamedTo is never left behind without the RenamedFrom it goes with.
+            while (count + needed > capacity)
+            {
+                bool is_rename = data[front_index].change.action == EFileAction::RenamedFrom;
+                front_index = (front_index + 1) % capacity;
+                count -= 1;
+                if (is_rename && count && data[front_index].change.action == EFileAction::RenamedTo)
+                {
+                    front_index = (front_index + 1) % capacity;
+                    count -= 1;
+                    dropped_count += 1;
+                }
+                if (count + needed > capacity) dropped_count += 1;
+            }
+            return true;
+        }
+        case EQueueFullPolicy::CoalescePath:
+        {
+            if (Coalesce(element, directory_id)) return false;
+        } // Fall through, nothing to merge with.
+        case EQueueFullPolicy::CollapseDirectory: break;
+    }
+
+    // If the element's own directory already has something queued, fold it all into one TooManyChanges event, which
+    // covers the new element too. Otherwise collapse whichever directory is at the front of the queue, or failing that
+    // the first one that has more than one change queued, to make room for the element.
+    if (Collapse(directory_id, 1) >= 0) return false;
+    for (s32 i = 0; i < count && count + needed > capacity; ++i)
+    {
+        s32 id = data[(front_index + i) % capacity].directory_id;
+        if (id >= 0) Collapse(id, 2);
+    }
+    if (count + needed <= capacity) return true;
+
+    // Every queued change is for a different directory. Give up and say that anything may have changed. Both halves
+    // of a rename become the marker, never just one of them.
+    QueuedChange* back = &data[(front_index + count - 1) % capacity];
+    if (back->change.action == EFileAction::RenamedTo && count > 1)
+    {
+        count -= 1;
+        dropped_count += 1;
+        back = &data[(front_index + count - 1) % capacity];
+    }
+    if (back->directory_id != -1)
+    {
+        u64 sequence = back->change.sequence;
+        back->change = {};
+        back->change.sequence = sequence;
+        back->change.action = EFileAction::TooManyChanges;
+        back->change.is_directory = true;
+        back->change.directory_id = -1;
+        back->directory_id = -1;
+        back->directory_path_length = 0;
+    }
+    return false;
+}
+
+// Tries to merge the element with an earlier queued change to the same path. Renames are never merged, since the
+// caller expects them in pairs. Returns true if the element doesn't need to be queued anymore.
+bool DirectoryWatcher::ThreadSafeQueue::Coalesce(const FileChange& element, s32 directory_id)
+{
+    if (element.action != EFileAction::Added && element.action != EFileAction::Removed && element.action != EFileAction::Modified) return false;
+
+    for (s32 i = count - 1; i >= 0; --i)
+    {
+        QueuedChange* queued = &data[(front_index + i) % capacity];
+        FileChange* change = &queued->change;
+        if (queued->directory_id != directory_id || change->path_length != element.path_length) continue;
+        if (memcmp(change->path, element.path, element.path_length) != 0) continue;
+
+        EFileAction before = change->action;
+        EFileAction after = element.action;
+        if (before == EFileAction::Added && after == EFileAction::Removed) {RemoveAt(i); return true;}
+
+        EFileAction merged = EFileAction::None;
+        if (before == EFileAction::Added && after == EFileAction::Modified) merged = EFileAction::Added;
+        else if (before == EFileAction::Modified && after == EFileAction::Modified) merged = EFileAction::Modified;
+        else if (before == EFileAction::Modified && after == EFileAction::Removed) merged = EFileAction::Removed;
+        else if (before == EFileAction::Removed && after == EFileAction::Added) merged = EFileAction::Modified;
+        else return false; // The latest change to this path is a rename or a marker, leave it alone.
+
+        // The merged change keeps its place in the queue, and the sequence numbers that go with it, so the queue
+        // stays in sequence order for PopLane().
+        u64 sequence = change->sequence;
+        u64 root_sequence = change->root_sequence;
+        *change = element;
+        change->action = merged;
+        change->sequence = sequence;
+        change->root_sequence = root_sequence;
+        return true;
+    }
+    return false;
+}
+
+// Replaces the first queued change for a directory with a TooManyChanges event for the directory itself, and removes
+// the rest. Returns how many changes were removed, or -1 if fewer than min_count were queued for that directory.
+s32 DirectoryWatcher::ThreadSafeQueue::Collapse(s32 directory_id, s32 min_count)
+{
+    s32 match_count = 0;
+    for (s32 i = 0; i < count && match_count < min_count; ++i)
+    {
+        if (data[(front_index + i) % capacity].directory_id == directory_id) match_count += 1;
+    }
+    if (match_count < min_count) return -1;
+
+    s32 marker_offset = -1;
+    s32 write_offset = 0;
+    for (s32 read_offset = 0; read_offset < count; ++read_offset)
+    {
+        QueuedChange* queued = &data[(front_index + read_offset) % capacity];
+        if (queued->directory_id == directory_id)
+        {
+            if (marker_offset >= 0) continue;
+            marker_offset = write_offset;
+
+            // The directory path is a prefix of every change path from that directory.
+            FileChange* change = &queued->change;
+            s32 path_length = queued->directory_path_length;
+            FileChange marker = {};
+            marker.action = EFileAction::TooManyChanges;
+            marker.is_directory = true;
+            marker.directory_id = directory_id;
+            marker.sequence = change->sequence; // Takes the first change's place, so it takes its sequence too.
+            marker.root_sequence = change->root_sequence;
+            marker.path_length = path_length;
+            CopyMemory(marker.path, change->path, path_length);
+            marker.path[path_length] = '\0';
+            *change = marker;
+        }
+        if (write_offset != read_offset) data[(front_index + write_offset) % capacity] = *queued;
+        write_offset += 1;
+    }
+
+    if (marker_offset < 0) return -1;
+    s32 removed_count = count - write_offset;
+    count = write_offset;
+    return removed_count;
+}
+
+void DirectoryWatcher::ThreadSafeQueue::RemoveAt(s32 offset)
+{
+    for (s32 i = offset; i < count - 1; ++i) data[(front_index + i) % capacity] = data[(front_index + i + 1) % capacity];
+    count -= 1;
+}
+
+void DirectoryWatcher::ThreadSafeQueue::Lock() {lock.Lock();}
+void DirectoryWatcher::ThreadSafeQueue::Unlock() {lock.Unlock();}
+
+void DirectoryWatcher::QueueLock::Lock()
+{
+    if (InterlockedCompareExchange((LPLONG)&state, 1, 0) == 0) return;
+
+    // Spin for a bit, backing off so we aren't taking the line away from the holder while it works.
+    for (s32 backoff = 1; backoff <= MaxSpinBackoff; backoff *= 2)
+    {
+        for (s32 i = 0; i < backoff; ++i) YieldProcessor();
+        if (state == 0 && InterlockedCompareExchange((LPLONG)&state, 1, 0) == 0)
+        {
+            spin_count += 1;
+            return;
+        }
+    }
+
+    // The holder is taking its time, most likely because it was descheduled. Mark the lock so Unlock() knows to
+    // wake somebody, and sleep until it's free. NOTE: Whoever gets it this way leaves it marked, since there's
+    // no telling whether anyone else is asleep, which costs at most one wakeup for nothing.
+    s32 parked_state = 2;
+    u64 parks = 0;
+    while (InterlockedExchange((LPLONG)&state, 2) != 0)
+    {
+        parks += 1;
+        WaitOnAddress(&state, &parked_state, sizeof(state), INFINITE);
+    }
+    spin_count += 1;
+    park_count += parks;
+}
+
+void DirectoryWatcher::QueueLock::Unlock()
+{
+    if (InterlockedExchange((LPLONG)&state, 0) == 2) WakeByAddressSingle((void*)&state);
+}
+
+void* DirectoryWatcher::Allocator::Allocate(size_t size, EMemoryTag tag) const
+{
+    return (allocate) ? allocate(context, size, tag) : malloc(size);
+}
+
+void DirectoryWatcher::Allocator::Free(void* memory, EMemoryTag tag) const
+{
+    if (!memory) return;
+    if (deallocate) deallocate(context, memory, tag);
+    else free(memory);
+}
+
+void* DirectoryWatcher::Allocator::AllocateAligned(size_t size, EMemoryTag tag) const
+{
+    // Allocate a line extra, and keep what Allocate() gave us just in front of the aligned block for FreeAligned().
+    const size_t line = DIRECTORY_WATCHER_CACHE_LINE_SIZE;
+    u8* memory = (u8*)Allocate(size + line + sizeof(void*), tag);
+    if (!memory) return 0;
+    u8* aligned = (u8*)(((size_t)memory + sizeof(void*) + line - 1) & ~(line - 1));
+    ((void**)aligned)[-1] = memory;
+    return aligned;
+}
+
+void DirectoryWatcher::Allocator::FreeAligned(void* memory, EMemoryTag tag) const
+{
+    if (memory) Free(((void**)memory)[-1], tag);
+}
+
+// The arena is a first-fit free list kept in address order, so neighbouring free blocks can be merged back together.
+// It lives at the start of the block it manages. Allocations come from several threads, so it's guarded by a QueueLock.
+struct ArenaBlock
+{
+    size_t size; // Including this header.
+    ArenaBlock* next; // Only meaningful while the block is free.
+};
+
+struct Arena
+{
+    DirectoryWatcher::QueueLock lock;
+    size_t used;
+    size_t peak;
+    ArenaBlock* free_list;
+};
+
+static const size_t ArenaAlignment = 16;
+static const size_t ArenaHeaderSize = (sizeof(ArenaBlock) + ArenaAlignment - 1) & ~(ArenaAlignment - 1);
+
+static void* ArenaAllocate(void* context, size_t size, DirectoryWatcher::EMemoryTag tag)
+{
+    Arena* arena = (Arena*)context;
+    size_t needed = (ArenaHeaderSize + size + ArenaAlignment - 1) & ~(ArenaAlignment - 1);
+    void* result = 0;
+
+    arena->lock.Lock();
+    for (ArenaBlock** link = &arena->free_list; *link; link = &(*link)->next)
+    {
+        ArenaBlock* block = *link;
+        if (block->size < needed) continue;
+
+        // Split off the tail if what's left over is still worth keeping.
+        if (block->size - needed >= ArenaHeaderSize * 4)
+        {
+            ArenaBlock* rest = (ArenaBlock*)((u8*)block + needed);
+            rest->size = block->size - needed;
+            rest->next = block->next;
+            block->size = needed;
+            *link = rest;
+        }
+        else *link = block->next;
+
+        arena->used += block->size;
+        if (arena->used > arena->peak) arena->peak = arena->used;
+        result = (u8*)block + ArenaHeaderSize;
+        break;
+    }
+    arena->lock.Unlock();
+
+    assert(result); // Out of arena memory.
+    return result;
+}
+
+static void ArenaFree(void* context, void* memory, DirectoryWatcher::EMemoryTag tag)
+{
+    Arena* arena = (Arena*)context;
+    ArenaBlock* block = (ArenaBlock*)((u8*)memory - ArenaHeaderSize);
+
+    arena->lock.Lock();
+    arena->used -= block->size;
+
+    ArenaBlock* previous = 0;
+    ArenaBlock* next = arena->free_list;
+    while (next && next < block)
+    {
+        previous = next;
+        next = next->next;
+    }
+
+    block->next = next;
+    if (next && (u8*)block + block->size == (u8*)next)
+    {
+        block->size += next->size;
+        block->next = next->next;
+    }
+    if (previous && (u8*)previous + previous->size == (u8*)block)
+    {
+        previous->size += block->size;
+        previous->next = block->next;
+    }
+    else if (previous) previous->next = block;
+    else arena->free_list = block;
+    arena->lock.Unlock();
+}
+
+DirectoryWatcher::Allocator DirectoryWatcher::Allocator::CreateArena(void* memory, size_t size)
+{
+    // Put the bookkeeping at the (aligned) start of the block, and hand out the rest as one big free block.
+    u8* start = (u8*)(((size_t)memory + ArenaAlignment - 1) & ~(ArenaAlignment - 1));
+    size_t arena_size = (sizeof(Arena) + ArenaAlignment - 1) & ~(ArenaAlignment - 1);
+    assert(memory && (size_t)(start - (u8*)memory) + arena_size + ArenaHeaderSize * 4 <= size);
+
+    Arena* arena = (Arena*)start;
+    *arena = {};
+    arena->free_list = (ArenaBlock*)(start + arena_size);
+    arena->free_list->size = (size - (size_t)(start - (u8*)memory) - arena_size) & ~(ArenaAlignment - 1);
+    arena->free_list->next = 0;
+
+    Allocator allocator = {};
+    allocator.allocate = ArenaAllocate;
+    allocator.deallocate = ArenaFree;
+    allocator.context = arena;
+    return allocator;
 }
 
-void DirectoryWatcher::ThreadSafeQueue::Lock() {while (InterlockedExchange((LPLONG)&lock, 1) == 1) {/*spin!*/};}
-void DirectoryWatcher::ThreadSafeQueue::Unlock() {InterlockedExchange((LPLONG)&lock, 0);}
+void DirectoryWatcher::Allocator::GetArenaUsage(const Allocator& arena, size_t* out_used, size_t* out_peak)
+{
+    assert(arena.allocate == ArenaAllocate && arena.context);
+    Arena* state = (Arena*)arena.context;
+    if (out_used) *out_used = state->used;
+    if (out_peak) *out_peak = state->peak;
+}
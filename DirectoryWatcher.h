@@ -47,6 +47,44 @@ One disadvantage of this approach is that it requires a statically sized buffer
 directory to be monitored. If enough changes happen at one time to fill the buffer, then the call fails,
 and we would need to track/scan the directory manually to see what changed - which we want to avoid!
 
+Some file systems (a lot of network shares, FUSE-style redirectors, FAT volumes) don't support
+ReadDirectoryChangesExW at all. For those we fall back to polling: AddPolledDirectory() asks for it
+explicitly, and AddDirectory() switches a directory over automatically if its watch can't be started or
+breaks later on. Polled directories are rescanned on a thread pool timer (see DirectorySnapshot.h for how
+the scan works), and the difference from the previous scan is pushed to the same queue as Added, Removed
+and Modified events. Renames show up as a removal and an addition, since a scan can't tell them apart.
+
+Polling also backs the optional watch budget (Settings::max_watched_directories). Each watch pins two change
+buffers and some non-paged kernel memory for as long as it's open, which adds up with hundreds of roots when
+only a handful of them are ever busy. Directories added past the budget start out polled, a polled directory
+whose last rescan found changes gets promoted to a real watch when there's room, and to make room we demote
+the watched directory that has been quiet the longest (at least Settings::watch_cold_after_ms). Swapping
+modes always overlaps the two: the baseline scan is taken before a watch is cancelled, and a promoted
+directory gets one last rescan after its watch has started, so a swap can produce a duplicate event but
+shouldn't lose one. GetStats() reports how many watches the budget is saving.
+
+One watcher thread decodes every notification, which with hundreds of busy roots becomes the ceiling, and
+the buffers start overflowing. Settings::watcher_thread_count splits the directories between several watcher
+threads (shards), each with its own alertable loop and its own segment of the default queue. A directory is
+given to a shard when it's added, and stays there: EShardPolicy::PathHash spreads them by a consistent hash
+of the path (so the same root lands on the same thread from run to run, and changing the thread count only
+moves the roots it has to), EShardPolicy::LeastLoaded gives each one to the shard with the fewest directories.
+Decoding happens in parallel, and only the push itself takes turns between shards, which is what keeps sequence
+numbers in order. TryGetNextChange() merges the segments by taking whichever front change is oldest, so changes
+still come out in sequence order, and a directory's changes always come out in the order they happened.
+
+When one directory floods the queue (a build writing thousands of outputs), the changes behind it wait their
+turn, even ones from a small directory that matters more. AddDirectory() and AddPolledDirectory() take an
+EPriority, and each priority has its own lane in every shard's segment of the default queue. TryGetNextChange()
+drains the lanes by weighted round robin: each lane gets Settings::lane_weights turns per round, highest
+priority first, so a High change that comes in during a storm in the Low lane only waits for the rest of the
+current round, a handful of changes with the default weights. Every lane with something in it gets at least one
+turn per round too, so a busy High lane can't starve the others either. Settings::max_queue_count applies to
+each lane separately, so a flood collapses in its own lane and can't push anything out of the others. A
+directory's changes still come out in order, but changes from directories of different priorities no longer come
+out in sequence order. Subscriptions, handlers and the history aren't affected. In fixed-capacity builds
+DIRECTORY_WATCHER_PRIORITY_LANES says how many lanes there are, and priorities that don't have a lane of their
+own share the lowest one.
 
 A note about MAX_PATH:
 
@@ -69,22 +107,136 @@ to be separated. The queue Pop() function checks for this. If the queue has one
 element is a "Rename From" event, it returns nothing. You could choose to replicate this behavior if you
 swap in your own queue implementation, or you could make the calling code handle that case.
 
+By default the queue grows as needed, which means a consumer that stops calling TryGetNextChange() lets it grow
+without limit. Settings::max_queue_count puts a cap on it, and Settings::queue_full_policy says what to do once
+the cap is reached. The default, CollapseDirectory, folds every queued change for the incoming change's
+directory into a single TooManyChanges event for that directory, so memory stays bounded and the caller knows
+exactly which directory to rescan. CoalescePath first tries to merge the new change into an earlier one for the
+same path (two modifications become one, an addition followed by a removal cancels out), and only collapses if
+that doesn't help. A merged change stays where the earlier one was, with its sequence numbers. DropOldest and
+DropNewest are there if you really don't care. As a last resort, when every queued change is for a different
+directory, the newest one is replaced with a TooManyChanges event with an empty path, which means that anything
+may have changed. Whatever the policy, a rename is kept or dropped as a whole: a RenamedFrom only goes in with room
+for its RenamedTo, and a marker that replaces one half replaces the other too. Stats::dropped_change_count says
+how often any of this has happened. A capped queue always has room for at least one rename.
+
+If several parts of a program want changes, they don't each need their own DirectoryWatcher (and thread, and
+directory handles). Subscribe() creates a consumer with its own filter (a path prefix and a set of actions)
+and its own queue, read with TryGetNextChange(subscription, ...). Each change is stored once, in a reference
+counted record, and every subscription that wants it queues a pointer to it. Renames are filtered as a pair,
+so a subscription never sees a RenamedFrom without the RenamedTo that goes with it. If nothing reads the
+default queue, turn it off with Settings::use_default_queue. Subscriptions always allocate through
+Settings::allocator, even in fixed-capacity builds, so give those an arena if you want to use them.
+
+Every change is stamped with a sequence number, counted across the whole watcher (FileChange::sequence) and
+per added directory (FileChange::root_sequence). With Settings::history_count set, the watcher also keeps
+that many of the most recent changes in a ring, so a client that went away for a while (a build system
+between builds, say) can hold on to a Cursor and ask for ChangesSince() it, rather than keeping a queue of
+its own filling up the whole time. If the changes it missed have already fallen out of the ring, or the
+cursor is from another watcher instance, it gets FreshInstance back and should rescan from scratch.
+The history goes through Settings::allocator as well, in fixed-capacity builds too. For a record that
+outlives the process, Settings::journal_directory writes every change to disk as well, from the thread
+pool rather than the watcher thread (see ChangeJournal.h, which also has a reader for it). To hand changes
+to other processes as they happen, Settings::shared_ring_name publishes each one to a ring in shared memory
+that any number of readers can follow without slowing the watcher down (see SharedChangeRing.h). When
+several tools each want their own roots and filters, tools\WatchDaemon.cpp runs one watcher for all of
+them and serves subscriptions over a local socket instead (see WatchClient.h).
+
+Settings::record_path goes one level lower, and saves the raw buffers ReadDirectoryChangesExW hands back,
+with their timing. Replay() feeds such a recording back through the same decoding as live notifications, at
+the recorded speed, a multiple of it, or as fast as possible, which makes a change storm that happened once
+something you can test and benchmark against as often as you like (see NotificationRecording.h).
+
+AddHandler() turns a subscription around, so changes are pushed to a function instead of being pulled out
+of a queue. Changes are handed over in batches of up to HandlerSettings::max_batch_count, and a batch that
+isn't full yet is held back for at most max_batch_delay_ms, so a burst of changes costs a few calls instead
+of one call per change. The handler can run on the caller's own thread (whenever it calls DispatchHandlers(),
+which suits an update loop), on the Windows thread pool, or inline on the thread that decoded the changes.
+Inline handlers get each notification as soon as it's decoded, without any waiting, but they hold up the
+watcher thread while they run, so keep them short or the change buffers will overflow.
+
+For code that would rather wait for changes than check for them, ArmWakeup() asks for a one-off call as soon
+as a queue (the default one, or a subscription's) has something to read. It's fired by the push itself, so
+there is no polling and no extra thread. DirectoryWatcherCoroutine.h builds a C++20 awaitable on top of it,
+so a coroutine can co_await watcher.NextBatch(...) and be resumed on the thread pool, or on an executor of
+your own, once changes arrive. The rest of the library doesn't need C++20, only that header does.
+
 The event queue contains FileChange structs, which are a fixed size. This tends to waste a lot of space for
 the file path. At the cost of some API complexity, you could use a similar approach to ReadDirectoryChangesW
 and iterate through a buffer where each element's size depends on the path length. This could save a lot of
 space and prevent needless copying.
 
 The library has two C standard library dependencies, assert.h for assert(), and stdlib.h for malloc()
-and free(). You could replace or remove the asserts, and replace allocations with your own scheme.
-
-If you know at compile time how large of a change buffer you want, which directories you are monitoring, and
-provided you are willing to use a fixed-size queue, then you could avoid doing any dynamic allocations at all.
+and free(). You could replace or remove the asserts. Allocations go through Settings::allocator, which
+defaults to malloc() and free(), so you can hand them to your own scheme without touching the library.
+Every allocation is tagged with what it's for, which makes it easy to charge it to the right budget in a
+memory profiler. Allocator::CreateArena() sets up an allocator that carves everything out of one block
+you provide, so the whole watcher lives in memory you control. (Thread pool timers and work items used by
+polling are allocated by Windows itself, and don't go through the allocator.)
+
+If you know at compile time how large of a change buffer you want, how many directories you are monitoring, and
+provided you are willing to use a fixed-size queue, then you can avoid doing any dynamic allocations at all, by
+defining DIRECTORY_WATCHER_FIXED_CAPACITY (project-wide, so every file sees the same struct layout). Requests,
+their change buffers and the queue then live inside the DirectoryWatcher struct, sized by the macros below.
+Every watcher thread gets a queue segment of its own, so the thread count is capped at DIRECTORY_WATCHER_MAX_SHARDS.
+When the queue fills up, Settings::queue_full_policy decides what happens to new events (see below). Polling needs memory
+proportional to the size of the tree, so fixed-capacity builds don't support it: AddPolledDirectory() fails,
+there is no watch budget, and a directory whose watch breaks is reported with TooManyChanges and dropped.
+FileChange::path can also be shrunk with DIRECTORY_WATCHER_MAX_PATH_LENGTH. A change whose path doesn't fit
+gets reported as TooManyChanges for its watched directory instead.
 To contextualize the buffer sizes:
     - The library allocates space for two change buffers per monitored directory. One buffer element uses
       ~88 bytes plus the size of the relative file path (in UTF-16 ish). If it fills up, we have to give up
       and return an error.
-    - The event queue uses 840 bytes per change, since the FileChange struct is a fixed size and needs to
+    - The event queue (and the history ring) uses 864 bytes per change, since the FileChange struct is a fixed size and needs to
       have space for a maximum length relative path.
+
+The state that more than one thread writes is laid out by cache line (DIRECTORY_WATCHER_CACHE_LINE_SIZE), so
+threads don't slow each other down by writing to different things that happen to share a line. Each queue
+segment and lane starts on a line of its own, so a watcher thread pushing into one doesn't keep taking the line
+away from the consumer popping the one next to it. In the watcher itself the consumer's state (lane credits and
+the merged wakeup), the producers' state (the push lock, the sequence and the history ring) and the state that
+only gets read once the watcher is running each get their own lines. A ReadChangesRequest keeps what the
+watcher thread touches on every notification in its first lines, ahead of what is set up once or only used
+while polling, and its change buffers start on a fresh line. tools\QueueBench.cpp measures the difference.
+
+The queues (the default queue's segments and lanes, and every subscription) are guarded by a QueueLock. It's
+held for a handful of instructions at a time, so a thread that finds it taken spins for a few microseconds
+first, pausing for twice as long after each look so it isn't fighting the holder for the cache line. If the
+lock still isn't free by then, the holder has most likely been descheduled in the middle of a push or a pop,
+and the waiter goes to sleep in WaitOnAddress() instead of burning the rest of its time slice (which could be
+the very time slice the holder needs). Stats::lock_spin_count and Stats::lock_park_count say how often each
+happens in the default queue. WaitOnAddress() needs Windows 8 or later, link with Synchronization.lib.
+
+The history ring and each handler's delivery are guarded by a QueueLock too. The history lock is taken for every
+change pushed, and a handler's lock is held for as long as its callback runs, so a second thread delivering to
+the same handler sleeps rather than spinning through the whole callback. The arena's free list, the journal's
+pending buffer, the recorder and the crawler's work queues use one as well. None of them is guaranteed to be quick:
+the arena walks its free list with the lock held, the recorder writes to disk, and the crawler can grow a queue
+through the allocator.
+
+On other platforms QueueLock would park on a futex (FUTEX_WAIT_PRIVATE and FUTEX_WAKE_PRIVATE) where it uses
+WaitOnAddress().
+
+A note about other platforms:
+
+There is no Linux backend (yet). If one gets written, the closest match to the design above is a single
+io_uring instance owned by the watcher thread: one outstanding read SQE per inotify descriptor, playing
+the part of the overlapped ReadDirectoryChangesExW call, and a single io_uring_enter() that reaps every
+completion that arrived while the thread slept, the same way one alertable SleepEx() runs every queued
+completion routine. Any open/stat calls made to enrich an event (inotify doesn't report sizes or times,
+unlike FILE_NOTIFY_EXTENDED_INFORMATION) should be queued on the same ring, with an epoll loop as the
+fallback for kernels where io_uring_setup() fails or is disabled. On Windows none of this is needed:
+the extended notify information already carries the metadata, so there are no per-event syscalls to batch.
+
+inotify watches are per directory, so a Linux backend watching a huge tree would also need a recursive crawl
+at startup and would run into fs.inotify.max_user_watches. The way around that is fanotify with
+FAN_REPORT_DFID_NAME and a FAN_MARK_FILESYSTEM (or FAN_MARK_MOUNT) mark: one mark covers the whole
+filesystem, and events get filtered down to the roots passed to AddDirectory() by resolving the reported
+directory handle. It needs CAP_SYS_ADMIN, so if fanotify_init() fails with EPERM the backend should quietly
+drop back to inotify. Windows doesn't have this problem: a recursive ReadDirectoryChangesExW watch is a
+single handle no matter how big the tree is, and setting it up costs the same for ten files or ten million.
+(The volume-wide equivalent, the NTFS USN change journal, is only worth it if you need to survive restarts.)
 */
 
 #include <Windows.h>
@@ -94,9 +246,42 @@ To contextualize the buffer sizes:
 #include <assert.h>
 #include <stdint.h>
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef int32_t s32;
 typedef uint64_t u64;
+typedef int64_t s64;
+
+#ifndef DIRECTORY_WATCHER_MAX_PATH_LENGTH
+#define DIRECTORY_WATCHER_MAX_PATH_LENGTH (MAX_PATH * 3) // Size of FileChange::path in bytes, see the note about MAX_PATH.
+#endif
+
+#ifndef DIRECTORY_WATCHER_CACHE_LINE_SIZE
+#define DIRECTORY_WATCHER_CACHE_LINE_SIZE 64 // State written by different threads is kept this far apart.
+#endif
+
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+#ifndef DIRECTORY_WATCHER_MAX_DIRECTORIES
+#define DIRECTORY_WATCHER_MAX_DIRECTORIES 16
+#endif
+#ifndef DIRECTORY_WATCHER_BUFFER_SIZE
+#define DIRECTORY_WATCHER_BUFFER_SIZE 32768 // Size of each of the two change buffers per directory, in bytes.
+#endif
+#ifndef DIRECTORY_WATCHER_QUEUE_CAPACITY
+#define DIRECTORY_WATCHER_QUEUE_CAPACITY 1024 // Per watcher thread, each one gets its own segment of the queue.
+#endif
+#ifndef DIRECTORY_WATCHER_MAX_SHARDS
+#define DIRECTORY_WATCHER_MAX_SHARDS 1 // Most watcher threads, see Settings::watcher_thread_count.
+#endif
+#ifndef DIRECTORY_WATCHER_PRIORITY_LANES
+#define DIRECTORY_WATCHER_PRIORITY_LANES 1 // Queue lanes per watcher thread, up to 3, each DIRECTORY_WATCHER_QUEUE_CAPACITY long.
+#endif
+#endif
+
+struct DirectorySnapshot;
+struct ChangeJournal;
+struct NotificationRecorder;
+struct SharedChangeRing;
 
 struct DirectoryWatcher
 {
@@ -112,9 +297,34 @@ struct DirectoryWatcher
         Count
     };
 
+    // What to do with a new change when the queue is full, see the notes at the top of the file.
+    enum struct EQueueFullPolicy
+    {
+        CollapseDirectory = 0,
+        CoalescePath,
+        DropOldest,
+        DropNewest,
+    };
+
+    // How directories are spread across watcher threads, see the notes at the top of the file.
+    enum struct EShardPolicy
+    {
+        PathHash = 0,
+        LeastLoaded,
+    };
+
+    // Which lane of the default queue a directory's changes go in, see the notes at the top of the file.
+    enum struct EPriority
+    {
+        High = 0,
+        Normal,
+        Low,
+        Count
+    };
+
     struct FileChange
     {
-        char path[MAX_PATH * 3];
+        char path[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
         s32 path_length;
 
         EFileAction action;
@@ -126,49 +336,266 @@ struct DirectoryWatcher
         u64 size;
         u32 attributes;
         bool is_directory;
+
+        u64 sequence; // Goes up by one for every change the watcher reports, starting at 1. See ChangesSince().
+        u64 root_sequence; // The same, but counted separately for each directory that was added.
+        s32 directory_id; // Which added directory reported it, numbered from 0 in the order they were added. -1 if no single one did, or it isn't known.
+    };
+
+    enum struct EMemoryTag
+    {
+        Request = 0, // A watched directory: the request itself, its two change buffers and its path.
+        Queue, // Event queue storage.
+        Snapshot, // Directory snapshots and scan bookkeeping for polled directories.
+        Subscription, // Subscriptions, their queues, and the shared change records they point to.
+        History, // The ring of recent changes behind ChangesSince().
+        Journal, // The journal's write buffers, and the index a journal reader builds.
+        Recording, // The buffer used to write a notification recording.
+        SharedRing, // The owner's handles to the shared change ring (the ring itself is in a file mapping).
+        Count
+    };
+
+    struct Allocator
+    {
+        void* (*allocate)(void* context, size_t size, EMemoryTag tag) = 0; // Null means malloc().
+        void (*deallocate)(void* context, void* memory, EMemoryTag tag) = 0; // Null means free().
+        void* context = 0;
+
+        void* Allocate(size_t size, EMemoryTag tag) const;
+        void Free(void* memory, EMemoryTag tag) const;
+        // Same, but aligned to DIRECTORY_WATCHER_CACHE_LINE_SIZE, for the structs that are laid out by cache line.
+        void* AllocateAligned(size_t size, EMemoryTag tag) const;
+        void FreeAligned(void* memory, EMemoryTag tag) const;
+
+        // Creates an allocator that serves every allocation from the given block, which must outlive the watcher.
+        // Allocation fails (and asserts) once the block is full, it never falls back to the heap.
+        static Allocator CreateArena(void* memory, size_t size);
+        // Gets the number of bytes currently allocated from an arena, and the most that have ever been allocated at once.
+        static void GetArenaUsage(const Allocator& arena, size_t* out_used, size_t* out_peak);
     };
 
-    //Initialize the directory watcher, creating a (sleeping) thread to wait for changes.
+    struct Settings
+    {
+        s32 poll_interval_ms = 1000; // How often polled directories are rescanned.
+        s32 poll_full_scan_interval = 10; // Every Nth rescan lists every directory, to catch in-place file modifications.
+        s32 poll_thread_count = 0; // Threads used to scan a polled directory, or 0 for one per processor.
+        s32 max_watched_directories = 0; // Watch budget. Directories past this get polled until they're busy enough to swap in. 0 means no limit.
+        s32 watch_cold_after_ms = 60000; // A watched directory with no changes for this long can be swapped out for a busier polled one.
+        s32 max_queue_count = 0; // Most changes the queue will hold before queue_full_policy kicks in, or 0 to grow as needed.
+        EQueueFullPolicy queue_full_policy = EQueueFullPolicy::CollapseDirectory;
+        Allocator allocator; // Where all of the watcher's memory comes from (unless it's built with DIRECTORY_WATCHER_FIXED_CAPACITY).
+        bool use_default_queue = true; // Set to false if changes are only read through subscriptions, so the default queue doesn't fill up.
+        s32 history_count = 0; // Recent changes kept around for ChangesSince(), or 0 to keep none.
+        const char* journal_directory = 0; // Where to write a journal of every change, or null for no journal. See ChangeJournal.h.
+        u64 journal_segment_size = 64 << 20; // Size of each journal file before a new one is started, at most 4GB - 1.
+        const char* shared_ring_name = 0; // Name to publish changes to other processes under, or null. See SharedChangeRing.h.
+        s32 shared_ring_count = 4096; // Changes the shared ring holds, rounded up to a power of two.
+        const char* record_path = 0; // File to record every raw change buffer to, for Replay(). See NotificationRecording.h.
+        s32 watcher_thread_count = 1; // Threads that wait for and decode notifications, each serving its own share of the directories.
+        EShardPolicy shard_policy = EShardPolicy::PathHash; // Which thread a directory goes to when it's added.
+        s32 lane_weights[(s32)EPriority::Count] = {16, 4, 1}; // Turns each priority lane gets per round of TryGetNextChange(). At least 1.
+    };
+
+    struct SubscriptionFilter
+    {
+        const char* path_prefix = 0; // Only changes under this path, in the same form it was given to AddDirectory(). Null for everything.
+        const char* path_pattern = 0; // Only changes whose full path matches this, like "data/**/*.png" ('*' stays within a directory, '**' doesn't). Null for everything.
+        u32 action_mask = ~0u; // Set bit (1 << EFileAction) for each action wanted. TooManyChanges events are always delivered if they overlap path_prefix.
+        s32 max_queue_count = 0; // Changes this subscription will hold before it reports TooManyChanges and drops the rest, or 0 to grow as needed.
+    };
+
+    struct Subscription; // Opaque, see Subscribe().
+
+    // Where a handler gets called, see AddHandler().
+    enum struct EDispatchMode
+    {
+        CallerPump = 0, // On whichever thread calls DispatchHandlers().
+        ThreadPool, // On the Windows thread pool, one batch at a time per handler.
+        Inline, // On the thread that decoded the changes (the watcher thread, or the poll timer), right after each notification.
+    };
+
+    typedef void (*ChangeHandlerProc)(void* context, const FileChange* changes, s32 change_count);
+
+    struct HandlerSettings
+    {
+        SubscriptionFilter filter;
+        ChangeHandlerProc proc = 0;
+        void* context = 0;
+        EDispatchMode mode = EDispatchMode::CallerPump;
+        s32 max_batch_count = 64; // Most changes passed to the handler in one call.
+        s32 max_batch_delay_ms = 10; // Longest a change waits for its batch to fill up. Inline handlers never wait.
+    };
+
+    struct Handler; // Opaque, see AddHandler().
+
+    typedef void (*WakeupProc)(void* context);
+
+    struct BatchAwaiter; // Defined in DirectoryWatcherCoroutine.h, which needs C++20.
+
+    // A point in the stream of changes. Cursors from a different DirectoryWatcher (or an earlier Initialize()) never match.
+    struct Cursor
+    {
+        u64 instance;
+        u64 sequence; // Sequence of the last change seen.
+    };
+
+    enum struct EHistoryResult
+    {
+        Changes = 0, // The changes since the cursor were returned (possibly none).
+        FreshInstance, // The history doesn't go back far enough, or the cursor is from another instance. Rescan everything.
+    };
+
+    enum struct EReplaySpeed
+    {
+        Recorded = 0, // Wait between notifications as long as the recording did.
+        Max, // Don't wait at all.
+        Scaled, // Wait as long as the recording did, divided by the speed scale (so 2 is twice as fast).
+    };
+
+    struct Stats
+    {
+        s32 watched_directory_count; // Directories with a ReadDirectoryChangesExW watch (including ones about to be swapped out).
+        s32 polled_directory_count;
+        s32 watches_saved; // Polled directories that would have a watch if there was no watch budget.
+        u64 promotion_count; // Times a polled directory was switched to a watch because it was busy.
+        u64 demotion_count; // Times a quiet watched directory was switched to polling to make room.
+        u64 dropped_change_count; // Changes that were dropped, merged or folded into a TooManyChanges event because the queue (any segment or lane of it) was full.
+        s32 journal_error_count; // Journal writes that failed. Also set (to 1) if the journal couldn't be opened at all.
+        bool is_sharing_changes; // The shared ring is open. False if shared_ring_name is taken by another live process.
+        u64 lock_spin_count; // Times a thread found a default queue lock taken and had to wait for it.
+        u64 lock_park_count; // Times a thread gave up spinning on a default queue lock and went to sleep.
+    };
+
+    // Spin then park lock, see the notes at the top of the file. Public so tools\QueueBench.cpp can measure it.
+    struct QueueLock
+    {
+        static const s32 MaxSpinBackoff = 64; // Most pauses between looks at the lock, before going to sleep.
+
+        volatile s32 state = 0; // 0 is free, 1 is held, 2 is held and somebody may be asleep waiting for it.
+        u64 spin_count = 0; // Only touched with the lock held.
+        u64 park_count = 0;
+
+        void Lock();
+        void Unlock();
+    };
+
+    //Initialize the directory watcher, creating (sleeping) threads to wait for changes.
     void Initialize();
-    // Destroys the directory watcher. This cancels any I/O operations and blocks until the watcher thread completes.
+    void Initialize(const Settings& settings);
+    // Destroys the directory watcher. This cancels any I/O operations and blocks until the watcher threads complete.
     void ShutDown();
     // Adds a directory to monitor for changes, optionally monitoring all subdirectories as well.
-    bool AddDirectory(const char* directory, bool is_recursive = true, s32 change_buffer_size = 32768);
+    bool AddDirectory(const char* directory, bool is_recursive = true, s32 change_buffer_size = 32768, EPriority priority = EPriority::Normal);
+    // Adds a directory to monitor by periodically rescanning it, for file systems that don't support change notifications.
+    bool AddPolledDirectory(const char* directory, bool is_recursive = true, EPriority priority = EPriority::Normal);
     // Gets the next change which occured since the last call to this function, or nothing if there are no more changes.
     bool TryGetNextChange(FileChange* out_change);
+    // Gets a rough count of how directories are currently being monitored. Safe to call from any thread.
+    Stats GetStats();
+    // Creates an independent consumer of changes, with its own filter and queue. Safe to call from any thread.
+    // Subscriptions still alive at ShutDown() are destroyed with the watcher.
+    Subscription* Subscribe(const SubscriptionFilter& filter);
+    void Unsubscribe(Subscription* subscription);
+    // Like TryGetNextChange(), but for one subscription. Each subscription should only be read by one thread at a time.
+    bool TryGetNextChange(Subscription* subscription, FileChange* out_change);
+    // Calls settings.proc with batches of the changes that pass settings.filter. Safe to call from any thread.
+    // A handler must not add or remove handlers or subscriptions itself. Handlers still alive at ShutDown() are removed with the watcher.
+    Handler* AddHandler(const HandlerSettings& settings);
+    // Blocks until the handler isn't running on any other thread, so it's safe to free its context afterwards.
+    void RemoveHandler(Handler* handler);
+    // Delivers every batch that is due for the CallerPump handlers, on the calling thread. Returns the number of calls made.
+    s32 DispatchHandlers();
+    // Feeds a recording made with Settings::record_path back through the same decoding as live changes, on the calling thread,
+    // and returns once all of it has been pushed. Its directories are added as replayed directories, which aren't watched.
+    bool Replay(const char* recording_path, EReplaySpeed speed = EReplaySpeed::Recorded, double speed_scale = 1.0);
+    // Gets a cursor for "now", which a later ChangesSince() call can pick up from. Safe to call from any thread.
+    Cursor GetCursor();
+    // Gets up to max_count of the changes made after since, and advances *out_next to the last one returned. Call it again
+    // with *out_next until *out_count comes back 0. Doesn't affect the default queue or subscriptions. Safe to call from any thread.
+    EHistoryResult ChangesSince(const Cursor& since, FileChange* out_changes, s32 max_count, s32* out_count, Cursor* out_next);
+    // Calls proc once, as soon as there is a change to read from the subscription (or from the default queue, if subscription is null).
+    // Returns false without arming anything if there already is one, so read it instead. Only one wakeup can be armed per queue
+    // at a time. proc runs on whichever thread pushed the change, so it should hand the work off rather than do it.
+    bool ArmWakeup(Subscription* subscription, WakeupProc proc, void* context);
+    // For coroutines: s32 count = co_await watcher.NextBatch(subscription, changes, max_count); See DirectoryWatcherCoroutine.h.
+    BatchAwaiter NextBatch(Subscription* subscription, FileChange* out_changes, s32 max_count);
 
 private:
 
-    struct ReadChangesRequest
+    enum struct EWatchMode : s32
+    {
+        Watched = 0,
+        Polled,
+        Promoting, // Polled, with a watch being started. The next poll closes the gap and drops the snapshot.
+        Demoting, // Watched, with a baseline snapshot taken and the watch being cancelled.
+        Replayed, // Only gets changes from Replay(), there is no handle or timer behind it.
+    };
+
+    struct Shard;
+
+    struct alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) ReadChangesRequest
     {
+        // Touched by the watcher thread on every notification.
+        OVERLAPPED overlapped;
         DirectoryWatcher* watcher; // Parent directory watcher that made the request.
+        Shard* shard; // Watcher thread (and queue segment) the directory belongs to.
         u8* buffers;
-        char16_t* path;
+        void* directory;
+        u64 sequence; // Last FileChange::root_sequence handed out for this directory.
+        u64 last_change_tick; // GetTickCount64() when this directory last reported a change (or was added).
         s32 buffer_size;
-        s32 path_length;
-
-        OVERLAPPED overlapped;
-
         s32 buffer_index;
+        s32 id; // Small number identifying this directory in the queue.
+        s32 lane; // Which of its shard's queue lanes the directory's changes go in.
+        s32 utf8_path_length; // Length of the path in UTF-8, which is how much of FileChange::path belongs to the directory.
         bool is_recursive;
-        void* directory;
+        volatile EWatchMode mode;
+        volatile bool is_reading; // Set once a ReadDirectoryChangesExW call has been made for a promoted directory.
+
+        // Set up once, or only used while the directory is polled.
+        alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) char16_t* path;
+        s32 path_length;
+        s32 poll_count;
+        DirectorySnapshot* snapshot; // Last scan of a polled directory, or null until the first scan is done.
+        bool had_poll_changes; // Set if the most recent poll found anything.
         ReadChangesRequest* next; // Link to the next request in the list, if any.
     };
 
-    struct ThreadSafeQueue
+    struct QueuedChange
+    {
+        FileChange change;
+        s32 directory_id; // Which watched directory the change came from, or -1 for a queue-wide TooManyChanges event.
+        s32 directory_path_length; // Length of the watched directory's part of change.path, for collapsing into TooManyChanges.
+    };
+
+    // NOTE: Aligned so that lanes and segments next to each other never share a line.
+    struct alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) ThreadSafeQueue
     {
         static const s32 InitialCapacity = 16;
         static const s32 GrowRate = 2; // Multiplier for the new capacity if we need to grow the queue.
 
-        s32 lock = 0;
-        FileChange* data = 0;
+        QueueLock lock;
+        QueuedChange* data = 0;
         s32 capacity = 0;
+        s32 max_capacity = 0; // 0 means no limit.
         s32 count = 0;
         s32 front_index = 0;
-
-        void Create();
-        void Push(FileChange element);
+        EQueueFullPolicy full_policy = EQueueFullPolicy::CollapseDirectory;
+        u64 dropped_count = 0;
+        bool is_dropping_rename = false; // The last RenamedFrom was dropped, so its RenamedTo has to go as well.
+        const Allocator* allocator = 0;
+        WakeupProc wakeup_proc = 0; // Armed by ArmWakeup(), cleared when it fires.
+        void* wakeup_context = 0;
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+        QueuedChange storage[DIRECTORY_WATCHER_QUEUE_CAPACITY];
+#endif
+
+        void Create(s32 max_count, EQueueFullPolicy policy, const Allocator* allocator);
+        void Push(const FileChange& element, s32 directory_id, s32 directory_path_length);
         bool Pop(FileChange* element);
+        bool PeekSequence(u64* out_sequence); // Sequence of the change Pop() would return, if any.
+        bool ArmWakeup(WakeupProc proc, void* context);
+        void DisarmWakeup();
         void Destroy();
 
         inline void Lock();
@@ -176,18 +603,112 @@ private:
 
         private:
         void Grow();
+        bool MakeRoom(const FileChange& element, s32 directory_id);
+        bool Coalesce(const FileChange& element, s32 directory_id);
+        s32 Collapse(s32 directory_id, s32 min_count);
+        void RemoveAt(s32 offset);
+    };
+
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    static const s32 LaneCount = (DIRECTORY_WATCHER_PRIORITY_LANES < (s32)EPriority::Count) ? DIRECTORY_WATCHER_PRIORITY_LANES : (s32)EPriority::Count;
+#else
+    static const s32 LaneCount = (s32)EPriority::Count;
+#endif
+
+    struct alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) Shard
+    {
+        DirectoryWatcher* watcher;
+        void* thread_handle;
+        u32 outstanding_request_count; // NOTE(Frog): This is incremented/decremented atomically on different threads.
+        volatile s32 directory_count; // Requests given to this shard, for EShardPolicy::LeastLoaded.
+        u64 change_count; // Changes pushed for this shard's directories, breaks ties between equally full shards. Only touched under push_lock.
+        ThreadSafeQueue lanes[LaneCount]; // This shard's segment of the default queue, a lane per priority.
+    };
+
+    struct MergedWakeup
+    {
+        WakeupProc proc;
+        void* context;
     };
 
-    void ProcessNotification(u8* buffer, const char16_t* directory_path, s32 directory_path_length);
-    void BeginRead(ReadChangesRequest* request);
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    struct RequestSlot
+    {
+        ReadChangesRequest request; // NOTE: Must come first, FreeRequest() casts the request pointer back to its slot.
+        u8 buffers[2 * DIRECTORY_WATCHER_BUFFER_SIZE];
+        char16_t path[MAX_PATH];
+    };
+#endif
+
+    ReadChangesRequest* CreateRequest(const char* directory, bool is_recursive, s32 change_buffer_size, EPriority priority);
+    void AppendRequest(ReadChangesRequest* request);
+    void ProcessNotification(ReadChangesRequest* request, u8* buffer);
+    Shard* AssignShard(const char16_t* path, s32 path_length);
+    bool PopLane(s32 lane, FileChange* out_change);
+    void PushChange(ReadChangesRequest* request, FileChange& change, FileChange* rename_to = 0);
+    void PublishChange(const FileChange& change);
+    void DestroySubscription(Subscription* subscription);
+    s32 DeliverBatches(Handler* handler);
+    void DispatchInlineHandlers();
+    bool BeginRead(ReadChangesRequest* request);
+    void BeginPolling(ReadChangesRequest* request);
+    void Poll(ReadChangesRequest* request);
+    void Rebalance();
+    s32 CountWatchedDirectories();
+    void FreeRequest(ReadChangesRequest* request);
+    DirectorySnapshot* CreateSnapshot();
+    void DestroySnapshot(DirectorySnapshot* snapshot);
 
     static u32 __stdcall ThreadProc(void* arg);
+    static void __stdcall ThreadWakeProc(u64 arg);
     static void __stdcall ThreadAddDirectoryProc(u64 arg);
+    static void __stdcall ThreadCancelDirectoryProc(u64 arg);
     static void __stdcall NotificationCompletion(u32 error_code, u32 bytes_transferred, OVERLAPPED* overlapped);
-
-    ThreadSafeQueue queue = {};
+    static void __stdcall PollTimerProc(void* instance, void* arg, void* timer);
+    static void __stdcall HandlerTimerProc(void* instance, void* arg, void* timer);
+    static void __stdcall HandlerWorkProc(void* instance, void* arg, void* work);
+    static void MergedWakeupProc(void* context);
+    void DisarmMergedWakeups();
+
+    // Read by every thread, but only written while setting up, adding directories and shutting down.
+    Settings settings = {};
+    Shard* shards = 0;
+    s32 shard_count = 0;
     ReadChangesRequest* requests = 0;
-    void* thread_handle = 0;
+    s32 next_request_id = 0;
+    u64 instance_id = 0;
+    ChangeJournal* journal = 0;
+    NotificationRecorder* recorder = 0;
+    SharedChangeRing* shared_ring = 0;
+    FileChange* history = 0; // Ring of the last settings.history_count changes.
+    s32 history_count = 0;
     bool should_terminate = false;
-    u32 outstanding_request_count = 0; // NOTE(Frog): This is incremented/decremented atomically on different threads.
+
+    // Written by whoever takes changes from the default queue.
+    alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) s32 lane_credits[LaneCount] = {}; // Turns left for each lane in this round of TryGetNextChange().
+    MergedWakeup* volatile merged_wakeup = 0; // Armed on the merged queue when there's more than one shard or lane, see ArmWakeup().
+    MergedWakeup merged_wakeup_records[2] = {}; // What merged_wakeup points at, used in turn.
+    s32 merged_wakeup_index = 0;
+
+    // Written by the watcher threads for every change they push.
+    alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) SRWLOCK push_lock = SRWLOCK_INIT; // Held while a change is stamped and pushed, so every consumer sees sequences in order. Producers only.
+    SRWLOCK subscription_lock = SRWLOCK_INIT; // Shared while publishing a change, exclusive while adding or removing subscriptions.
+    QueueLock history_lock; // Guards sequence and the ring. Never held while calling out, so readers can't deadlock with producers.
+    u64 sequence = 0;
+    s32 history_front_index = 0;
+    bool did_journal_fail = false;
+    Subscription* subscriptions = 0;
+    volatile s32 inline_handler_count = 0;
+
+    // Written by the poll timer and by Rebalance().
+    alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) void* poll_timer = 0; // Thread pool timer that rescans polled directories, created when the first one is added.
+    s32 is_polling = 0; // Set while a rescan is running, so a slow scan doesn't get a second one started on top of it.
+    u64 promotion_count = 0;
+    u64 demotion_count = 0;
+
+#ifdef DIRECTORY_WATCHER_FIXED_CAPACITY
+    s32 request_slot_used[DIRECTORY_WATCHER_MAX_DIRECTORIES] = {}; // Claimed and released atomically, requests are freed on the watcher thread.
+    RequestSlot request_slots[DIRECTORY_WATCHER_MAX_DIRECTORIES];
+    Shard shard_storage[DIRECTORY_WATCHER_MAX_SHARDS];
+#endif
 };
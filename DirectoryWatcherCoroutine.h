@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+C++20 coroutine support for DirectoryWatcher. This is the only part of the library that needs C++20 (and
+the standard library), so it lives in its own header. Include it wherever you want to co_await changes:
+
+Task WatchAssets(DirectoryWatcher* watcher, DirectoryWatcher::Subscription* subscription)
+{
+    DirectoryWatcher::FileChange changes[64];
+    for (;;)
+    {
+        s32 count = co_await watcher->NextBatch(subscription, changes, 64);
+        // Do whatever processing you need to in here.
+    }
+}
+
+(Task being whatever coroutine type your runtime uses, the awaiter doesn't care.)
+
+NextBatch() fills in as many changes as are ready, up to max_count, and only suspends if there are none.
+While it's suspended nothing polls and no thread blocks: the awaiter arms a wakeup on the queue with
+DirectoryWatcher::ArmWakeup(), and the thread that pushes the next change fires it. Since that is the
+watcher thread (or the poll timer), the coroutine isn't resumed right there. By default it's handed to the
+Windows thread pool, or you can pass your own executor with Via(), for example one that queues the handle
+up for your main loop.
+
+Only one coroutine should wait on a given subscription (or the default queue, if subscription is null) at a
+time. Don't unsubscribe while one is waiting, it won't be resumed.
+*/
+
+#include "DirectoryWatcher.h"
+#include <coroutine>
+
+struct DirectoryWatcher::BatchAwaiter
+{
+    struct Executor
+    {
+        void (*post)(void* context, std::coroutine_handle<> handle) = 0; // Must not resume the handle itself. Null means the thread pool.
+        void* context = 0;
+    };
+
+    DirectoryWatcher* watcher;
+    Subscription* subscription;
+    FileChange* changes;
+    s32 max_count;
+    s32 count;
+    Executor executor;
+    std::coroutine_handle<> handle;
+
+    BatchAwaiter& Via(Executor in_executor) {executor = in_executor; return *this;}
+
+    bool await_ready()
+    {
+        Fill();
+        return count > 0;
+    }
+
+    bool await_suspend(std::coroutine_handle<> in_handle)
+    {
+        // Once the wakeup is armed it can fire on another thread at any moment, so don't touch anything after it.
+        handle = in_handle;
+        return watcher->ArmWakeup(subscription, BatchAwaiter::Wake, this);
+    }
+
+    s32 await_resume()
+    {
+        Fill();
+        return count;
+    }
+
+private:
+
+    void Fill()
+    {
+        while (count < max_count)
+        {
+            bool has_change = (subscription) ? watcher->TryGetNextChange(subscription, changes + count) : watcher->TryGetNextChange(changes + count);
+            if (!has_change) break;
+            count += 1;
+        }
+    }
+
+    static void Wake(void* context)
+    {
+        BatchAwaiter* awaiter = (BatchAwaiter*)context;
+        if (awaiter->executor.post) awaiter->executor.post(awaiter->executor.context, awaiter->handle);
+        else
+        {
+            bool did_submit = TrySubmitThreadpoolCallback((PTP_SIMPLE_CALLBACK)BatchAwaiter::ResumeProc, awaiter->handle.address(), 0);
+            assert(did_submit);
+        }
+    }
+
+    static void __stdcall ResumeProc(PTP_CALLBACK_INSTANCE instance, void* address)
+    {
+        std::coroutine_handle<>::from_address(address).resume();
+    }
+};
+
+inline DirectoryWatcher::BatchAwaiter DirectoryWatcher::NextBatch(Subscription* subscription, FileChange* out_changes, s32 max_count)
+{
+    assert(out_changes && max_count > 0);
+    BatchAwaiter awaiter = {};
+    awaiter.watcher = this;
+    awaiter.subscription = subscription;
+    awaiter.changes = out_changes;
+    awaiter.max_count = max_count;
+    return awaiter;
+}
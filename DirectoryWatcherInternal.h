@@ -0,0 +1,136 @@
+#pragma once
+
+/*
+Helpers shared by the library's .cpp files (and the tools): allocating through an optional
+DirectoryWatcher::Allocator, growing arrays, and comparing, joining and matching paths. Nothing in here is
+part of the public interface, so don't include it from a public header.
+*/
+
+#include "DirectoryWatcher.h"
+
+#include <stdlib.h>
+
+static inline void* Allocate(const DirectoryWatcher::Allocator* allocator, size_t size, DirectoryWatcher::EMemoryTag tag = DirectoryWatcher::EMemoryTag::Snapshot)
+{
+    void* memory = (allocator) ? allocator->Allocate(size, tag) : malloc(size);
+    assert(memory);
+    return memory;
+}
+
+static inline void Free(const DirectoryWatcher::Allocator* allocator, void* memory, DirectoryWatcher::EMemoryTag tag = DirectoryWatcher::EMemoryTag::Snapshot)
+{
+    if (allocator) allocator->Free(memory, tag);
+    else free(memory);
+}
+
+// Grows an array so it can hold at least needed elements. Returns the (possibly moved) array.
+static inline void* GrowArray(const DirectoryWatcher::Allocator* allocator, void* data, s32* capacity, s32 needed, s32 element_size)
+{
+    if (needed <= *capacity) return data;
+    s32 new_capacity = (*capacity) ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    // NOTE: No realloc() in the allocator interface, so copy by hand.
+    void* new_data = Allocate(allocator, (size_t)new_capacity * element_size);
+    if (data) CopyMemory(new_data, data, (size_t)(*capacity) * element_size);
+    Free(allocator, data);
+    *capacity = new_capacity;
+    return new_data;
+}
+
+// Orders names by UTF-16 code unit, the same order a snapshot is sorted in.
+static inline s32 CompareNames(const char16_t* a, s32 a_length, const char16_t* b, s32 b_length)
+{
+    s32 length = (a_length < b_length) ? a_length : b_length;
+    for (s32 i = 0; i < length; ++i)
+    {
+        if (a[i] != b[i]) return (a[i] < b[i]) ? -1 : 1;
+    }
+    return (a_length == b_length) ? 0 : ((a_length < b_length) ? -1 : 1);
+}
+
+// Joins a parent path and a name with a backslash, unless the parent is empty. Returns the length, or -1 if it doesn't fit.
+static inline s32 JoinPath(char16_t* out, s32 out_capacity, const char16_t* parent, s32 parent_length, const char16_t* name, s32 name_length)
+{
+    s32 length = parent_length + (parent_length ? 1 : 0) + name_length;
+    if (length + 1 > out_capacity) return -1;
+    CopyMemory(out, parent, parent_length * 2);
+    if (parent_length) out[parent_length] = u'\\';
+    CopyMemory(out + length - name_length, name, name_length * 2);
+    out[length] = u'\0';
+    return length;
+}
+
+// Paths are compared the way Windows would: ignoring (ASCII) case, and treating forward and back slashes the same.
+// Works on UTF-8 (char) and UTF-16 (char16_t) paths alike.
+template <typename Char>
+static inline Char FoldPathChar(Char c)
+{
+    if (c == '/') return '\\';
+    if (c >= 'A' && c <= 'Z') return (Char)(c + ('a' - 'A'));
+    return c;
+}
+
+// '?' matches any one character and '*' any run of characters within a directory name, '**' can span directories.
+// A "**/" that starts a directory name can also match nothing at all, so "data/**/*.png" matches "data/a.png".
+// NOTE: No recursion, this runs under the push lock. On a mismatch the last '*' takes one more character, and once
+// it would have to leave its directory, the last '**' does instead. That's enough, since neither has to give any back.
+template <typename Char>
+static bool MatchesPattern(const Char* pattern, const Char* path)
+{
+    const Char* pattern_start = pattern;
+    const Char* star_pattern = 0;
+    const Char* star_path = 0;
+    const Char* span_pattern = 0;
+    const Char* span_path = 0;
+    bool does_span_whole_directories = false;
+    for (;;)
+    {
+        if (*pattern == '*')
+        {
+            bool can_span_directories = (pattern[1] == '*');
+            bool starts_directory_name = (pattern == pattern_start || FoldPathChar(pattern[-1]) == '\\');
+            while (*pattern == '*') ++pattern;
+            if (can_span_directories)
+            {
+                // Such a "**/" only ever takes whole directories, starting with none.
+                does_span_whole_directories = (starts_directory_name && FoldPathChar(*pattern) == '\\');
+                if (does_span_whole_directories) ++pattern;
+                span_pattern = pattern;
+                span_path = path;
+                star_pattern = 0;
+            }
+            else
+            {
+                star_pattern = pattern;
+                star_path = path;
+            }
+            continue;
+        }
+
+        bool is_separator = (FoldPathChar(*path) == '\\');
+        if (*path && *pattern && ((*pattern == '?' && !is_separator) || FoldPathChar(*pattern) == FoldPathChar(*path)))
+        {
+            ++pattern;
+            ++path;
+            continue;
+        }
+        if (!*pattern && !*path) return true;
+
+        if (star_pattern && *star_path && FoldPathChar(*star_path) != '\\')
+        {
+            pattern = star_pattern;
+            path = ++star_path;
+            continue;
+        }
+        if (!span_pattern || !*span_path) return false;
+        if (does_span_whole_directories)
+        {
+            while (*span_path && FoldPathChar(*span_path) != '\\') ++span_path;
+            if (!*span_path) return false;
+        }
+        pattern = span_pattern;
+        path = ++span_path;
+        star_pattern = 0;
+    }
+}
@@ -0,0 +1,135 @@
+#include "NotificationRecording.h"
+
+typedef NotificationRecording::Chunk Chunk;
+
+static u64 GetTicks()
+{
+    LARGE_INTEGER counter = {};
+    QueryPerformanceCounter(&counter);
+    return (u64)counter.QuadPart;
+}
+
+bool NotificationRecorder::Open(const char* path, const DirectoryWatcher::Allocator* in_allocator)
+{
+    allocator = in_allocator;
+    char16_t wide_path[MAX_PATH];
+    if (MultiByteToWideChar(CP_UTF8, 0, path, -1, (LPWSTR)wide_path, MAX_PATH) <= 0) return false;
+    file = CreateFileW((LPCWSTR)wide_path, GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = 0;
+        return false;
+    }
+
+    LARGE_INTEGER frequency = {};
+    QueryPerformanceFrequency(&frequency);
+    NotificationRecording::FileHeader header = {NotificationRecording::Magic, NotificationRecording::Version, (u64)frequency.QuadPart};
+    DWORD written = 0;
+    if (!WriteFile(file, &header, sizeof(header), &written, 0) || written != sizeof(header))
+    {
+        Close();
+        return false;
+    }
+    start_ticks = GetTicks();
+    return true;
+}
+
+void NotificationRecorder::Close()
+{
+    if (file) CloseHandle(file);
+    if (scratch) allocator->Free(scratch, DirectoryWatcher::EMemoryTag::Recording);
+    file = 0;
+    scratch = 0;
+    scratch_capacity = 0;
+}
+
+void NotificationRecorder::Record(NotificationRecording::EChunkType type, s32 directory_id, bool is_recursive, const void* payload, u32 payload_size)
+{
+    u64 time = GetTicks() - start_ticks;
+    s32 total_size = (s32)((sizeof(Chunk) + payload_size + 7) & ~7);
+
+    lock.Lock();
+    if (total_size > scratch_capacity)
+    {
+        // Sized for the biggest change buffer seen so far, so this stops happening almost right away.
+        if (scratch) allocator->Free(scratch, DirectoryWatcher::EMemoryTag::Recording);
+        scratch_capacity = (total_size > 65536) ? total_size : 65536;
+        scratch = (u8*)allocator->Allocate(scratch_capacity, DirectoryWatcher::EMemoryTag::Recording);
+        assert(scratch);
+    }
+    Chunk* chunk = (Chunk*)scratch;
+    chunk->type = type;
+    chunk->size = payload_size;
+    chunk->time = time;
+    chunk->directory_id = directory_id;
+    chunk->is_recursive = is_recursive;
+    if (payload_size) CopyMemory(chunk + 1, payload, payload_size);
+    for (s32 i = (s32)(sizeof(Chunk) + payload_size); i < total_size; ++i) scratch[i] = 0;
+
+    DWORD written = 0;
+    if (!WriteFile(file, scratch, total_size, &written, 0) || (s32)written != total_size) InterlockedIncrement((LPLONG)&error_count);
+    lock.Unlock();
+}
+
+bool NotificationRecordingReader::Open(const char* path)
+{
+    Close();
+    char16_t wide_path[MAX_PATH];
+    if (MultiByteToWideChar(CP_UTF8, 0, path, -1, (LPWSTR)wide_path, MAX_PATH) <= 0) return false;
+    file = CreateFileW((LPCWSTR)wide_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = 0;
+        return false;
+    }
+
+    LARGE_INTEGER file_size = {};
+    if (!GetFileSizeEx(file, &file_size) || (u64)file_size.QuadPart < sizeof(header))
+    {
+        Close();
+        return false;
+    }
+    mapping = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+    view = (mapping) ? (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+    if (!view)
+    {
+        Close();
+        return false;
+    }
+    view_size = (u64)file_size.QuadPart;
+
+    CopyMemory(&header, view, sizeof(header));
+    if (header.magic != NotificationRecording::Magic || header.version != NotificationRecording::Version || !header.ticks_per_second)
+    {
+        Close();
+        return false;
+    }
+    offset = sizeof(header);
+    return true;
+}
+
+void NotificationRecordingReader::Close()
+{
+    if (view) UnmapViewOfFile(view);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    view = 0;
+    mapping = 0;
+    file = 0;
+    view_size = 0;
+    offset = 0;
+}
+
+bool NotificationRecordingReader::Next(Chunk* out_chunk, const u8** out_payload)
+{
+    assert(out_chunk && out_payload);
+    if (offset + sizeof(Chunk) > view_size) return false;
+    const Chunk* chunk = (const Chunk*)(view + offset);
+    u64 total_size = (sizeof(Chunk) + (u64)chunk->size + 7) & ~(u64)7;
+    if (offset + sizeof(Chunk) + chunk->size > view_size || (u32)chunk->type > (u32)NotificationRecording::EChunkType::Overflow) return false;
+
+    *out_chunk = *chunk;
+    *out_payload = (const u8*)(chunk + 1);
+    offset += total_size;
+    return true;
+}
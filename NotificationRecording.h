@@ -0,0 +1,78 @@
+#pragma once
+
+/*
+A notification recording captures exactly what ReadDirectoryChangesExW handed the watcher, so a change storm
+(a big branch switch, a build tree being wiped) can be fed back through the same decoding code later, on
+demand, as many times as you like. Turn it on with DirectoryWatcher::Settings::record_path, and play it
+back with DirectoryWatcher::Replay().
+
+The file is a FileHeader followed by Chunks, each padded to 8 bytes so the notification buffers inside stay
+aligned the way FILE_NOTIFY_EXTENDED_INFORMATION needs when the file is mapped. A Directory chunk is written
+whenever a directory is added, holding its UTF-16 path, and every completed read writes a Notification chunk
+holding the raw buffer, or an Overflow chunk if the buffer overflowed or the watch broke. Polled directories
+only show up as a Directory chunk, since there's no buffer to capture for them.
+
+Recording happens on the watcher thread, with one WriteFile() per notification. That's fine for a capture
+session, but don't leave it on all the time: the change journal (see ChangeJournal.h) is the one meant for that.
+*/
+
+#include "DirectoryWatcher.h"
+
+struct NotificationRecording
+{
+    static const u32 Magic = 0x31525744; // "DWR1"
+    static const u32 Version = 1;
+
+    enum struct EChunkType : u32
+    {
+        Directory = 0, // A directory was added. Payload is its UTF-16 path.
+        Notification, // A read completed. Payload is the raw change buffer.
+        Overflow, // A read completed with nothing in it (the buffer overflowed), or the watch broke. No payload.
+    };
+
+    struct FileHeader
+    {
+        u32 magic;
+        u32 version;
+        u64 ticks_per_second; // Chunk::time is in these units.
+    };
+
+    struct Chunk
+    {
+        EChunkType type;
+        u32 size; // Of the payload, not including padding.
+        u64 time; // Since recording started.
+        s32 directory_id;
+        u32 is_recursive; // Directory chunks only.
+    };
+};
+
+struct NotificationRecorder
+{
+    void* file = 0;
+    u64 start_ticks = 0;
+    DirectoryWatcher::QueueLock lock; // Directories are added on the caller's thread, notifications arrive on the watcher thread.
+    u8* scratch = 0; // Chunk and payload get copied together, so each one is a single write.
+    s32 scratch_capacity = 0;
+    const DirectoryWatcher::Allocator* allocator = 0;
+    volatile s32 error_count = 0;
+
+    bool Open(const char* path, const DirectoryWatcher::Allocator* allocator);
+    void Close();
+    void Record(NotificationRecording::EChunkType type, s32 directory_id, bool is_recursive, const void* payload, u32 payload_size);
+};
+
+struct NotificationRecordingReader
+{
+    NotificationRecording::FileHeader header = {};
+    void* file = 0;
+    void* mapping = 0;
+    const u8* view = 0;
+    u64 view_size = 0;
+    u64 offset = 0;
+
+    bool Open(const char* path);
+    void Close();
+    // Gets the next chunk and its payload, which points into the mapped file. False at the end, or at the first damaged chunk.
+    bool Next(NotificationRecording::Chunk* out_chunk, const u8** out_payload);
+};
@@ -0,0 +1,299 @@
+#include "SharedChangeRing.h"
+
+static bool IsProcessAlive(u32 process_id)
+{
+    void* process = OpenProcess(SYNCHRONIZE, false, process_id);
+    // NOTE: A process we aren't allowed to open is still alive, only one that doesn't exist any more is gone.
+    if (!process) return GetLastError() != ERROR_INVALID_PARAMETER;
+    bool is_alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return is_alive;
+}
+
+bool SharedChangeRing::GetObjectNames(const char* name, char16_t* out_mapping_name, char16_t* out_semaphore_name, s32 out_capacity)
+{
+    assert(name && out_mapping_name && out_semaphore_name);
+    s32 length = MultiByteToWideChar(CP_UTF8, 0, name, -1, (LPWSTR)out_mapping_name, out_capacity - 5) - 1;
+    if (length <= 0) return false;
+    CopyMemory(out_semaphore_name, out_mapping_name, length * 2);
+    CopyMemory(out_semaphore_name + length, u".wake", 6 * 2);
+    return true;
+}
+
+bool SharedChangeRing::Open(const char* name, s32 slot_count, u64 instance_id)
+{
+    char16_t mapping_name[MAX_PATH];
+    char16_t semaphore_name[MAX_PATH];
+    if (!GetObjectNames(name, mapping_name, semaphore_name, MAX_PATH)) return false;
+
+    u32 count = 64;
+    while ((s32)count < slot_count) count *= 2;
+    u32 slot_size = (u32)((sizeof(Record) + DIRECTORY_WATCHER_MAX_PATH_LENGTH + 63) & ~63);
+    u64 size = GetHeaderSize() + (u64)count * slot_size;
+
+    // Backed by the page file, so it only lasts as long as somebody has it open.
+    mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, (LPCWSTR)mapping_name);
+    if (!mapping) return false;
+    bool did_exist = GetLastError() == ERROR_ALREADY_EXISTS;
+    header = (Header*)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    if (!header)
+    {
+        Close();
+        return false;
+    }
+
+    if (did_exist)
+    {
+        // Take over only from an owner that's done with it, and only if the layout is what its readers already have mapped.
+        bool is_compatible = header->magic == Magic && header->version == Version && header->slot_size == slot_size &&
+                             header->slot_count == count && header->path_capacity == DIRECTORY_WATCHER_MAX_PATH_LENGTH;
+        if (!is_compatible || (!header->is_closed && IsProcessAlive(header->owner_process_id)))
+        {
+            UnmapViewOfFile(header);
+            header = 0;
+            Close();
+            return false;
+        }
+    }
+
+    semaphore = CreateSemaphoreW(0, 0, 0x7FFFFFFF, (LPCWSTR)semaphore_name);
+    if (!semaphore)
+    {
+        UnmapViewOfFile(header);
+        header = 0;
+        Close();
+        return false;
+    }
+
+    // NOTE: On a takeover head carries on counting from where the last owner stopped, so slot stamps stay meaningful.
+    header->magic = Magic;
+    header->version = Version;
+    header->slot_size = slot_size;
+    header->slot_count = count;
+    header->path_capacity = DIRECTORY_WATCHER_MAX_PATH_LENGTH;
+    header->owner_process_id = GetCurrentProcessId();
+    InterlockedExchange64((LONGLONG volatile*)&header->instance_id, (LONGLONG)instance_id);
+    InterlockedExchange((LPLONG)&header->is_closed, 0);
+    return true;
+}
+
+void SharedChangeRing::Close()
+{
+    if (header)
+    {
+        // Wake everybody, so they see it's closed rather than sleeping until their timeout.
+        InterlockedExchange((LPLONG)&header->is_closed, 1);
+        s32 waiter_count = InterlockedExchange((LPLONG)&header->waiter_count, 0);
+        if (waiter_count > 0 && semaphore) ReleaseSemaphore(semaphore, waiter_count, 0);
+        UnmapViewOfFile(header);
+    }
+    if (semaphore) CloseHandle(semaphore);
+    if (mapping) CloseHandle(mapping);
+    header = 0;
+    semaphore = 0;
+    mapping = 0;
+}
+
+void SharedChangeRing::Publish(const DirectoryWatcher::FileChange& change)
+{
+    u64 index = header->head;
+    Record* record = (Record*)GetSlot(header, index);
+
+    // Odd while we're in here, so a reader that was looking at the old change knows it was pulled out from under it.
+    InterlockedExchange64((LONGLONG volatile*)&record->stamp, (LONGLONG)(2 * (index + 1) - 1));
+    record->sequence = change.sequence;
+    record->root_sequence = change.root_sequence;
+    record->creation_time = change.creation_time;
+    record->modification_time = change.modification_time;
+    record->change_time = change.change_time;
+    record->access_time = change.access_time;
+    record->size = change.size;
+    record->attributes = change.attributes;
+    s32 path_length = (change.path_length > 0) ? change.path_length : 0;
+    record->path_length = (u16)path_length;
+    record->action = (u8)change.action;
+    record->is_directory = change.is_directory;
+    CopyMemory(record + 1, change.path, path_length);
+    InterlockedExchange64((LONGLONG volatile*)&record->stamp, (LONGLONG)(2 * (index + 1)));
+    InterlockedExchange64((LONGLONG volatile*)&header->head, (LONGLONG)(index + 1));
+}
+
+void SharedChangeRing::Wake()
+{
+    if (!header->waiter_count) return;
+    s32 waiter_count = InterlockedExchange((LPLONG)&header->waiter_count, 0);
+    if (waiter_count > 0) ReleaseSemaphore(semaphore, waiter_count, 0);
+}
+
+bool SharedChangeRingReader::Open(const char* name, bool from_oldest)
+{
+    Close();
+    char16_t mapping_name[MAX_PATH];
+    char16_t semaphore_name[MAX_PATH];
+    if (!SharedChangeRing::GetObjectNames(name, mapping_name, semaphore_name, MAX_PATH)) return false;
+
+    // Writable too, for the waiter count.
+    mapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, false, (LPCWSTR)mapping_name);
+    header = (mapping) ? (SharedChangeRing::Header*)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0) : 0;
+    semaphore = (header) ? OpenSemaphoreW(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, false, (LPCWSTR)semaphore_name) : 0;
+    if (!semaphore || header->magic != SharedChangeRing::Magic || header->version != SharedChangeRing::Version)
+    {
+        Close();
+        return false;
+    }
+
+    instance_id = header->instance_id;
+    u64 head = header->head;
+    cursor = head;
+    if (from_oldest) cursor = (head > header->slot_count) ? head - header->slot_count : 0;
+    overrun_count = 0;
+    lost_count = 0;
+    is_in_read = false;
+    return true;
+}
+
+void SharedChangeRingReader::Close()
+{
+    if (header) UnmapViewOfFile(header);
+    if (semaphore) CloseHandle(semaphore);
+    if (mapping) CloseHandle(mapping);
+    header = 0;
+    semaphore = 0;
+    mapping = 0;
+}
+
+bool SharedChangeRingReader::TryGetNextChange(DirectoryWatcher::FileChange* out_change)
+{
+    assert(out_change);
+    u64 previous_overrun_count = overrun_count;
+    const SharedChangeRing::Record* record = BeginRead();
+    if (overrun_count != previous_overrun_count)
+    {
+        is_in_read = false;
+        record = 0;
+    }
+
+    if (record)
+    {
+        out_change->sequence = record->sequence;
+        out_change->root_sequence = record->root_sequence;
+        out_change->directory_id = -1; // Not published, directory ids only mean something inside the owner.
+        out_change->creation_time = record->creation_time;
+        out_change->modification_time = record->modification_time;
+        out_change->change_time = record->change_time;
+        out_change->access_time = record->access_time;
+        out_change->size = record->size;
+        out_change->attributes = record->attributes;
+        out_change->action = (DirectoryWatcher::EFileAction)record->action;
+        out_change->is_directory = record->is_directory;
+
+        // An owner built with longer paths gets cut short, rather than overflowing.
+        s32 path_length = record->path_length;
+        if (path_length > (s32)header->path_capacity) path_length = (s32)header->path_capacity;
+        if (path_length > DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1) path_length = DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1;
+        CopyMemory(out_change->path, record + 1, path_length);
+        out_change->path[path_length] = '\0';
+        out_change->path_length = path_length;
+        if (EndRead()) return true;
+    }
+    if (overrun_count == previous_overrun_count) return false;
+
+    // What we wanted was overwritten, so all we can say is that anything may have changed.
+    *out_change = {};
+    out_change->action = DirectoryWatcher::EFileAction::TooManyChanges;
+    out_change->directory_id = -1;
+    return true;
+}
+
+const SharedChangeRing::Record* SharedChangeRingReader::BeginRead()
+{
+    assert(header && !is_in_read);
+    if (!CheckPosition() || cursor == header->head) return 0;
+
+    const SharedChangeRing::Record* record = (const SharedChangeRing::Record*)SharedChangeRing::GetSlot(header, cursor);
+    u64 stamp = record->stamp;
+    if (stamp != 2 * (cursor + 1))
+    {
+        // Already overwritten by a later change. (It can't be an earlier one, head only moves once a slot is written.)
+        overrun_count += 1;
+        lost_count += header->head - cursor;
+        cursor = header->head;
+        return 0;
+    }
+    MemoryBarrier(); // Nothing in the record can be read before the stamp was.
+    is_in_read = true;
+    return record;
+}
+
+bool SharedChangeRingReader::EndRead()
+{
+    assert(is_in_read);
+    is_in_read = false;
+    MemoryBarrier(); // Everything read from the record has been read before the stamp is looked at again.
+    const SharedChangeRing::Record* record = (const SharedChangeRing::Record*)SharedChangeRing::GetSlot(header, cursor);
+    if (record->stamp != 2 * (cursor + 1))
+    {
+        overrun_count += 1;
+        lost_count += header->head - cursor;
+        cursor = header->head;
+        return false;
+    }
+    cursor += 1;
+    return true;
+}
+
+// Takes back a Wait() that didn't get woken, unless the writer already reset the count to wake everyone. Then the
+// semaphore keeps the count it was given for us, which wakes whoever waits next instead, so nobody is left asleep.
+static void RemoveWaiter(volatile s32* waiter_count)
+{
+    for (s32 count = *waiter_count; count > 0;)
+    {
+        s32 seen = InterlockedCompareExchange((LPLONG)waiter_count, count - 1, count);
+        if (seen == count) return;
+        count = seen;
+    }
+}
+
+bool SharedChangeRingReader::Wait(u32 timeout_ms)
+{
+    assert(header);
+    if (HasChanges()) return true;
+    InterlockedIncrement((LPLONG)&header->waiter_count);
+    if (HasChanges())
+    {
+        RemoveWaiter(&header->waiter_count);
+        return true;
+    }
+    if (WaitForSingleObject(semaphore, timeout_ms) == WAIT_OBJECT_0) return HasChanges();
+    RemoveWaiter(&header->waiter_count);
+    return false;
+}
+
+bool SharedChangeRingReader::HasChanges() const
+{
+    return header->is_closed || header->head != cursor || header->instance_id != instance_id;
+}
+
+bool SharedChangeRingReader::CheckPosition()
+{
+    if (header->instance_id != instance_id)
+    {
+        // A new owner took over. Its changes have nothing to do with the ones we've read so far.
+        instance_id = header->instance_id;
+        overrun_count += 1;
+        cursor = header->head;
+        return false;
+    }
+
+    // More than a ring behind, so what we wanted next is gone. Changes before the newest ones add nothing once we have to
+    // report a TooManyChanges anyway, so skip straight to the front.
+    u64 head = header->head;
+    if (head - cursor > header->slot_count)
+    {
+        overrun_count += 1;
+        lost_count += head - cursor;
+        cursor = head;
+        return false;
+    }
+    return true;
+}
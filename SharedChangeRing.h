@@ -0,0 +1,117 @@
+#pragma once
+
+/*
+SharedChangeRing lets one process own a DirectoryWatcher and every other process on the machine read its
+changes, rather than each of them watching the same tree with its own threads and kernel buffers and
+decoding the same notifications again. Turn it on with DirectoryWatcher::Settings::shared_ring_name, then
+open a SharedChangeRingReader with the same name in as many processes as you like.
+
+The ring is a named, page file backed file mapping: a Header, followed by Settings::shared_ring_count fixed
+size slots, each a Record followed by room for a path of DIRECTORY_WATCHER_MAX_PATH_LENGTH bytes. The owner
+writes every change into the next slot as it's pushed, under the watcher's push lock, so there is only ever
+one writer. Nothing the readers do can hold it up: it never waits for them, and simply overwrites the
+oldest slot once the ring is full.
+
+Each reader keeps its own cursor, the number of the next slot it wants, in its own process. A slot's stamp
+says which change it holds and whether it's finished being written (it's odd while the writer is in it), so
+a reader checks the stamp before and after looking at a slot and knows if it was overwritten in between.
+A reader that falls more than a ring behind gets a TooManyChanges with an empty path, meaning anything may
+have changed, and carries on from the newest change (anything older adds nothing once it has to rescan).
+BeginRead() and EndRead() read a
+change in place, without copying it; TryGetNextChange() copies it out into a FileChange.
+
+Readers that run out of changes can Wait(). They count themselves in the header and sleep on a named
+semaphore, which the owner releases once per waiting reader after each push. If the owner goes away, the
+header is marked closed and readers see IsClosed(). A new owner can take over the name once the old one
+is closed or its process is gone, and readers get a TooManyChanges when they notice the switch.
+*/
+
+#include "DirectoryWatcher.h"
+
+struct SharedChangeRing
+{
+    static const u32 Magic = 0x31524344; // "DCR1"
+    static const u32 Version = 1;
+
+    struct Header
+    {
+        u32 magic;
+        u32 version;
+        u32 slot_size; // Bytes per slot, the Record and its path, rounded up to a cache line.
+        u32 slot_count; // Always a power of two.
+        u32 path_capacity; // DIRECTORY_WATCHER_MAX_PATH_LENGTH of the owner.
+        u32 owner_process_id;
+        u64 instance_id; // DirectoryWatcher::Cursor::instance of the owner.
+        volatile u64 head; // Changes written so far. The next one goes in slot head % slot_count.
+        volatile s32 waiter_count; // Readers asleep in Wait(), or about to be.
+        volatile s32 is_closed;
+    };
+
+    struct Record
+    {
+        volatile u64 stamp; // 2 * (index + 1) once change number index is in the slot, one less while it's being written.
+        u64 sequence;
+        u64 root_sequence;
+        u64 creation_time;
+        u64 modification_time;
+        u64 change_time;
+        u64 access_time;
+        u64 size;
+        u32 attributes;
+        u16 path_length;
+        u8 action;
+        u8 is_directory;
+        // Followed by the path, path_capacity bytes, not null terminated.
+    };
+
+    Header* header = 0;
+    void* mapping = 0;
+    void* semaphore = 0;
+
+    // Creates the mapping, or takes over one whose owner has gone away. False if another live process owns the name.
+    bool Open(const char* name, s32 slot_count, u64 instance_id);
+    // Marks the ring closed, wakes every reader so they notice, and unmaps it.
+    void Close();
+    // Writes one change into the ring. Only ever called by one thread at a time.
+    void Publish(const DirectoryWatcher::FileChange& change);
+    // Wakes the readers waiting for changes. Cheap when nobody is waiting.
+    void Wake();
+
+    static u8* GetSlot(Header* header, u64 index) {return (u8*)header + GetHeaderSize() + (size_t)(index & (header->slot_count - 1)) * header->slot_size;}
+    static size_t GetHeaderSize() {return (sizeof(Header) + 63) & ~(size_t)63;}
+    // Writes the names of the mapping and the semaphore for a ring name. False if they don't fit.
+    static bool GetObjectNames(const char* name, char16_t* out_mapping_name, char16_t* out_semaphore_name, s32 out_capacity);
+};
+
+struct SharedChangeRingReader
+{
+    SharedChangeRing::Header* header = 0;
+    void* mapping = 0;
+    void* semaphore = 0;
+    u64 cursor = 0; // Index of the next change to read.
+    u64 instance_id = 0; // Of the owner when we last looked, so a new owner can be noticed.
+    u64 overrun_count = 0; // Times the writer got a whole ring ahead of us.
+    u64 lost_count = 0; // Changes that were overwritten before we got to them.
+
+    // Maps the ring. Reading starts with the next change to be written, or the oldest one still in the ring if from_oldest is set.
+    bool Open(const char* name, bool from_oldest = false);
+    void Close();
+    // Gets the next change, copied out of the ring. False if there isn't one yet.
+    bool TryGetNextChange(DirectoryWatcher::FileChange* out_change);
+    // Gets the next change in place, without copying it. The path follows the record. Null if there isn't one yet.
+    // Whatever is read from it is only good if the EndRead() that follows returns true. Overruns aren't reported as a
+    // change here, watch overrun_count instead.
+    const SharedChangeRing::Record* BeginRead();
+    // Moves on from the change BeginRead() returned. False if it was overwritten while it was being read.
+    bool EndRead();
+    // Waits for a change to read, or for the ring to close, or for timeout_ms to pass. False on a timeout (or a spurious wakeup).
+    bool Wait(u32 timeout_ms);
+    bool IsClosed() const {return !header || header->is_closed;}
+
+private:
+
+    bool is_in_read = false;
+
+    bool HasChanges() const;
+    bool CheckPosition();
+};
@@ -0,0 +1,383 @@
+// NOTE: Winsock has to come before Windows.h, or Windows.h pulls in the old winsock.h and the two clash.
+#include <winsock2.h>
+#include <afunix.h>
+#include "WatchClient.h"
+#include <string.h>
+
+typedef WatchProtocol::EFrameType EFrameType;
+
+bool WatchProtocol::GetDefaultSocketPath(char* out, s32 out_capacity)
+{
+    static const char name[] = "DirectoryWatcher.sock";
+    s32 length = (s32)GetTempPathA((DWORD)out_capacity, out);
+    if (length <= 0 || length + (s32)sizeof(name) > out_capacity) return false;
+    CopyMemory(out + length, name, sizeof(name));
+    return true;
+}
+
+bool WatchClient::Connect(const char* socket_path, u32 timeout_ms)
+{
+    Disconnect();
+    char default_path[MAX_PATH];
+    if (!socket_path)
+    {
+        if (!WatchProtocol::GetDefaultSocketPath(default_path, MAX_PATH)) return false;
+        socket_path = default_path;
+    }
+    SOCKADDR_UN address = {};
+    address.sun_family = AF_UNIX;
+    size_t path_length = strlen(socket_path);
+    if (path_length >= sizeof(address.sun_path)) return false;
+    CopyMemory(address.sun_path, socket_path, path_length);
+
+    // Winsock counts its users, so every WSAStartup() here gets a WSACleanup() in Disconnect().
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data)) return false;
+    SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET || connect(s, (const sockaddr*)&address, sizeof(address)) == SOCKET_ERROR)
+    {
+        if (s != INVALID_SOCKET) closesocket(s);
+        WSACleanup();
+        return false;
+    }
+
+    // Non-blocking from here on, since TryGetNextChange() must never wait. Waiting is done with select().
+    u_long is_nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &is_nonblocking);
+    connection = (u64)s;
+
+    WatchProtocol::Hello hello = {WatchProtocol::Magic, WatchProtocol::Version};
+    if (!Send(EFrameType::Hello, &hello, sizeof(hello))) return false;
+
+    u64 deadline = GetTickCount64() + timeout_ms;
+    s32 needed = (s32)(sizeof(WatchProtocol::FrameHeader) + sizeof(hello));
+    while (buffer_size < needed)
+    {
+        u64 now = GetTickCount64();
+        if (now >= deadline || Receive((u32)(deadline - now)) < 0)
+        {
+            Disconnect();
+            return false;
+        }
+    }
+    WatchProtocol::FrameHeader header;
+    CopyMemory(&header, buffer, sizeof(header));
+    CopyMemory(&hello, buffer + sizeof(header), sizeof(hello));
+    if (header.type != (u32)EFrameType::Hello || header.size != sizeof(hello) || hello.magic != WatchProtocol::Magic || hello.version != WatchProtocol::Version)
+    {
+        Disconnect();
+        return false;
+    }
+    read_offset = needed;
+    return true;
+}
+
+void WatchClient::Disconnect()
+{
+    if (IsConnected())
+    {
+        closesocket((SOCKET)connection);
+        WSACleanup();
+    }
+    connection = ~0ull;
+    free(buffer);
+    buffer = 0;
+    buffer_size = 0;
+    buffer_capacity = 0;
+    read_offset = 0;
+    frame_start = 0;
+    frame_end = 0;
+    record_offset = 0;
+    for (s32 i = 0; i < MaxSubscriptions; ++i) subscriptions[i] = {};
+}
+
+u32 WatchClient::Subscribe(const char* root, bool is_recursive, const char* pattern, u32 action_mask, const DirectoryWatcher::Cursor* since,
+                           WatchProtocol::ESubscribeResult* out_result, u32 timeout_ms)
+{
+    assert(root);
+    WatchProtocol::ESubscribeResult unused;
+    if (!out_result) out_result = &unused;
+    *out_result = WatchProtocol::ESubscribeResult::Failed;
+    if (!IsConnected()) return 0;
+
+    SubscriptionState* state = FindSubscription(0);
+    if (!state) return 0;
+
+    // The daemon has a different current directory to us, so send it an absolute path. GetFullPathNameW() also turns
+    // forward slashes into backslashes, so everybody's spelling of a root comes out the same.
+    char16_t wide_root[MAX_PATH];
+    char16_t full_root[MAX_PATH];
+    if (MultiByteToWideChar(CP_UTF8, 0, root, -1, (LPWSTR)wide_root, MAX_PATH) <= 0) return 0;
+    s32 full_length = (s32)GetFullPathNameW((LPCWSTR)wide_root, MAX_PATH, (LPWSTR)full_root, 0);
+    if (full_length <= 0 || full_length >= MAX_PATH) return 0;
+    if (full_length > 3 && full_root[full_length - 1] == u'\\') full_root[--full_length] = u'\0'; // But keep "C:\".
+
+    u8 payload[sizeof(WatchProtocol::SubscribeRequest) + DIRECTORY_WATCHER_MAX_PATH_LENGTH * 2];
+    WatchProtocol::SubscribeRequest request = {};
+    u8* strings = payload + sizeof(request);
+    s32 root_length = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)full_root, full_length, (char*)strings, DIRECTORY_WATCHER_MAX_PATH_LENGTH, 0, 0);
+    s32 pattern_length = (pattern) ? (s32)strlen(pattern) : 0;
+    if (root_length <= 0 || pattern_length >= DIRECTORY_WATCHER_MAX_PATH_LENGTH) return 0;
+    if (pattern_length) CopyMemory(strings + root_length, pattern, pattern_length);
+
+    u32 id = next_id++;
+    if (!next_id) next_id = 1;
+    request.subscription_id = id;
+    request.action_mask = action_mask;
+    request.since_instance = (since) ? since->instance : 0;
+    request.since_sequence = (since) ? since->sequence : 0;
+    request.root_length = (u16)root_length;
+    request.pattern_length = (u16)pattern_length;
+    request.is_recursive = is_recursive;
+    CopyMemory(payload, &request, sizeof(request));
+    if (!Send(EFrameType::Subscribe, payload, (s32)sizeof(request) + root_length + pattern_length)) return 0;
+
+    // Changes for other subscriptions can arrive while we wait, they stay in the buffer for TryGetNextChange().
+    WatchProtocol::SubscribeReply reply = {};
+    u64 deadline = GetTickCount64() + timeout_ms;
+    while (!TakeReply(id, &reply))
+    {
+        u64 now = GetTickCount64();
+        if (now >= deadline || Receive((u32)(deadline - now)) < 0) return 0;
+    }
+
+    *out_result = (WatchProtocol::ESubscribeResult)reply.result;
+    if (*out_result == WatchProtocol::ESubscribeResult::Failed) return 0;
+    state->id = id;
+    state->cursor = {reply.instance, reply.sequence};
+    // The history since the cursor comes first, and reading it moves the cursor along from there.
+    if (*out_result == WatchProtocol::ESubscribeResult::Changes && since && since->instance == reply.instance) state->cursor = *since;
+    return id;
+}
+
+void WatchClient::Unsubscribe(u32 subscription_id)
+{
+    SubscriptionState* state = FindSubscription(subscription_id);
+    if (!state || !subscription_id) return;
+    *state = {};
+    // Changes already on their way for it are skipped by TryGetNextChange().
+    if (IsConnected()) Send(EFrameType::Unsubscribe, &subscription_id, sizeof(subscription_id));
+}
+
+bool WatchClient::TryGetNextChange(DirectoryWatcher::FileChange* out_change, u32* out_subscription_id)
+{
+    assert(out_change);
+    while (true)
+    {
+        if (record_offset < frame_end)
+        {
+            WatchProtocol::ChangeRecord record;
+            if (record_offset + (s32)sizeof(record) > frame_end)
+            {
+                record_offset = frame_end;
+                continue;
+            }
+            CopyMemory(&record, buffer + record_offset, sizeof(record));
+            const u8* path = buffer + record_offset + sizeof(record);
+            record_offset += WatchProtocol::GetRecordSize(record.path_length);
+            if (record_offset > frame_end) continue; // Cut off, the daemon wouldn't do that.
+
+            SubscriptionState* state = FindSubscription(frame_subscription_id);
+            if (!state || !frame_subscription_id) continue; // Unsubscribed while these were on their way.
+
+            s32 path_length = record.path_length;
+            if (path_length > DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1) path_length = DIRECTORY_WATCHER_MAX_PATH_LENGTH - 1;
+            CopyMemory(out_change->path, path, path_length);
+            out_change->path[path_length] = '\0';
+            out_change->path_length = path_length;
+            out_change->action = (DirectoryWatcher::EFileAction)record.action;
+            out_change->creation_time = record.creation_time;
+            out_change->modification_time = record.modification_time;
+            out_change->change_time = record.change_time;
+            out_change->access_time = record.access_time;
+            out_change->size = record.size;
+            out_change->attributes = record.attributes;
+            out_change->is_directory = record.is_directory;
+            out_change->sequence = record.sequence;
+            out_change->root_sequence = record.root_sequence;
+            out_change->directory_id = -1; // The daemon's own business.
+            if (record.sequence > state->cursor.sequence) state->cursor.sequence = record.sequence;
+            if (out_subscription_id) *out_subscription_id = frame_subscription_id;
+            return true;
+        }
+
+        if (NextFrame()) continue;
+        if (Receive(0) <= 0) return false;
+    }
+}
+
+bool WatchClient::Wait(u32 timeout_ms)
+{
+    if (record_offset < frame_end || NextFrame()) return true;
+    return Receive(timeout_ms) > 0;
+}
+
+DirectoryWatcher::Cursor WatchClient::GetCursor(u32 subscription_id) const
+{
+    for (s32 i = 0; i < MaxSubscriptions; ++i)
+    {
+        if (subscription_id && subscriptions[i].id == subscription_id) return subscriptions[i].cursor;
+    }
+    return {};
+}
+
+WatchClient::SubscriptionState* WatchClient::FindSubscription(u32 subscription_id)
+{
+    for (s32 i = 0; i < MaxSubscriptions; ++i)
+    {
+        if (subscriptions[i].id == subscription_id) return &subscriptions[i];
+    }
+    return 0;
+}
+
+bool WatchClient::Send(EFrameType type, const void* payload, s32 size)
+{
+    u8 frame[sizeof(WatchProtocol::FrameHeader) + sizeof(WatchProtocol::SubscribeRequest) + DIRECTORY_WATCHER_MAX_PATH_LENGTH * 2];
+    assert(size + sizeof(WatchProtocol::FrameHeader) <= sizeof(frame));
+    WatchProtocol::FrameHeader header = {(u32)size, (u32)type};
+    CopyMemory(frame, &header, sizeof(header));
+    CopyMemory(frame + sizeof(header), payload, size);
+
+    s32 total = (s32)sizeof(header) + size;
+    for (s32 sent = 0; sent < total;)
+    {
+        s32 result = send((SOCKET)connection, (const char*)frame + sent, total - sent, 0);
+        if (result > 0)
+        {
+            sent += result;
+            continue;
+        }
+        if (result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+        {
+            // The daemon isn't keeping up with our requests. Unlikely, they're tiny, but wait for room.
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET((SOCKET)connection, &writable);
+            select(0, 0, &writable, 0, 0);
+            continue;
+        }
+        Disconnect();
+        return false;
+    }
+    return true;
+}
+
+s32 WatchClient::Receive(u32 timeout_ms)
+{
+    if (!IsConnected()) return -1;
+
+    // Drop what has been read, keeping the Changes frame we're partway through.
+    s32 keep = (record_offset < frame_end) ? frame_start : read_offset;
+    if (keep > 0)
+    {
+        MoveMemory(buffer, buffer + keep, buffer_size - keep);
+        buffer_size -= keep;
+        read_offset -= keep;
+        frame_start -= keep;
+        frame_end -= keep;
+        record_offset -= keep;
+    }
+
+    // Room for at least a whole frame, so the one at the front can always be completed.
+    s32 needed = buffer_size + (s32)sizeof(WatchProtocol::FrameHeader) + WatchProtocol::MaxFrameSize;
+    if (needed > buffer_capacity)
+    {
+        u8* new_buffer = (u8*)malloc(needed);
+        assert(new_buffer);
+        if (buffer_size) CopyMemory(new_buffer, buffer, buffer_size);
+        free(buffer);
+        buffer = new_buffer;
+        buffer_capacity = needed;
+    }
+
+    if (timeout_ms)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET((SOCKET)connection, &readable);
+        timeval timeout = {(long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000};
+        s32 ready = select(0, &readable, 0, 0, (timeout_ms == INFINITE) ? 0 : &timeout);
+        if (ready == 0) return 0;
+        if (ready == SOCKET_ERROR)
+        {
+            Disconnect();
+            return -1;
+        }
+    }
+
+    s32 result = recv((SOCKET)connection, (char*)buffer + buffer_size, buffer_capacity - buffer_size, 0);
+    if (result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+    if (result <= 0)
+    {
+        // Zero means the daemon closed the connection.
+        Disconnect();
+        return -1;
+    }
+    buffer_size += result;
+    return result;
+}
+
+bool WatchClient::NextFrame()
+{
+    WatchProtocol::FrameHeader header;
+    while (read_offset + (s32)sizeof(header) <= buffer_size)
+    {
+        CopyMemory(&header, buffer + read_offset, sizeof(header));
+        if (header.size > (u32)WatchProtocol::MaxFrameSize)
+        {
+            Disconnect(); // Not something the daemon would send, we've lost our place.
+            return false;
+        }
+        s32 start = read_offset;
+        s32 end = start + (s32)sizeof(header) + (s32)header.size;
+        if (end > buffer_size) return false;
+        read_offset = end;
+
+        if (header.type == (u32)EFrameType::Changes && header.size >= sizeof(WatchProtocol::ChangesHeader))
+        {
+            WatchProtocol::ChangesHeader changes;
+            CopyMemory(&changes, buffer + start + sizeof(header), sizeof(changes));
+            frame_subscription_id = changes.subscription_id;
+            frame_start = start;
+            frame_end = end;
+            record_offset = start + (s32)(sizeof(header) + sizeof(changes));
+            return true;
+        }
+        if (header.type == (u32)EFrameType::Subscribed && header.size == sizeof(WatchProtocol::SubscribeReply))
+        {
+            // The answer to a Subscribe() that gave up waiting. The daemon went ahead anyway, so take it back.
+            WatchProtocol::SubscribeReply reply;
+            CopyMemory(&reply, buffer + start + sizeof(header), sizeof(reply));
+            if (reply.result != (u32)WatchProtocol::ESubscribeResult::Failed && !FindSubscription(reply.subscription_id))
+            {
+                Send(EFrameType::Unsubscribe, &reply.subscription_id, sizeof(reply.subscription_id));
+            }
+        }
+    }
+    return false;
+}
+
+bool WatchClient::TakeReply(u32 subscription_id, WatchProtocol::SubscribeReply* out_reply)
+{
+    // Look past the frames nobody has read yet, and cut the reply out from between them.
+    WatchProtocol::FrameHeader header;
+    for (s32 offset = read_offset; offset + (s32)sizeof(header) <= buffer_size;)
+    {
+        CopyMemory(&header, buffer + offset, sizeof(header));
+        s32 end = offset + (s32)sizeof(header) + (s32)header.size;
+        if (header.size > (u32)WatchProtocol::MaxFrameSize || end > buffer_size) return false;
+
+        if (header.type == (u32)EFrameType::Subscribed && header.size == sizeof(*out_reply))
+        {
+            CopyMemory(out_reply, buffer + offset + sizeof(header), sizeof(*out_reply));
+            if (out_reply->subscription_id == subscription_id)
+            {
+                MoveMemory(buffer + offset, buffer + end, buffer_size - end);
+                buffer_size -= end - offset;
+                return true;
+            }
+        }
+        offset = end;
+    }
+    return false;
+}
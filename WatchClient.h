@@ -0,0 +1,159 @@
+#pragma once
+
+/*
+WatchClient talks to the watch daemon (tools\WatchDaemon.cpp), a process that owns one DirectoryWatcher and
+serves any number of other processes over a Unix domain socket (AF_UNIX, in Windows 10 1803 and later). Ten
+tools watching the same repository then cost one set of watches, one set of change buffers and one pass of
+decoding, instead of ten. Link with Ws2_32.lib.
+
+A client connects, then subscribes to as many roots as it likes, each with an optional pattern and action
+mask (the same as DirectoryWatcher::SubscriptionFilter), and optionally a Cursor from an earlier session.
+The daemon shares watches between everybody: a root that is already covered by a recursive watch (whoever
+asked for it) doesn't get one of its own. Watches are never taken down again, since nothing is ever cheaper
+than a watch that already exists. If a root is covered by more than one watch, say "repo" was subscribed
+after "repo\src", both report each change; the daemon only sends the one that came from the outermost watch.
+
+With a cursor, the daemon first sends what the subscription missed since then out of its history, then
+carries on with live changes, without gaps or repeats. If its history doesn't go back far enough (or the
+cursor is from an earlier daemon), Subscribe() says FreshInstance and the client should rescan.
+
+Changes are sent in batches: a frame per subscription holding as many changes as were waiting, up to
+MaxFrameSize. TryGetNextChange() reads them one at a time, the same as DirectoryWatcher::TryGetNextChange(),
+and never blocks. Paths are full paths, starting with the root the way the daemon spells it (see Subscribe()).
+
+The protocol is little-endian binary. Every frame is a FrameHeader followed by size bytes of payload. The
+client starts with a Hello, and the daemon answers with one, so mismatched versions fail right away.
+*/
+
+#include "DirectoryWatcher.h"
+
+struct WatchProtocol
+{
+    static const u32 Magic = 0x31445744; // "DWD1"
+    static const u32 Version = 1;
+    static const s32 MaxFrameSize = 64 * 1024; // Payload bytes, not counting the header.
+    static const s32 MaxPatternStars = 8; // Runs of '*' in a subscription pattern. The daemon turns down patterns with more.
+
+    enum struct EFrameType : u32
+    {
+        Hello = 0, // Both ways, first thing. Payload is a Hello.
+        Subscribe, // To the daemon. A SubscribeRequest, followed by the root and the pattern (UTF-8, not null terminated).
+        Unsubscribe, // To the daemon. A u32 subscription id.
+        Subscribed, // From the daemon, the answer to a Subscribe. A SubscribeReply.
+        Changes, // From the daemon. A ChangesHeader, followed by count ChangeRecords.
+    };
+
+    enum struct ESubscribeResult : u32
+    {
+        Changes = 0, // Subscribed. Everything since the cursor (if there was one) follows.
+        FreshInstance, // Subscribed, but the changes since the cursor are gone. Rescan, then carry on from here.
+        Failed, // The root couldn't be watched, or the pattern wasn't acceptable.
+    };
+
+    struct FrameHeader
+    {
+        u32 size; // Payload bytes that follow.
+        u32 type; // EFrameType.
+    };
+
+    struct Hello
+    {
+        u32 magic;
+        u32 version;
+    };
+
+    struct SubscribeRequest
+    {
+        u32 subscription_id; // Chosen by the client, nonzero.
+        u32 action_mask; // As in DirectoryWatcher::SubscriptionFilter.
+        u64 since_instance; // Both zero to start from now.
+        u64 since_sequence;
+        u16 root_length;
+        u16 pattern_length; // Zero for no pattern.
+        u8 is_recursive;
+        u8 reserved[3];
+    };
+
+    struct SubscribeReply
+    {
+        u32 subscription_id;
+        u32 result; // ESubscribeResult.
+        u64 instance; // The daemon's watcher, for building cursors.
+        u64 sequence; // Where live changes pick up from. Anything after it comes as a change.
+    };
+
+    struct ChangesHeader
+    {
+        u32 subscription_id;
+        u32 count;
+    };
+
+    struct ChangeRecord
+    {
+        u64 sequence;
+        u64 root_sequence;
+        u64 creation_time;
+        u64 modification_time;
+        u64 change_time;
+        u64 access_time;
+        u64 size;
+        u32 attributes;
+        u16 path_length;
+        u8 action;
+        u8 is_directory;
+        // Followed by the path, padded to 8 bytes.
+    };
+
+    static s32 GetRecordSize(s32 path_length) {return (s32)((sizeof(ChangeRecord) + path_length + 7) & ~7);}
+    // Writes the socket path the daemon uses when it isn't given one, %TEMP%\DirectoryWatcher.sock.
+    static bool GetDefaultSocketPath(char* out, s32 out_capacity);
+};
+
+struct WatchClient
+{
+    static const s32 MaxSubscriptions = 64;
+
+    struct SubscriptionState
+    {
+        u32 id; // Zero if the slot is free.
+        DirectoryWatcher::Cursor cursor; // The last change read from it, for picking up in a later session.
+    };
+
+    u64 connection = ~0ull; // A SOCKET, INVALID_SOCKET when not connected.
+    SubscriptionState subscriptions[MaxSubscriptions] = {};
+    u32 next_id = 1;
+
+    // Connects to a daemon. Null means the default socket path. False if there's no daemon there, or it speaks another version.
+    bool Connect(const char* socket_path = 0, u32 timeout_ms = 5000);
+    // Disconnects, ending every subscription.
+    void Disconnect();
+    bool IsConnected() const {return connection != ~0ull;}
+    // Subscribes to changes under root, which is made absolute here. The pattern is matched against the full path of each change.
+    // Returns the subscription id, or 0 if it failed, in which case out_result says why (or the connection was lost).
+    u32 Subscribe(const char* root, bool is_recursive = true, const char* pattern = 0, u32 action_mask = ~0u, const DirectoryWatcher::Cursor* since = 0,
+                  WatchProtocol::ESubscribeResult* out_result = 0, u32 timeout_ms = 5000);
+    void Unsubscribe(u32 subscription_id);
+    // Gets the next change for any subscription, or nothing if there are no more right now. Never blocks.
+    bool TryGetNextChange(DirectoryWatcher::FileChange* out_change, u32* out_subscription_id = 0);
+    // Waits until there is something to read, or timeout_ms passes. False on a timeout, or if the connection was lost.
+    bool Wait(u32 timeout_ms);
+    // Cursor of the last change read from a subscription, to pass to Subscribe() after a restart.
+    DirectoryWatcher::Cursor GetCursor(u32 subscription_id) const;
+
+private:
+
+    u8* buffer = 0; // What has been received and not read yet.
+    s32 buffer_size = 0;
+    s32 buffer_capacity = 0;
+    s32 read_offset = 0; // Start of the first frame that hasn't been looked at.
+    s32 frame_start = 0; // The Changes frame being read, if record_offset < frame_end.
+    s32 frame_end = 0;
+    s32 record_offset = 0;
+    u32 frame_subscription_id = 0;
+
+    SubscriptionState* FindSubscription(u32 subscription_id);
+    bool Send(WatchProtocol::EFrameType type, const void* payload, s32 size);
+    s32 Receive(u32 timeout_ms);
+    bool NextFrame();
+    bool TakeReply(u32 subscription_id, WatchProtocol::SubscribeReply* out_reply);
+};
@@ -0,0 +1,491 @@
+/*
+ChurnGenerator is a load generator for DirectoryWatcher. It builds a directory tree, watches it, and then has
+a few threads create, modify, rename and delete files in it at a steady rate, while the main thread reads
+changes as fast as it can. Afterwards it matches every operation it did against the changes it got, and
+reports throughput, how often the watcher gave up with TooManyChanges, missed and duplicate events, and how
+long changes took to come through. Use it to size change_buffer_size and Settings::max_queue_count before
+pointing the watcher at something real.
+
+Build it along with the library, for example:
+    cl /O2 /std:c++17 /I. tools\ChurnGenerator.cpp DirectoryWatcher.cpp DirectorySnapshot.cpp DirectoryCrawler.cpp ChangeJournal.cpp NotificationRecording.cpp SharedChangeRing.cpp ChangeOracle.cpp Synchronization.lib
+
+Usage:
+    ChurnGenerator <empty directory> [options]
+        --threads N         Threads making changes (default 4).
+        --rate N            Operations per second, per thread. 0 means as fast as possible (default 1000).
+        --duration N        Seconds to make changes for (default 10).
+        --depth N           Levels of directories below the root (default 3).
+        --fanout N          Subdirectories per directory (default 4).
+        --files N           Files each thread tries to keep around (default 200).
+        --buffer-size N     change_buffer_size passed to AddDirectory() (default 32768).
+        --queue-count N     Settings::max_queue_count (default 0, unbounded).
+        --settle N          Milliseconds without a change before the run counts as finished (default 2000).
+        --verify N          1 to also check the changes against the tree on disk with ChangeOracle (default 0).
+
+Every operation uses a fresh file name, so each Added, Removed, RenamedFrom and RenamedTo change should come
+through exactly once. A write can produce more than one Modified change, so those extra ones are reported
+separately rather than as duplicates. With --verify the changes are also applied to a ChangeOracle, which
+compares the result with a scan of the tree once everything has settled. Changes for paths we never touched (mostly directories being modified
+because a file in them changed) are counted as "other". Events are matched on a 64-bit hash of the action
+and path, which is plenty for a test tool.
+*/
+
+#include "../DirectoryWatcher.h"
+#include "../ChangeOracle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef DirectoryWatcher::EFileAction EFileAction;
+
+enum struct EOperation
+{
+    Create = 0,
+    Modify,
+    Rename,
+    Delete,
+    Count
+};
+
+static const char* OperationNames[] = {"create", "modify", "rename", "delete"};
+static const char* ActionNames[] = {"none", "added", "removed", "modified", "renamed from", "renamed to", "too many changes"};
+
+struct Options
+{
+    const char* root = 0;
+    s32 thread_count = 4;
+    s32 rate = 1000;
+    s32 duration_s = 10;
+    s32 depth = 3;
+    s32 fanout = 4;
+    s32 files_per_thread = 200;
+    s32 buffer_size = 32768;
+    s32 queue_count = 0;
+    s32 settle_ms = 2000;
+    bool should_verify = false;
+};
+
+// Something that happened, either an operation we expect to see (op) or a change we got (event).
+struct Record
+{
+    u64 hash; // Of the action and the full path.
+    s64 time; // QueryPerformanceCounter() ticks.
+    EFileAction action;
+};
+
+struct RecordArray
+{
+    Record* data = 0;
+    s32 count = 0;
+    s32 capacity = 0;
+
+    void Push(const Record& record)
+    {
+        if (count == capacity)
+        {
+            capacity = (capacity) ? capacity * 2 : 4096;
+            data = (Record*)realloc(data, sizeof(Record) * capacity);
+            assert(data);
+        }
+        data[count++] = record;
+    }
+};
+
+struct Worker
+{
+    const Options* options;
+    const char* const* directories; // Relative paths, "" being the root.
+    s32 directory_count;
+    s32 index;
+    HANDLE thread;
+    u64 random_state;
+
+    char** files; // Full paths of the files this thread currently has.
+    s32 file_count;
+    s32 next_name;
+
+    RecordArray expected;
+    u64 operation_counts[(s32)EOperation::Count];
+    u64 failure_count;
+};
+
+static volatile s32 finished_worker_count = 0;
+static s64 counter_frequency = 0;
+
+static s64 Now()
+{
+    LARGE_INTEGER counter = {};
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+static u64 HashChange(EFileAction action, const char* path, s32 path_length)
+{
+    u64 hash = 14695981039346656037ull;
+    hash = (hash ^ (u8)action) * 1099511628211ull;
+    for (s32 i = 0; i < path_length; ++i) hash = (hash ^ (u8)path[i]) * 1099511628211ull;
+    return hash;
+}
+
+static u64 NextRandom(u64* state)
+{
+    // xorshift64*, plenty for picking files.
+    u64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+static bool ToWide(const char* path, char16_t* out)
+{
+    return MultiByteToWideChar(CP_UTF8, 0, path, -1, (LPWSTR)out, MAX_PATH) > 0;
+}
+
+static void Expect(Worker* worker, EFileAction action, const char* path, s64 time)
+{
+    worker->expected.Push({HashChange(action, path, (s32)strlen(path)), time, action});
+}
+
+static void MakePath(Worker* worker, char* out)
+{
+    const char* directory = worker->directories[NextRandom(&worker->random_state) % worker->directory_count];
+    snprintf(out, MAX_PATH, "%s%s%s\\t%d_%d.dat", worker->options->root, (*directory) ? "\\" : "", directory, worker->index, worker->next_name++);
+}
+
+static bool WriteSomething(const char16_t* path, u32 disposition, u32 access)
+{
+    HANDLE file = CreateFileW((LPCWSTR)path, access, FILE_SHARE_READ, 0, disposition, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    char data[64];
+    DWORD written = 0;
+    memset(data, 'x', sizeof(data));
+    bool result = WriteFile(file, data, sizeof(data), &written, 0) != 0;
+    CloseHandle(file);
+    return result;
+}
+
+static void DoOperation(Worker* worker)
+{
+    // Keep roughly files_per_thread files around: mostly create below that, and mostly don't above it.
+    u64 roll = NextRandom(&worker->random_state) % 100;
+    EOperation operation;
+    if (!worker->file_count || (worker->file_count < worker->options->files_per_thread / 2 && roll < 70)) operation = EOperation::Create;
+    else if (roll < 35) operation = (worker->file_count < worker->options->files_per_thread) ? EOperation::Create : EOperation::Delete;
+    else if (roll < 65) operation = EOperation::Modify;
+    else if (roll < 85) operation = EOperation::Rename;
+    else operation = EOperation::Delete;
+
+    char16_t wide_path[MAX_PATH];
+    s32 file_index = (worker->file_count) ? (s32)(NextRandom(&worker->random_state) % worker->file_count) : -1;
+    bool did_succeed = false;
+    s64 time = Now();
+    switch (operation)
+    {
+        case EOperation::Create:
+        {
+            char* path = (char*)malloc(MAX_PATH);
+            MakePath(worker, path);
+            did_succeed = ToWide(path, wide_path) && WriteSomething(wide_path, CREATE_NEW, GENERIC_WRITE);
+            if (did_succeed)
+            {
+                Expect(worker, EFileAction::Added, path, time);
+                worker->files = (char**)realloc(worker->files, sizeof(char*) * (worker->file_count + 1));
+                worker->files[worker->file_count++] = path;
+            }
+            else free(path);
+        } break;
+        case EOperation::Modify:
+        {
+            const char* path = worker->files[file_index];
+            did_succeed = ToWide(path, wide_path) && WriteSomething(wide_path, OPEN_EXISTING, FILE_APPEND_DATA);
+            if (did_succeed) Expect(worker, EFileAction::Modified, path, time);
+        } break;
+        case EOperation::Rename:
+        {
+            char* new_path = (char*)malloc(MAX_PATH);
+            char16_t new_wide_path[MAX_PATH];
+            MakePath(worker, new_path);
+            did_succeed = ToWide(worker->files[file_index], wide_path) && ToWide(new_path, new_wide_path) && MoveFileExW((LPCWSTR)wide_path, (LPCWSTR)new_wide_path, 0);
+            if (did_succeed)
+            {
+                // A move to another directory is a removal and an addition, not a rename.
+                const char* old_path = worker->files[file_index];
+                bool is_same_directory = strrchr(old_path, '\\') - old_path == strrchr(new_path, '\\') - new_path &&
+                                         !strncmp(old_path, new_path, strrchr(old_path, '\\') - old_path);
+                Expect(worker, (is_same_directory) ? EFileAction::RenamedFrom : EFileAction::Removed, old_path, time);
+                Expect(worker, (is_same_directory) ? EFileAction::RenamedTo : EFileAction::Added, new_path, time);
+                free(worker->files[file_index]);
+                worker->files[file_index] = new_path;
+            }
+            else free(new_path);
+        } break;
+        case EOperation::Delete:
+        {
+            did_succeed = ToWide(worker->files[file_index], wide_path) && DeleteFileW((LPCWSTR)wide_path);
+            if (did_succeed)
+            {
+                Expect(worker, EFileAction::Removed, worker->files[file_index], time);
+                free(worker->files[file_index]);
+                worker->files[file_index] = worker->files[--worker->file_count];
+            }
+        } break;
+        default: break;
+    }
+    if (did_succeed) worker->operation_counts[(s32)operation] += 1;
+    else worker->failure_count += 1;
+}
+
+static DWORD __stdcall WorkerProc(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    s64 start = Now();
+    s64 end = start + (s64)worker->options->duration_s * counter_frequency;
+    for (u64 operation_index = 0;; ++operation_index)
+    {
+        // Pace to the requested rate: operation N is due N / rate seconds after the start.
+        s64 due = (worker->options->rate > 0) ? start + (s64)(operation_index * counter_frequency / worker->options->rate) : 0;
+        s64 now = Now();
+        while (now < due)
+        {
+            s64 remaining_ms = (due - now) * 1000 / counter_frequency;
+            if (remaining_ms > 1) Sleep((DWORD)(remaining_ms - 1));
+            else YieldProcessor();
+            now = Now();
+        }
+        if (now >= end) break;
+        DoOperation(worker);
+    }
+    InterlockedIncrement((LPLONG)&finished_worker_count);
+    return 0;
+}
+
+// Directories are created before the watch starts, so none of them show up as changes.
+static s32 CreateTree(const char* root, const char* relative, s32 depth, s32 fanout, char** out_directories, s32 directory_count)
+{
+    out_directories[directory_count++] = _strdup(relative);
+    if (depth <= 0) return directory_count;
+    for (s32 i = 0; i < fanout; ++i)
+    {
+        char child[MAX_PATH];
+        char full_path[MAX_PATH];
+        char16_t wide_path[MAX_PATH];
+        snprintf(child, sizeof(child), "%s%sd%d", relative, (*relative) ? "\\" : "", i);
+        snprintf(full_path, sizeof(full_path), "%s\\%s", root, child);
+        if (ToWide(full_path, wide_path)) CreateDirectoryW((LPCWSTR)wide_path, 0);
+        directory_count = CreateTree(root, child, depth - 1, fanout, out_directories, directory_count);
+    }
+    return directory_count;
+}
+
+static int CompareRecords(const void* a, const void* b)
+{
+    const Record* left = (const Record*)a;
+    const Record* right = (const Record*)b;
+    if (left->hash != right->hash) return (left->hash < right->hash) ? -1 : 1;
+    if (left->time != right->time) return (left->time < right->time) ? -1 : 1;
+    return 0;
+}
+
+static int CompareLatencies(const void* a, const void* b)
+{
+    s64 left = *(const s64*)a;
+    s64 right = *(const s64*)b;
+    return (left < right) ? -1 : ((left > right) ? 1 : 0);
+}
+
+static void WakeProc(void* context) {SetEvent((HANDLE)context);}
+
+static bool ParseOptions(int argc, char** argv, Options* options)
+{
+    if (argc < 2) return false;
+    options->root = argv[1];
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        s32 value = atoi(argv[i + 1]);
+        if (!strcmp(argv[i], "--threads")) options->thread_count = value;
+        else if (!strcmp(argv[i], "--rate")) options->rate = value;
+        else if (!strcmp(argv[i], "--duration")) options->duration_s = value;
+        else if (!strcmp(argv[i], "--depth")) options->depth = value;
+        else if (!strcmp(argv[i], "--fanout")) options->fanout = value;
+        else if (!strcmp(argv[i], "--files")) options->files_per_thread = value;
+        else if (!strcmp(argv[i], "--buffer-size")) options->buffer_size = value;
+        else if (!strcmp(argv[i], "--queue-count")) options->queue_count = value;
+        else if (!strcmp(argv[i], "--settle")) options->settle_ms = value;
+        else if (!strcmp(argv[i], "--verify")) options->should_verify = value != 0;
+        else return false;
+    }
+    return options->thread_count > 0 && options->depth >= 0 && options->fanout > 0 && options->buffer_size > 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, &options))
+    {
+        printf("usage: ChurnGenerator <empty directory> [--threads N] [--rate N] [--duration N] [--depth N] [--fanout N]\n"
+               "                      [--files N] [--buffer-size N] [--queue-count N] [--settle N] [--verify N]\n");
+        return 1;
+    }
+    LARGE_INTEGER frequency = {};
+    QueryPerformanceFrequency(&frequency);
+    counter_frequency = frequency.QuadPart;
+
+    char16_t wide_root[MAX_PATH];
+    if (!ToWide(options.root, wide_root)) return 1;
+    CreateDirectoryW((LPCWSTR)wide_root, 0);
+
+    s32 max_directories = 1;
+    for (s32 level = 0, level_count = 1; level < options.depth; ++level) max_directories += (level_count *= options.fanout);
+    char** directories = (char**)malloc(sizeof(char*) * max_directories);
+    s32 directory_count = CreateTree(options.root, "", options.depth, options.fanout, directories, 0);
+    printf("%d directories, %d threads at %d operations per second each, for %d seconds\n", directory_count, options.thread_count, options.rate, options.duration_s);
+
+    DirectoryWatcher::Settings settings;
+    settings.max_queue_count = options.queue_count;
+    DirectoryWatcher watcher = {};
+    watcher.Initialize(settings);
+    if (!watcher.AddDirectory(options.root, true, options.buffer_size))
+    {
+        printf("couldn't watch %s\n", options.root);
+        return 1;
+    }
+    Sleep(100); // Give the watch a moment to start, so the first operations aren't missed.
+
+    ChangeOracle oracle;
+    if (options.should_verify && !oracle.Open(options.root, true))
+    {
+        printf("couldn't scan %s\n", options.root);
+        return 1;
+    }
+
+    Worker* workers = (Worker*)calloc(options.thread_count, sizeof(Worker));
+    for (s32 i = 0; i < options.thread_count; ++i)
+    {
+        workers[i].options = &options;
+        workers[i].directories = directories;
+        workers[i].directory_count = directory_count;
+        workers[i].index = i;
+        workers[i].random_state = 0x9E3779B97F4A7C15ull * (i + 1);
+        workers[i].thread = CreateThread(0, 0, WorkerProc, &workers[i], 0, 0);
+    }
+
+    // Read changes until the workers are done and nothing has come in for a while.
+    RecordArray events;
+    u64 too_many_changes_count = 0;
+    HANDLE wake_event = CreateEventW(0, false, false, 0);
+    s64 start = Now();
+    s64 last_event = start;
+    for (;;)
+    {
+        DirectoryWatcher::FileChange change;
+        while (watcher.TryGetNextChange(&change))
+        {
+            s64 now = Now();
+            last_event = now;
+            if (change.action == EFileAction::TooManyChanges) too_many_changes_count += 1;
+            events.Push({HashChange(change.action, change.path, change.path_length), now, change.action});
+            if (options.should_verify) oracle.Apply(change);
+        }
+        if (finished_worker_count == options.thread_count && (Now() - last_event) * 1000 / counter_frequency >= options.settle_ms) break;
+
+        // Sleep until the next change, using the same wakeup a coroutine would.
+        if (watcher.ArmWakeup(0, WakeProc, wake_event)) WaitForSingleObject(wake_event, 50);
+    }
+    s64 end = Now();
+    DirectoryWatcher::Stats stats = watcher.GetStats();
+    watcher.ShutDown();
+    for (s32 i = 0; i < options.thread_count; ++i)
+    {
+        WaitForSingleObject(workers[i].thread, INFINITE);
+        CloseHandle(workers[i].thread);
+    }
+
+    // Match every expected change against the changes we got, by hash, in time order.
+    RecordArray expected;
+    u64 operation_counts[(s32)EOperation::Count] = {};
+    u64 failure_count = 0;
+    for (s32 i = 0; i < options.thread_count; ++i)
+    {
+        for (s32 j = 0; j < workers[i].expected.count; ++j) expected.Push(workers[i].expected.data[j]);
+        for (s32 j = 0; j < (s32)EOperation::Count; ++j) operation_counts[j] += workers[i].operation_counts[j];
+        failure_count += workers[i].failure_count;
+    }
+    if (expected.count) qsort(expected.data, expected.count, sizeof(Record), CompareRecords);
+    if (events.count) qsort(events.data, events.count, sizeof(Record), CompareRecords);
+
+    u64 missed[7] = {};
+    u64 duplicates[7] = {};
+    u64 other_count = 0;
+    s64* latencies = (s64*)malloc(sizeof(s64) * (expected.count + 1));
+    s32 latency_count = 0;
+    s32 e = 0;
+    s32 x = 0;
+    while (e < events.count || x < expected.count)
+    {
+        u64 hash = (x < expected.count && (e >= events.count || expected.data[x].hash <= events.data[e].hash)) ? expected.data[x].hash : events.data[e].hash;
+        s32 expected_end = x;
+        s32 events_end = e;
+        while (expected_end < expected.count && expected.data[expected_end].hash == hash) expected_end += 1;
+        while (events_end < events.count && events.data[events_end].hash == hash) events_end += 1;
+
+        if (expected_end == x) other_count += events_end - e;
+        else
+        {
+            EFileAction action = expected.data[x].action;
+            s32 matched = (expected_end - x < events_end - e) ? expected_end - x : events_end - e;
+            for (s32 i = 0; i < matched; ++i)
+            {
+                s64 latency = events.data[e + i].time - expected.data[x + i].time;
+                latencies[latency_count++] = (latency > 0) ? latency : 0;
+            }
+            missed[(s32)action] += (expected_end - x) - matched;
+            duplicates[(s32)action] += (events_end - e) - matched;
+        }
+        x = expected_end;
+        e = events_end;
+    }
+
+    double seconds = (double)(end - start) / counter_frequency;
+    u64 total_operations = 0;
+    for (s32 i = 0; i < (s32)EOperation::Count; ++i) total_operations += operation_counts[i];
+    printf("\noperations: %llu in %.1fs (%.0f per second), %llu failed\n", (unsigned long long)total_operations, (double)options.duration_s,
+           (double)total_operations / options.duration_s, (unsigned long long)failure_count);
+    for (s32 i = 0; i < (s32)EOperation::Count; ++i) printf("    %-8s %llu\n", OperationNames[i], (unsigned long long)operation_counts[i]);
+    printf("changes: %d in %.1fs (%.0f per second)\n", events.count, seconds, events.count / seconds);
+    printf("too many changes: %llu (%.2f per second)\n", (unsigned long long)too_many_changes_count, too_many_changes_count / seconds);
+    printf("dropped by the queue: %llu\n", (unsigned long long)stats.dropped_change_count);
+    printf("other changes (directories, and paths we didn't touch): %llu\n", (unsigned long long)other_count);
+    printf("%-18s %10s %10s\n", "", "missed", "duplicate");
+    for (s32 i = (s32)EFileAction::Added; i <= (s32)EFileAction::RenamedTo; ++i)
+    {
+        const char* label = (i == (s32)EFileAction::Modified) ? "extra" : "";
+        printf("    %-14s %10llu %10llu %s\n", ActionNames[i], (unsigned long long)missed[i], (unsigned long long)duplicates[i], label);
+    }
+    if (too_many_changes_count) printf("(missed changes are expected after a TooManyChanges, that's what it means)\n");
+
+    if (latency_count)
+    {
+        qsort(latencies, latency_count, sizeof(s64), CompareLatencies);
+        const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 100.0};
+        printf("latency (microseconds):");
+        for (double percentile : percentiles)
+        {
+            s32 index = (s32)(percentile / 100.0 * (latency_count - 1) + 0.5);
+            printf(" p%g=%.0f", percentile, (double)latencies[index] * 1000000.0 / counter_frequency);
+        }
+        printf("\n");
+    }
+
+    ChangeOracle::Counts counts = {};
+    if (options.should_verify && oracle.Verify(&counts))
+    {
+        const char* divergence_names[] = {"missed add", "missed remove", "wrong rename target", "phantom remove", "phantom modify", "duplicate add", "unpaired rename"};
+        printf("oracle (%llu changes applied):", (unsigned long long)counts.applied_count);
+        for (s32 i = 0; i < (s32)ChangeOracle::EDivergence::Count; ++i) printf(" %s=%llu", divergence_names[i], (unsigned long long)counts.divergences[i]);
+        printf(", explained by overflow=%llu\n", (unsigned long long)counts.explained_by_overflow);
+    }
+    oracle.Close();
+    return 0;
+}
@@ -0,0 +1,300 @@
+/*
+QueueBench measures how much a watcher thread pushing changes and the thread taking them get in each other's
+way through the cache, when nothing they write is actually shared. Each of the two threads takes its own spin
+lock and updates its own state, the way a watcher thread pushes into one queue lane while the consumer pops
+from the one next to it, and the watcher's producer and consumer fields sit next to each other.
+
+It runs the same loop twice. Once with the state packed the way DirectoryWatcher used to lay it out, so both
+threads write to the same cache line, and once split by DIRECTORY_WATCHER_CACHE_LINE_SIZE the way it does now.
+The packed run keeps pulling the line back and forth between the two cores (false sharing), the split run
+doesn't. The difference is what the cache line layout in DirectoryWatcher.h saves on every push and pop.
+
+Then it measures what happens when the two threads really do share a lock, and the one holding it gets
+descheduled. The consumer takes the lock over and over, and every so often sleeps while holding it, the way it
+would if the scheduler took its processor away in the middle of a pop. The producer keeps taking the same lock.
+It runs once with the plain spin lock the queue used to have, and once with DirectoryWatcher::QueueLock. The
+spin lock keeps the producer's processor busy for the whole of every stall, and QueueLock puts it to sleep, so
+compare the processor time the two threads used, and how often QueueLock spun and parked.
+
+Build it along with the library (it only uses the allocator, but that pulls in the rest), for example:
+    cl /O2 /std:c++17 /I. tools\QueueBench.cpp DirectoryWatcher.cpp DirectorySnapshot.cpp DirectoryCrawler.cpp ChangeJournal.cpp NotificationRecording.cpp SharedChangeRing.cpp Synchronization.lib
+
+Usage:
+    QueueBench [options]
+        --iterations N      Lock, update and unlock cycles per thread, per run (default 10000000).
+        --runs N            Times to run each layout. The fastest run counts (default 5).
+        --stalls N          Times the consumer sleeps holding the lock, per contention run (default 100).
+        --stall-every N     Lock cycles between stalls (default 10000).
+        --stall-ms N        Milliseconds each stall lasts (default 2).
+
+Run it on a machine that's otherwise idle, with at least two cores. Times are per cycle, per thread.
+*/
+
+#include "../DirectoryWatcher.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Options
+{
+    s32 iteration_count = 10000000;
+    s32 run_count = 5;
+    s32 stall_count = 100;
+    s32 stall_every = 10000;
+    s32 stall_ms = 2;
+};
+
+// What the consumer writes for every change it takes (a lane's lock and the lane credits) right next to what a
+// watcher thread writes for every change it pushes (the next lane's lock and the sequence).
+struct PackedState
+{
+    s32 consumer_lock;
+    s32 lane_credits[3];
+    s32 producer_lock;
+    u64 sequence;
+};
+
+// The same, with each thread's state on a line of its own.
+struct SplitState
+{
+    alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) s32 consumer_lock;
+    s32 lane_credits[3];
+    alignas(DIRECTORY_WATCHER_CACHE_LINE_SIZE) s32 producer_lock;
+    u64 sequence;
+};
+
+template <typename T>
+struct Run
+{
+    T* state;
+    s32 iteration_count;
+    volatile s32 ready_count;
+    volatile s32 is_started;
+    s64 elapsed[2]; // Counter ticks, per thread.
+};
+
+static inline void Lock(s32* lock) {while (InterlockedExchange((LPLONG)lock, 1) == 1) {/*spin!*/};}
+static inline void Unlock(s32* lock) {InterlockedExchange((LPLONG)lock, 0);}
+
+// The lock ThreadSafeQueue had before QueueLock, for comparison. It counts its spins the same way, and never parks.
+struct SpinLock
+{
+    s32 state = 0;
+    u64 spin_count = 0;
+    u64 park_count = 0;
+
+    void Lock()
+    {
+        if (InterlockedExchange((LPLONG)&state, 1) == 0) return;
+        ::Lock(&state);
+        spin_count += 1;
+    }
+    void Unlock() {::Unlock(&state);}
+};
+
+template <typename T>
+struct ContentionRun
+{
+    T lock;
+    const Options* options;
+    u64 count; // Guarded by the lock, so it comes out right if the lock works.
+    volatile s32 ready_count;
+    volatile s32 is_started;
+};
+
+static s64 GetCounter()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+template <typename R>
+static void WaitForStart(R* run)
+{
+    // Both threads start together, so they really are running at the same time.
+    InterlockedIncrement((LPLONG)&run->ready_count);
+    while (!run->is_started) YieldProcessor();
+}
+
+template <typename T>
+static u32 __stdcall ProducerProc(void* arg)
+{
+    Run<T>* run = (Run<T>*)arg;
+    T* state = run->state;
+    WaitForStart(run);
+    s64 start = GetCounter();
+    for (s32 i = 0; i < run->iteration_count; ++i)
+    {
+        Lock(&state->producer_lock);
+        state->sequence += 1;
+        Unlock(&state->producer_lock);
+    }
+    run->elapsed[0] = GetCounter() - start;
+    return 0;
+}
+
+template <typename T>
+static u32 __stdcall ConsumerProc(void* arg)
+{
+    Run<T>* run = (Run<T>*)arg;
+    T* state = run->state;
+    WaitForStart(run);
+    s64 start = GetCounter();
+    for (s32 i = 0; i < run->iteration_count; ++i)
+    {
+        Lock(&state->consumer_lock);
+        state->lane_credits[i % 3] -= 1;
+        Unlock(&state->consumer_lock);
+    }
+    run->elapsed[1] = GetCounter() - start;
+    return 0;
+}
+
+// Runs both threads over the layout run_count times, and returns the fastest nanoseconds per cycle.
+template <typename T>
+static double Measure(const Options& options, s64 frequency)
+{
+    double best = 0.0;
+    for (s32 r = 0; r < options.run_count; ++r)
+    {
+        // Allocated rather than on the stack, so nothing else we write lands on the same lines.
+        DirectoryWatcher::Allocator allocator;
+        T* state = (T*)allocator.AllocateAligned(sizeof(T), DirectoryWatcher::EMemoryTag::Queue);
+        memset(state, 0, sizeof(T));
+        Run<T> run = {state, options.iteration_count, 0, 0, {}};
+
+        void* threads[2];
+        threads[0] = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ProducerProc<T>, &run, 0, 0);
+        threads[1] = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ConsumerProc<T>, &run, 0, 0);
+        while (run.ready_count < 2) Sleep(0);
+        InterlockedExchange((LPLONG)&run.is_started, 1);
+        for (s32 i = 0; i < 2; ++i)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+
+        s64 elapsed = (run.elapsed[0] > run.elapsed[1]) ? run.elapsed[0] : run.elapsed[1];
+        double ns = (double)elapsed * 1e9 / (double)frequency / (double)options.iteration_count;
+        if (r == 0 || ns < best) best = ns;
+        allocator.FreeAligned(state, DirectoryWatcher::EMemoryTag::Queue);
+    }
+    return best;
+}
+
+template <typename T>
+static u32 __stdcall ContendedProducerProc(void* arg)
+{
+    ContentionRun<T>* run = (ContentionRun<T>*)arg;
+    WaitForStart(run);
+    s32 cycle_count = run->options->stall_count * run->options->stall_every;
+    for (s32 i = 0; i < cycle_count; ++i)
+    {
+        run->lock.Lock();
+        run->count += 1;
+        run->lock.Unlock();
+    }
+    return 0;
+}
+
+template <typename T>
+static u32 __stdcall ContendedConsumerProc(void* arg)
+{
+    ContentionRun<T>* run = (ContentionRun<T>*)arg;
+    WaitForStart(run);
+    s32 cycle_count = run->options->stall_count * run->options->stall_every;
+    for (s32 i = 0; i < cycle_count; ++i)
+    {
+        run->lock.Lock();
+        run->count += 1;
+        if (i % run->options->stall_every == 0) Sleep(run->options->stall_ms); // Descheduled while holding the lock.
+        run->lock.Unlock();
+    }
+    return 0;
+}
+
+static u64 GetThreadCpuTime(void* thread)
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(thread, &creation, &exit, &kernel, &user)) return 0;
+    u64 kernel_time = ((u64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    u64 user_time = ((u64)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return kernel_time + user_time; // In 100 ns units.
+}
+
+// Runs the producer and the stalling consumer against one lock, and prints the times and counts.
+template <typename T>
+static void MeasureContention(const char* name, const Options& options, s64 frequency)
+{
+    DirectoryWatcher::Allocator allocator;
+    ContentionRun<T>* run = (ContentionRun<T>*)allocator.AllocateAligned(sizeof(ContentionRun<T>), DirectoryWatcher::EMemoryTag::Queue);
+    *run = {};
+    run->options = &options;
+
+    void* threads[2];
+    threads[0] = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ContendedProducerProc<T>, run, 0, 0);
+    threads[1] = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ContendedConsumerProc<T>, run, 0, 0);
+    while (run->ready_count < 2) Sleep(0);
+    s64 start = GetCounter();
+    InterlockedExchange((LPLONG)&run->is_started, 1);
+    u64 cpu_time[2] = {};
+    for (s32 i = 0; i < 2; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        cpu_time[i] = GetThreadCpuTime(threads[i]);
+        CloseHandle(threads[i]);
+    }
+    double wall_ms = (double)(GetCounter() - start) * 1e3 / (double)frequency;
+
+    bool is_correct = run->count == 2 * (u64)options.stall_count * (u64)options.stall_every;
+    printf("  %-10s %8.1f ms wall, producer %8.1f ms cpu, consumer %8.1f ms cpu, %llu spins, %llu parks%s\n", name, wall_ms,
+           cpu_time[0] / 1e4, cpu_time[1] / 1e4, (unsigned long long)run->lock.spin_count, (unsigned long long)run->lock.park_count,
+           is_correct ? "" : " (COUNT IS WRONG)");
+    allocator.FreeAligned(run, DirectoryWatcher::EMemoryTag::Queue);
+}
+
+static bool ParseOptions(int argc, char** argv, Options* options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 >= argc) return false;
+        const char* name = argv[i];
+        s32 value = atoi(argv[++i]);
+        if (value <= 0) return false;
+        if (!strcmp(name, "--iterations")) options->iteration_count = value;
+        else if (!strcmp(name, "--runs")) options->run_count = value;
+        else if (!strcmp(name, "--stalls")) options->stall_count = value;
+        else if (!strcmp(name, "--stall-every")) options->stall_every = value;
+        else if (!strcmp(name, "--stall-ms")) options->stall_ms = value;
+        else return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, &options))
+    {
+        printf("usage: QueueBench [--iterations N] [--runs N] [--stalls N] [--stall-every N] [--stall-ms N]\n");
+        return 1;
+    }
+    LARGE_INTEGER frequency = {};
+    QueryPerformanceFrequency(&frequency);
+    SYSTEM_INFO system_info = {};
+    GetSystemInfo(&system_info);
+    if (system_info.dwNumberOfProcessors < 2) printf("only one processor, so the threads take turns and both layouts should come out the same\n");
+
+    printf("%d cycles per thread, best of %d runs\n", options.iteration_count, options.run_count);
+    double packed = Measure<PackedState>(options, frequency.QuadPart);
+    printf("  packed (%3d bytes):  %6.1f ns per cycle\n", (s32)sizeof(PackedState), packed);
+    double split = Measure<SplitState>(options, frequency.QuadPart);
+    printf("  split  (%3d bytes):  %6.1f ns per cycle\n", (s32)sizeof(SplitState), split);
+    printf("  split is %.1fx as fast\n", (split > 0.0) ? packed / split : 0.0);
+
+    printf("%d stalls of %d ms, one every %d cycles, with the lock held\n", options.stall_count, options.stall_ms, options.stall_every);
+    MeasureContention<SpinLock>("spin", options, frequency.QuadPart);
+    MeasureContention<DirectoryWatcher::QueueLock>("spin+park", options, frequency.QuadPart);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+SnapshotCheck makes sure a rescan that can't list part of the tree doesn't make up changes for it. It builds a
+small tree, snapshots it, takes away the right to list a directory in the middle of it (the way an access
+denied or a flaky share would), and rescans with the first snapshot as the previous one. Everything the
+rescan couldn't see has to be carried over from the previous snapshot, including the directories below the
+one that failed, so diffing the two snapshots should report nothing. Then it gives the right back, rescans
+again, and expects nothing again.
+
+Build it along with the library, for example:
+    cl /O2 /std:c++17 /I. tools\SnapshotCheck.cpp DirectoryWatcher.cpp DirectorySnapshot.cpp DirectoryCrawler.cpp ChangeJournal.cpp NotificationRecording.cpp SharedChangeRing.cpp Advapi32.lib Synchronization.lib
+
+Usage:
+    SnapshotCheck <empty directory>
+
+Prints every change a diff reported, and exits with 0 if there were none.
+*/
+
+#include "../DirectorySnapshot.h"
+#include <sddl.h>
+#include <stdio.h>
+
+static const char16_t* Directories[] = {u"a", u"a\\b", u"a\\b\\c", u"a\\b\\c\\d"};
+static const char16_t* Files[] = {u"a\\x.txt", u"a\\b\\y.txt", u"a\\b\\c\\z.txt", u"a\\b\\c\\d\\w.txt"};
+static const char16_t* DeniedDirectory = u"a\\b";
+
+static s32 JoinRoot(char16_t* out, const char16_t* root, s32 root_length, const char16_t* relative)
+{
+    s32 length = root_length;
+    CopyMemory(out, root, root_length * 2);
+    out[length++] = u'\\';
+    while (*relative) out[length++] = *relative++;
+    out[length] = u'\0';
+    return length;
+}
+
+// Replaces the directory's access list, see the SDDL strings below.
+static bool SetAccess(const char16_t* path, const wchar_t* sddl)
+{
+    PSECURITY_DESCRIPTOR descriptor = 0;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &descriptor, 0)) return false;
+    bool result = SetFileSecurityW((LPCWSTR)path, DACL_SECURITY_INFORMATION, descriptor) != 0;
+    LocalFree(descriptor);
+    return result;
+}
+
+static void DiffProc(void* context, DirectoryWatcher::EFileAction action, const char16_t* path, s32 path_length, const DirectorySnapshot::Entry* entry)
+{
+    static const char* ActionNames[] = {"none", "added", "removed", "modified", "renamed from", "renamed to", "too many changes"};
+    *(s32*)context += 1;
+    printf("    %s %.*ls\n", ActionNames[(s32)action], (int)path_length, (const wchar_t*)path);
+}
+
+static s32 CountChanges(const DirectorySnapshot* from, const DirectorySnapshot* to)
+{
+    s32 change_count = 0;
+    DirectorySnapshot::Diff(from, to, DiffProc, &change_count);
+    return change_count;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: SnapshotCheck <empty directory>\n");
+        return 2;
+    }
+
+    char16_t root[MAX_PATH];
+    s32 root_length = MultiByteToWideChar(CP_UTF8, 0, argv[1], -1, (LPWSTR)root, MAX_PATH - 32) - 1;
+    if (root_length <= 0) return 2;
+    while (root_length > 3 && root[root_length - 1] == u'\\') root[--root_length] = u'\0';
+
+    char16_t path[MAX_PATH];
+    CreateDirectoryW((LPCWSTR)root, 0);
+    for (const char16_t* directory : Directories)
+    {
+        JoinRoot(path, root, root_length, directory);
+        CreateDirectoryW((LPCWSTR)path, 0);
+    }
+    for (const char16_t* file : Files)
+    {
+        JoinRoot(path, root, root_length, file);
+        HANDLE handle = CreateFileW((LPCWSTR)path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+    }
+
+    DirectorySnapshot before;
+    if (!before.Scan(root, root_length, true, 0, false, 0))
+    {
+        printf("couldn't scan %s\n", argv[1]);
+        return 2;
+    }
+
+    // Everybody may do anything, except list the directory.
+    JoinRoot(path, root, root_length, DeniedDirectory);
+    if (!SetAccess(path, L"D:P(D;;0x1;;;WD)(A;OICI;FA;;;WD)"))
+    {
+        printf("couldn't change the access list of %ls (error %u)\n", (const wchar_t*)path, (u32)GetLastError());
+        return 2;
+    }
+    DirectorySnapshot denied;
+    denied.Scan(root, root_length, true, &before, false, 0);
+    printf("with %ls unlistable:\n", (const wchar_t*)DeniedDirectory);
+    s32 denied_count = CountChanges(&before, &denied);
+
+    SetAccess(path, L"D:(A;OICI;FA;;;WD)");
+    DirectorySnapshot after;
+    after.Scan(root, root_length, true, &denied, false, 0);
+    printf("with it listable again:\n");
+    s32 after_count = CountChanges(&denied, &after);
+
+    printf("%s: %d changes while denied, %d after (expected 0 and 0)\n", (denied_count || after_count) ? "FAIL" : "PASS", denied_count, after_count);
+    before.Destroy();
+    denied.Destroy();
+    after.Destroy();
+    return (denied_count || after_count) ? 1 : 0;
+}
@@ -0,0 +1,617 @@
+/*
+WatchDaemon owns one DirectoryWatcher and shares it with every process on the machine, over a Unix domain
+socket. Clients use WatchClient (see WatchClient.h, which also describes the protocol): they subscribe to
+roots, and get their changes back in batches. Watches are shared between everybody, so a dozen tools that
+all watch the same repository cost one set of kernel watches and buffers between them.
+
+Each client gets a thread that reads its requests, and one dispatch thread sends changes to everybody. Each
+client subscription is a DirectoryWatcher subscription, with its own queue (capped at --queue-count, after
+which it gets a TooManyChanges instead), so one slow client can't hold up the others for long: a send that
+can't finish within 5 seconds drops the client. The dispatch thread sleeps until a subscription's wakeup
+fires, waits --batch-delay milliseconds for the rest of the burst to come in, then sends everything
+waiting for each subscription as one frame.
+
+Build it along with the library, for example:
+    cl /O2 /std:c++17 /I. tools\WatchDaemon.cpp WatchClient.cpp DirectoryWatcher.cpp DirectorySnapshot.cpp DirectoryCrawler.cpp ChangeJournal.cpp NotificationRecording.cpp SharedChangeRing.cpp Ws2_32.lib Synchronization.lib
+
+Usage:
+    WatchDaemon [options]
+        --socket PATH       Socket to listen on (default %TEMP%\DirectoryWatcher.sock).
+        --history N         Changes kept for clients that come back with a cursor (default 65536).
+        --threads N         Settings::watcher_thread_count (default 1).
+        --buffer-size N     change_buffer_size passed to AddDirectory() (default 65536).
+        --queue-count N     Changes held for each subscription before it gets a TooManyChanges instead (default 65536).
+        --batch-delay N     Milliseconds to let changes pile up before sending them (default 5).
+
+Only one daemon can listen on a socket path. A second one finds the first answering, and exits.
+*/
+
+// NOTE: Winsock has to come before Windows.h, or Windows.h pulls in the old winsock.h and the two clash.
+#include <winsock2.h>
+#include <afunix.h>
+#include "../WatchClient.h"
+#include "../DirectoryWatcherInternal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef DirectoryWatcher::EFileAction EFileAction;
+typedef WatchProtocol::EFrameType EFrameType;
+
+struct Options
+{
+    const char* socket_path = 0;
+    s32 history_count = 65536;
+    s32 thread_count = 1;
+    s32 buffer_size = 65536;
+    s32 queue_count = 65536;
+    s32 batch_delay_ms = 5;
+};
+
+// NOTE: The daemon is the only one adding directories, so a watch's index in watches is also its FileChange::directory_id.
+struct Watch
+{
+    char path[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
+    s32 path_length;
+    bool is_recursive;
+    u64 start_sequence; // The last change pushed before the watch was added. It only takes over changes after this.
+};
+
+struct Client;
+
+struct ClientSubscription
+{
+    u32 id;
+    Client* client;
+    DirectoryWatcher::Subscription* subscription;
+    char root[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
+    s32 root_length;
+    char pattern[DIRECTORY_WATCHER_MAX_PATH_LENGTH];
+    bool has_pattern;
+    bool is_recursive;
+    bool is_in_rename; // The last change read from the history was a wanted RenamedFrom.
+    u32 action_mask;
+    u64 last_sent_sequence; // Live changes up to here were already sent from the history, or came before the subscription.
+    volatile s32 is_armed; // A wakeup is armed, so there's nothing to send until it fires.
+    ClientSubscription* next;
+};
+
+struct FrameWriter
+{
+    SOCKET connection;
+    u32 subscription_id;
+    s32 count;
+    s32 size;
+    u8 data[sizeof(WatchProtocol::FrameHeader) + WatchProtocol::MaxFrameSize];
+
+    bool Add(const DirectoryWatcher::FileChange& change);
+    bool Flush();
+};
+
+struct Client
+{
+    SOCKET connection;
+    SRWLOCK lock; // Held while sending, and while changing the list of subscriptions.
+    ClientSubscription* subscriptions;
+    volatile s32 is_dead;
+    Client* next;
+    FrameWriter writer;
+};
+
+static Options options;
+static DirectoryWatcher watcher = {};
+static SRWLOCK watch_lock = SRWLOCK_INIT;
+static Watch* watches = 0;
+static s32 watch_count = 0;
+static s32 watch_capacity = 0;
+static SRWLOCK client_lock = SRWLOCK_INIT; // Shared while dispatching, exclusive while adding or removing clients.
+static Client* clients = 0;
+static HANDLE wake_event = 0;
+
+static bool IsPathPrefix(const char* prefix, s32 prefix_length, const char* path, s32 path_length)
+{
+    if (prefix_length > path_length) return false;
+    for (s32 i = 0; i < prefix_length; ++i)
+    {
+        if (FoldPathChar(prefix[i]) != FoldPathChar(path[i])) return false;
+    }
+    return prefix_length == path_length || FoldPathChar(path[prefix_length]) == '\\' || FoldPathChar(prefix[prefix_length - 1]) == '\\';
+}
+
+// Whether a path under root is directly in it, rather than further down.
+static bool IsDirectlyUnder(const char* root, s32 root_length, const char* path, s32 path_length)
+{
+    s32 start = (root_length && FoldPathChar(root[root_length - 1]) == '\\') ? root_length : root_length + 1;
+    for (s32 i = start; i < path_length; ++i)
+    {
+        if (FoldPathChar(path[i]) == '\\') return false;
+    }
+    return true;
+}
+
+static bool SendAll(SOCKET connection, const void* data, s32 size)
+{
+    for (s32 sent = 0; sent < size;)
+    {
+        // NOTE: The socket has a send timeout, so a client that stops reading fails here rather than blocking us for good.
+        s32 result = send(connection, (const char*)data + sent, size - sent, 0);
+        if (result <= 0) return false;
+        sent += result;
+    }
+    return true;
+}
+
+static bool ReceiveAll(SOCKET connection, void* data, s32 size)
+{
+    for (s32 received = 0; received < size;)
+    {
+        s32 result = recv(connection, (char*)data + received, size - received, 0);
+        if (result <= 0) return false;
+        received += result;
+    }
+    return true;
+}
+
+static bool SendFrame(Client* client, EFrameType type, const void* payload, s32 size)
+{
+    WatchProtocol::FrameHeader header = {(u32)size, (u32)type};
+    return SendAll(client->connection, &header, sizeof(header)) && SendAll(client->connection, payload, size);
+}
+
+// Called with the client's lock held. The client's own thread notices and cleans up.
+static void DropClient(Client* client)
+{
+    if (InterlockedExchange((LPLONG)&client->is_dead, 1) == 0) shutdown(client->connection, SD_BOTH);
+}
+
+bool FrameWriter::Add(const DirectoryWatcher::FileChange& change)
+{
+    s32 record_size = WatchProtocol::GetRecordSize(change.path_length);
+    if (count && size + record_size > (s32)sizeof(data) && !Flush()) return false;
+    if (!count) size = (s32)(sizeof(WatchProtocol::FrameHeader) + sizeof(WatchProtocol::ChangesHeader));
+
+    WatchProtocol::ChangeRecord record = {};
+    record.sequence = change.sequence;
+    record.root_sequence = change.root_sequence;
+    record.creation_time = change.creation_time;
+    record.modification_time = change.modification_time;
+    record.change_time = change.change_time;
+    record.access_time = change.access_time;
+    record.size = change.size;
+    record.attributes = change.attributes;
+    record.path_length = (u16)change.path_length;
+    record.action = (u8)change.action;
+    record.is_directory = change.is_directory;
+    CopyMemory(data + size, &record, sizeof(record));
+    CopyMemory(data + size + sizeof(record), change.path, change.path_length);
+    ZeroMemory(data + size + sizeof(record) + change.path_length, record_size - sizeof(record) - change.path_length);
+    size += record_size;
+    count += 1;
+    return true;
+}
+
+bool FrameWriter::Flush()
+{
+    if (!count) return true;
+    WatchProtocol::FrameHeader header = {(u32)(size - sizeof(header)), (u32)EFrameType::Changes};
+    WatchProtocol::ChangesHeader changes = {subscription_id, (u32)count};
+    CopyMemory(data, &header, sizeof(header));
+    CopyMemory(data + sizeof(header), &changes, sizeof(changes));
+    s32 total = size;
+    count = 0;
+    size = 0;
+    return SendAll(connection, data, total);
+}
+
+// Whether a change from the history is one the subscription would have got live, the same way DirectoryWatcher::PublishChange() decides.
+static bool MatchesFilter(ClientSubscription* subscription, const DirectoryWatcher::FileChange& change)
+{
+    bool is_wanted = false;
+    if (change.action == EFileAction::TooManyChanges)
+    {
+        is_wanted = !change.path_length || IsPathPrefix(subscription->root, subscription->root_length, change.path, change.path_length) ||
+                    IsPathPrefix(change.path, change.path_length, subscription->root, subscription->root_length);
+    }
+    else if (change.action == EFileAction::RenamedTo && subscription->is_in_rename) is_wanted = true;
+    else
+    {
+        is_wanted = (subscription->action_mask & (1u << (u32)change.action)) &&
+                    IsPathPrefix(subscription->root, subscription->root_length, change.path, change.path_length) &&
+                    (!subscription->has_pattern || MatchesPattern(subscription->pattern, change.path));
+    }
+    if (change.action == EFileAction::RenamedFrom || change.action == EFileAction::RenamedTo) subscription->is_in_rename = is_wanted && change.action == EFileAction::RenamedFrom;
+    return is_wanted;
+}
+
+// A non-recursive subscription can share a recursive watch, so what's further down is filtered out here.
+static bool IsInScope(ClientSubscription* subscription, const DirectoryWatcher::FileChange& change)
+{
+    if (subscription->is_recursive || change.action == EFileAction::TooManyChanges) return true;
+    return IsDirectlyUnder(subscription->root, subscription->root_length, change.path, change.path_length);
+}
+
+// Where watches overlap, each of them reports the same change. Only the outermost one that covers the path (a recursive
+// one, if there's a tie) gets to send it, so every change is sent once however often it really happened.
+// NOTE: A change made while a new outer watch is starting up can be dropped, since the new watch owns it but may not have
+// been listening yet. That's a few milliseconds, once per overlapping subscription.
+static bool IsDuplicate(const DirectoryWatcher::FileChange& change)
+{
+    if (change.action == EFileAction::TooManyChanges || change.directory_id < 0) return false;
+    s32 owner = -1;
+    AcquireSRWLockShared(&watch_lock);
+    for (s32 i = 0; i < watch_count; ++i)
+    {
+        Watch* watch = &watches[i];
+        if (change.sequence <= watch->start_sequence || change.path_length <= watch->path_length) continue;
+        if (!IsPathPrefix(watch->path, watch->path_length, change.path, change.path_length)) continue;
+        if (!watch->is_recursive && !IsDirectlyUnder(watch->path, watch->path_length, change.path, change.path_length)) continue;
+        if (owner < 0 || watch->path_length < watches[owner].path_length || (watch->path_length == watches[owner].path_length && watch->is_recursive)) owner = i;
+    }
+    ReleaseSRWLockShared(&watch_lock);
+    return owner >= 0 && owner != change.directory_id;
+}
+
+// Makes sure something is watching root. A recursive watch covers everything under it, whoever asked for it.
+static bool EnsureWatch(const char* root, s32 root_length, bool is_recursive)
+{
+    bool is_covered = false;
+    AcquireSRWLockExclusive(&watch_lock);
+    for (s32 i = 0; i < watch_count && !is_covered; ++i)
+    {
+        Watch* watch = &watches[i];
+        is_covered = IsPathPrefix(watch->path, watch->path_length, root, root_length) &&
+                     (watch->is_recursive || (!is_recursive && watch->path_length == root_length));
+    }
+    u64 start_sequence = watcher.GetCursor().sequence;
+    if (!is_covered && watcher.AddDirectory(root, is_recursive, options.buffer_size))
+    {
+        if (watch_count == watch_capacity)
+        {
+            watch_capacity = (watch_capacity) ? watch_capacity * 2 : 16;
+            watches = (Watch*)realloc(watches, sizeof(Watch) * watch_capacity);
+            assert(watches);
+        }
+        Watch* watch = &watches[watch_count++];
+        CopyMemory(watch->path, root, root_length);
+        watch->path_length = root_length;
+        watch->is_recursive = is_recursive;
+        watch->start_sequence = start_sequence;
+        printf("watching %s%s\n", root, (is_recursive) ? "" : " (not recursive)");
+        is_covered = true;
+    }
+    ReleaseSRWLockExclusive(&watch_lock);
+    return is_covered;
+}
+
+static void WakeProc(void* context)
+{
+    ClientSubscription* subscription = (ClientSubscription*)context;
+    InterlockedExchange((LPLONG)&subscription->is_armed, 0);
+    SetEvent(wake_event);
+}
+
+// Sends everything waiting for a subscription, then arms its wakeup. Called with the client's lock held.
+static void Dispatch(Client* client, ClientSubscription* subscription)
+{
+    FrameWriter* writer = &client->writer;
+    writer->subscription_id = subscription->id;
+    DirectoryWatcher::FileChange change;
+    while (true)
+    {
+        while (watcher.TryGetNextChange(subscription->subscription, &change))
+        {
+            if (change.sequence && change.sequence <= subscription->last_sent_sequence) continue;
+            if (!IsInScope(subscription, change) || IsDuplicate(change)) continue;
+            if (!writer->Add(change))
+            {
+                DropClient(client);
+                return;
+            }
+        }
+        if (!writer->Flush())
+        {
+            DropClient(client);
+            return;
+        }
+
+        // NOTE: Set before arming, the wakeup can fire before ArmWakeup() even returns.
+        InterlockedExchange((LPLONG)&subscription->is_armed, 1);
+        if (watcher.ArmWakeup(subscription->subscription, WakeProc, subscription)) return;
+        InterlockedExchange((LPLONG)&subscription->is_armed, 0);
+    }
+}
+
+static DWORD __stdcall DispatchProc(void* arg)
+{
+    while (true)
+    {
+        // The timeout is only a backstop, wakeups do the work.
+        WaitForSingleObject(wake_event, 1000);
+        if (options.batch_delay_ms > 0) Sleep(options.batch_delay_ms);
+
+        AcquireSRWLockShared(&client_lock);
+        for (Client* client = clients; client; client = client->next)
+        {
+            if (client->is_dead) continue;
+            AcquireSRWLockExclusive(&client->lock);
+            for (ClientSubscription* subscription = client->subscriptions; subscription && !client->is_dead; subscription = subscription->next)
+            {
+                if (!subscription->is_armed) Dispatch(client, subscription);
+            }
+            ReleaseSRWLockExclusive(&client->lock);
+        }
+        ReleaseSRWLockShared(&client_lock);
+    }
+    return 0;
+}
+
+// Every change gets matched against the pattern under the watcher's push lock, so keep what a client can ask for small.
+static bool IsAcceptablePattern(const char* pattern, s32 pattern_length)
+{
+    s32 star_count = 0;
+    for (s32 i = 0; i < pattern_length; ++i)
+    {
+        if (!pattern[i]) return false;
+        if (pattern[i] == '*' && (i == 0 || pattern[i - 1] != '*')) ++star_count;
+    }
+    return star_count <= WatchProtocol::MaxPatternStars;
+}
+
+static void HandleSubscribe(Client* client, const u8* payload, s32 size)
+{
+    WatchProtocol::SubscribeRequest request;
+    if (size < (s32)sizeof(request)) return;
+    CopyMemory(&request, payload, sizeof(request));
+    if ((s32)(sizeof(request) + request.root_length + request.pattern_length) != size || !request.root_length ||
+        request.root_length >= DIRECTORY_WATCHER_MAX_PATH_LENGTH || request.pattern_length >= DIRECTORY_WATCHER_MAX_PATH_LENGTH) return;
+
+    ClientSubscription* subscription = (ClientSubscription*)calloc(1, sizeof(ClientSubscription));
+    assert(subscription);
+    subscription->id = request.subscription_id;
+    subscription->client = client;
+    subscription->action_mask = request.action_mask;
+    subscription->is_recursive = request.is_recursive != 0;
+    CopyMemory(subscription->root, payload + sizeof(request), request.root_length);
+    subscription->root_length = request.root_length;
+    CopyMemory(subscription->pattern, payload + sizeof(request) + request.root_length, request.pattern_length);
+    subscription->has_pattern = request.pattern_length > 0;
+
+    // Spell the root the same way every time, since change paths start with whatever the watch was added with.
+    for (s32 i = 0; i < subscription->root_length; ++i) subscription->root[i] = (subscription->root[i] == '/') ? '\\' : subscription->root[i];
+    while (subscription->root_length > 3 && subscription->root[subscription->root_length - 1] == '\\') subscription->root[--subscription->root_length] = '\0';
+
+    WatchProtocol::SubscribeReply reply = {request.subscription_id, (u32)WatchProtocol::ESubscribeResult::Failed, 0, 0};
+    bool is_watched = IsAcceptablePattern(subscription->pattern, request.pattern_length) &&
+                      EnsureWatch(subscription->root, subscription->root_length, subscription->is_recursive);
+    if (is_watched)
+    {
+        DirectoryWatcher::SubscriptionFilter filter;
+        filter.path_prefix = subscription->root;
+        filter.path_pattern = (subscription->has_pattern) ? subscription->pattern : 0;
+        filter.action_mask = request.action_mask;
+        filter.max_queue_count = options.queue_count;
+        subscription->subscription = watcher.Subscribe(filter);
+
+        // Everything pushed from here on lands in the subscription's queue, so the history only has to cover up to now.
+        // The few changes that land in both are sent from the history, and skipped when they come up live.
+        DirectoryWatcher::Cursor now = watcher.GetCursor();
+        subscription->last_sent_sequence = now.sequence;
+        reply.result = (u32)WatchProtocol::ESubscribeResult::Changes;
+        reply.instance = now.instance;
+        reply.sequence = now.sequence;
+        if (request.since_instance || request.since_sequence)
+        {
+            DirectoryWatcher::Cursor since = {request.since_instance, request.since_sequence};
+            s32 count = 0;
+            if (watcher.ChangesSince(since, 0, 0, &count, &since) != DirectoryWatcher::EHistoryResult::Changes) reply.result = (u32)WatchProtocol::ESubscribeResult::FreshInstance;
+        }
+    }
+
+    AcquireSRWLockExclusive(&client->lock);
+    if (!SendFrame(client, EFrameType::Subscribed, &reply, sizeof(reply))) DropClient(client);
+    if (reply.result == (u32)WatchProtocol::ESubscribeResult::Changes && (request.since_instance || request.since_sequence) && !client->is_dead)
+    {
+        // Send what was missed, then let the dispatcher carry on from where the history stops.
+        static const s32 BatchCount = 64;
+        DirectoryWatcher::FileChange* batch = (DirectoryWatcher::FileChange*)malloc(sizeof(DirectoryWatcher::FileChange) * BatchCount);
+        assert(batch);
+        FrameWriter* writer = &client->writer;
+        writer->subscription_id = subscription->id;
+        DirectoryWatcher::Cursor cursor = {request.since_instance, request.since_sequence};
+        bool is_ok = true;
+        while (is_ok && cursor.sequence < subscription->last_sent_sequence)
+        {
+            s32 count = 0;
+            if (watcher.ChangesSince(cursor, batch, BatchCount, &count, &cursor) != DirectoryWatcher::EHistoryResult::Changes)
+            {
+                // It fell out of the history while we were sending it. All we can say now is that anything may have changed.
+                DirectoryWatcher::FileChange overflow = {};
+                overflow.action = EFileAction::TooManyChanges;
+                is_ok = writer->Add(overflow);
+                break;
+            }
+            if (!count) break;
+            for (s32 i = 0; i < count && is_ok; ++i)
+            {
+                if (batch[i].sequence > subscription->last_sent_sequence) break;
+                if (MatchesFilter(subscription, batch[i]) && IsInScope(subscription, batch[i]) && !IsDuplicate(batch[i])) is_ok = writer->Add(batch[i]);
+            }
+        }
+        if (!is_ok || !writer->Flush()) DropClient(client);
+        free(batch);
+    }
+
+    if (is_watched)
+    {
+        subscription->next = client->subscriptions;
+        client->subscriptions = subscription;
+    }
+    else free(subscription);
+    ReleaseSRWLockExclusive(&client->lock);
+    if (is_watched) SetEvent(wake_event); // Anything already queued for it goes out right away.
+}
+
+static void HandleUnsubscribe(Client* client, u32 subscription_id)
+{
+    AcquireSRWLockExclusive(&client->lock);
+    ClientSubscription** link = &client->subscriptions;
+    while (*link && (*link)->id != subscription_id) link = &(*link)->next;
+    ClientSubscription* subscription = *link;
+    if (subscription) *link = subscription->next;
+    ReleaseSRWLockExclusive(&client->lock);
+
+    // NOTE: Unsubscribe() waits out a wakeup that's running, so nothing points at it once this returns.
+    if (subscription) watcher.Unsubscribe(subscription->subscription);
+    free(subscription);
+}
+
+static DWORD __stdcall ClientProc(void* arg)
+{
+    Client* client = (Client*)arg;
+    u8* payload = (u8*)malloc(WatchProtocol::MaxFrameSize);
+    assert(payload);
+
+    WatchProtocol::FrameHeader header;
+    WatchProtocol::Hello hello;
+    bool is_ok = ReceiveAll(client->connection, &header, sizeof(header)) && header.type == (u32)EFrameType::Hello && header.size == sizeof(hello) &&
+                 ReceiveAll(client->connection, &hello, sizeof(hello)) && hello.magic == WatchProtocol::Magic && hello.version == WatchProtocol::Version;
+    if (is_ok)
+    {
+        hello = {WatchProtocol::Magic, WatchProtocol::Version};
+        AcquireSRWLockExclusive(&client->lock);
+        is_ok = SendFrame(client, EFrameType::Hello, &hello, sizeof(hello));
+        ReleaseSRWLockExclusive(&client->lock);
+    }
+
+    while (is_ok && ReceiveAll(client->connection, &header, sizeof(header)))
+    {
+        if (header.size > (u32)WatchProtocol::MaxFrameSize || !ReceiveAll(client->connection, payload, header.size)) break;
+        if (header.type == (u32)EFrameType::Subscribe) HandleSubscribe(client, payload, header.size);
+        else if (header.type == (u32)EFrameType::Unsubscribe && header.size == sizeof(u32)) HandleUnsubscribe(client, *(u32*)payload);
+    }
+
+    // Gone. Take it out of the list first, so the dispatcher can't be looking at it while it's freed.
+    AcquireSRWLockExclusive(&client_lock);
+    Client** link = &clients;
+    while (*link != client) link = &(*link)->next;
+    *link = client->next;
+    ReleaseSRWLockExclusive(&client_lock);
+
+    while (client->subscriptions)
+    {
+        ClientSubscription* subscription = client->subscriptions;
+        client->subscriptions = subscription->next;
+        watcher.Unsubscribe(subscription->subscription);
+        free(subscription);
+    }
+    closesocket(client->connection);
+    free(client);
+    free(payload);
+    return 0;
+}
+
+static bool ParseOptions(int argc, char** argv, Options* options)
+{
+    for (s32 i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc) return false;
+        s32 value = atoi(argv[i + 1]);
+        if (!strcmp(argv[i], "--socket")) options->socket_path = argv[i + 1];
+        else if (!strcmp(argv[i], "--history")) options->history_count = value;
+        else if (!strcmp(argv[i], "--threads")) options->thread_count = value;
+        else if (!strcmp(argv[i], "--buffer-size")) options->buffer_size = value;
+        else if (!strcmp(argv[i], "--queue-count")) options->queue_count = value;
+        else if (!strcmp(argv[i], "--batch-delay")) options->batch_delay_ms = value;
+        else return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (!ParseOptions(argc, argv, &options))
+    {
+        printf("usage: WatchDaemon [--socket PATH] [--history N] [--threads N] [--buffer-size N] [--queue-count N] [--batch-delay N]\n");
+        return 1;
+    }
+    char default_path[MAX_PATH];
+    if (!options.socket_path)
+    {
+        if (!WatchProtocol::GetDefaultSocketPath(default_path, MAX_PATH)) return 1;
+        options.socket_path = default_path;
+    }
+    SOCKADDR_UN address = {};
+    address.sun_family = AF_UNIX;
+    size_t path_length = strlen(options.socket_path);
+    if (path_length >= sizeof(address.sun_path))
+    {
+        printf("socket path too long: %s\n", options.socket_path);
+        return 1;
+    }
+    CopyMemory(address.sun_path, options.socket_path, path_length);
+
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data))
+    {
+        printf("couldn't start Winsock\n");
+        return 1;
+    }
+
+    // Somebody answering means there's a daemon already. Otherwise the file is left over from one that died.
+    SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool is_running = probe != INVALID_SOCKET && connect(probe, (const sockaddr*)&address, sizeof(address)) != SOCKET_ERROR;
+    if (probe != INVALID_SOCKET) closesocket(probe);
+    if (is_running)
+    {
+        printf("a daemon is already listening on %s\n", options.socket_path);
+        return 1;
+    }
+    DeleteFileA(options.socket_path);
+
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET || bind(listener, (const sockaddr*)&address, sizeof(address)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        printf("couldn't listen on %s (error %d)\n", options.socket_path, WSAGetLastError());
+        return 1;
+    }
+
+    DirectoryWatcher::Settings settings;
+    settings.history_count = options.history_count;
+    settings.watcher_thread_count = options.thread_count;
+    settings.use_default_queue = false; // Everything goes out through subscriptions.
+    watcher.Initialize(settings);
+    wake_event = CreateEventW(0, false, false, 0);
+    HANDLE dispatch_thread = CreateThread(0, 0, DispatchProc, 0, 0, 0);
+    CloseHandle(dispatch_thread);
+    printf("listening on %s\n", options.socket_path);
+
+    while (true)
+    {
+        SOCKET connection = accept(listener, 0, 0);
+        if (connection == INVALID_SOCKET) continue;
+        DWORD timeout_ms = 5000;
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout_ms, sizeof(timeout_ms));
+
+        Client* client = (Client*)calloc(1, sizeof(Client)); // Zeroed is SRWLOCK_INIT too.
+        assert(client);
+        client->connection = connection;
+        client->writer.connection = connection;
+        AcquireSRWLockExclusive(&client_lock);
+        client->next = clients;
+        clients = client;
+        ReleaseSRWLockExclusive(&client_lock);
+
+        HANDLE thread = CreateThread(0, 0, ClientProc, client, 0, 0);
+        if (thread)
+        {
+            CloseHandle(thread);
+            continue;
+        }
+        AcquireSRWLockExclusive(&client_lock);
+        clients = client->next;
+        ReleaseSRWLockExclusive(&client_lock);
+        closesocket(connection);
+        free(client);
+    }
+    return 0;
+}